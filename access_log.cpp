@@ -0,0 +1,149 @@
+#include "access_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "log.h"
+
+bool AccessLog::enabled_ = false;
+
+namespace {
+
+char access_dir[256];
+int segment_records = AccessLog::DEFAULT_SEGMENT_RECORDS;
+
+// 每个线程一个写入者，独占自己的段文件和URL表
+class AccessLogWriter {
+public:
+  AccessLogWriter() : tid_(syscall(SYS_gettid)), seq_(0), header_(nullptr), map_len_(0),
+                      urls_fd_(-1), next_url_id_(1) {}
+  void Append(AccessRecord* record, const char* url);
+
+private:
+  bool OpenSegment();
+  uint32_t Intern(const char* url);
+
+  int tid_;
+  uint32_t seq_;
+  AccessLogHeader* header_;    // 当前段的映射，写满之后换下一个段
+  AccessRecord* records_;
+  size_t map_len_;
+  int urls_fd_;
+  uint32_t next_url_id_;
+  // URL表，键指向strings_中保存的字符串
+  std::unordered_map<std::string_view, uint32_t> url_ids_;
+  std::deque<std::string> strings_;
+};
+
+bool AccessLogWriter::OpenSegment() {
+  if (header_) {
+    munmap(header_, map_len_);
+    header_ = nullptr;
+    ++seq_;
+  }
+  char path[512];
+  snprintf(path, sizeof(path), "%s/access_%d_%d_%u.bin", access_dir, getpid(), tid_, seq_);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  map_len_ = sizeof(AccessLogHeader) + (size_t)segment_records * sizeof(AccessRecord);
+  // 预先分配磁盘空间，写记录时不会因为文件扩展而缺页阻塞在分配块上
+  if (posix_fallocate(fd, 0, map_len_) != 0) {
+    close(fd);
+    return false;
+  }
+  void* addr = mmap(NULL, map_len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);  // 映射建立后就不再需要fd
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  madvise(addr, map_len_, MADV_SEQUENTIAL);
+  header_ = (AccessLogHeader*)addr;
+  records_ = (AccessRecord*)(header_ + 1);
+  memcpy(header_->magic, ACCESS_LOG_MAGIC, sizeof(header_->magic));
+  header_->record_size = sizeof(AccessRecord);
+  header_->capacity = segment_records;
+  header_->count = 0;
+  header_->pid = getpid();
+  header_->tid = tid_;
+  header_->seq = seq_;
+  return true;
+}
+
+uint32_t AccessLogWriter::Intern(const char* url) {
+  if (!url) {
+    return 0;
+  }
+  size_t len = strnlen(url, AccessLog::MAX_URL_LEN);
+  std::unordered_map<std::string_view, uint32_t>::iterator it =
+      url_ids_.find(std::string_view(url, len));
+  if (it != url_ids_.end()) {
+    return it->second;
+  }
+  if (next_url_id_ > AccessLog::MAX_URLS) {
+    return 0;  // URL表已满，不再记录新的URL
+  }
+  if (urls_fd_ < 0) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/access_%d_%d.urls", access_dir, getpid(), tid_);
+    urls_fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (urls_fd_ < 0) {
+      return 0;
+    }
+  }
+  // 新的URL只出现一次，直接写入URL表文件
+  uint32_t id = next_url_id_++;
+  char entry[8 + AccessLog::MAX_URL_LEN];
+  uint32_t len32 = len;
+  memcpy(entry, &id, 4);
+  memcpy(entry + 4, &len32, 4);
+  memcpy(entry + 8, url, len);
+  if (write(urls_fd_, entry, 8 + len) != (ssize_t)(8 + len)) {
+    return 0;
+  }
+  strings_.emplace_back(url, len);
+  url_ids_.emplace(std::string_view(strings_.back()), id);
+  return id;
+}
+
+void AccessLogWriter::Append(AccessRecord* record, const char* url) {
+  if ((!header_ || header_->count == header_->capacity) && !OpenSegment()) {
+    return;
+  }
+  record->url_id = Intern(url);
+  records_[header_->count] = *record;
+  // 解码时以count为准，记录写完之后才增加
+  __atomic_store_n(&header_->count, header_->count + 1, __ATOMIC_RELEASE);
+}
+
+}  // namespace
+
+bool AccessLog::Init(const char* dir, int records) {
+  if (!dir) {
+    return true;
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return false;
+  }
+  snprintf(access_dir, sizeof(access_dir), "%s", dir);
+  segment_records = records;
+  enabled_ = true;
+  LOG_INFO("访问日志写入%s，每个段%d条记录", dir, records);
+  return true;
+}
+
+void AccessLog::Append(AccessRecord* record, const char* url) {
+  static thread_local AccessLogWriter writer;
+  writer.Append(record, url);
+}
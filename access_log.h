@@ -0,0 +1,64 @@
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <stdint.h>
+
+// 二进制访问日志中的一条记录，定长48字节
+// 每个线程写自己的段文件(见AccessLog)，写入只是一次内存拷贝，不需要加锁也没有系统调用
+struct AccessRecord {
+  int64_t time_us;       // 收到请求数据的时间(UNIX时间，微秒)
+  uint64_t bytes;        // 响应的字节数(头部+实体)
+  uint32_t client_ip;    // 客户端地址(网络字节序)
+  uint32_t url_id;       // URL在本线程URL表中的编号，0表示未知(请求行有误或者URL表已满)
+  uint32_t wait_us;      // 收到数据到开始处理(请求队列中的等待)
+  uint32_t parse_us;     // 解析请求行和头部
+  uint32_t handle_us;    // 查找文件和生成响应
+  uint16_t client_port;  // 网络字节序
+  uint16_t status;       // 响应状态码
+  uint8_t method;        // HttpConn::METHOD
+  uint8_t flags;         // ACCESS_KEEP_ALIVE等
+  uint8_t reserved[6];
+};
+
+static_assert(sizeof(AccessRecord) == 48, "AccessRecord must be 48 bytes");
+
+enum ACCESS_FLAG {ACCESS_KEEP_ALIVE = 1, ACCESS_RANGE = 2};
+
+// 段文件的头部，之后紧跟capacity条记录
+struct AccessLogHeader {
+  char magic[8];         // ACCESS_LOG_MAGIC
+  uint32_t record_size;  // sizeof(AccessRecord)
+  uint32_t capacity;     // 段中的记录数上限
+  uint64_t count;        // 已经写入的记录数
+  int32_t pid;
+  int32_t tid;
+  uint32_t seq;          // 段的序号
+  char reserved[28];
+};
+
+static_assert(sizeof(AccessLogHeader) == 64, "AccessLogHeader must be 64 bytes");
+
+#define ACCESS_LOG_MAGIC "WSACLOG1"
+
+// 文件布局(dir下):
+//   access_<pid>_<tid>_<seq>.bin  预先分配好的段文件，通过mmap写入，写满后换下一个段
+//   access_<pid>_<tid>.urls       该线程的URL表，每项为 uint32 id, uint32 len, len字节的URL，
+//                                 只有第一次出现的URL才会追加
+// 离线用 make accesslog-decode 生成的 tools/accesslog-decode 转换成文本或CSV
+class AccessLog {
+public:
+  static const int DEFAULT_SEGMENT_RECORDS = 1 << 18;   // 每个段的记录数(12MB)
+  static const int MAX_URLS = 1 << 16;                  // 每个线程URL表的上限
+  static const int MAX_URL_LEN = 256;                   // 更长的URL被截断
+
+  // 在工作线程创建之前调用，dir为NULL时不记录访问日志
+  static bool Init(const char* dir, int segment_records = DEFAULT_SEGMENT_RECORDS);
+  static bool Enabled() { return enabled_; }
+  // 把记录追加到当前线程的段中，url为NULL时记为未知
+  static void Append(AccessRecord* record, const char* url);
+
+private:
+  static bool enabled_;
+};
+
+#endif
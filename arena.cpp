@@ -0,0 +1,105 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+namespace {
+
+std::atomic<uint64_t> heap_allocations(0);
+
+// 每个线程的空闲块，线程退出时释放
+struct BlockPool {
+  void* free = nullptr;     // 空闲块组成的链表，块的前8个字节是next指针
+  int count = 0;
+
+  ~BlockPool() {
+    while (free) {
+      void* next = *(void**)free;
+      ::free(free);
+      free = next;
+    }
+  }
+
+  void* Get() {
+    if (free) {
+      void* block = free;
+      free = *(void**)block;
+      --count;
+      return block;
+    }
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(Arena::BLOCK_SIZE);
+  }
+
+  void Put(void* block) {
+    if (count >= Arena::MAX_POOLED_BLOCKS) {
+      ::free(block);    // 连接在线程之间迁移，块都还给了同一个线程时不再缓存
+      return;
+    }
+    *(void**)block = free;
+    free = block;
+    ++count;
+  }
+};
+
+thread_local BlockPool pool;
+
+}  // namespace
+
+void* Arena::AllocateSlow(size_t size, size_t align) {
+  size_t header = (sizeof(Block) + align - 1) & ~(align - 1);
+  size_t block_size = BLOCK_SIZE;
+  void* memory;
+  if (header + size > BLOCK_SIZE) {
+    block_size = header + size;
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    memory = malloc(block_size);
+  } else {
+    memory = pool.Get();
+  }
+  if (!memory) {
+    return nullptr;
+  }
+  Block* block = (Block*)memory;
+  block->size = block_size;
+  if (block_size > BLOCK_SIZE && head_) {
+    // 大块放在当前块后面，当前块剩下的空间还可以继续使用
+    block->next = head_->next;
+    head_->next = block;
+  } else {
+    block->next = head_;
+    head_ = block;
+    ptr_ = (char*)block + header + size;
+    end_ = (char*)block + block_size;
+  }
+  used_ += size;
+  return (char*)block + header;
+}
+
+char* Arena::Copy(const char* data, size_t len) {
+  char* p = (char*)Allocate(len + 1, 1);
+  if (p) {
+    memcpy(p, data, len);
+    p[len] = '\0';
+  }
+  return p;
+}
+
+void Arena::Reset() {
+  while (head_) {
+    Block* next = head_->next;
+    if (head_->size == BLOCK_SIZE) {
+      pool.Put(head_);
+    } else {
+      free(head_);
+    }
+    head_ = next;
+  }
+  ptr_ = end_ = nullptr;
+  used_ = 0;
+}
+
+uint64_t Arena::HeapAllocations() {
+  return heap_allocations.load(std::memory_order_relaxed);
+}
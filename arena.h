@@ -0,0 +1,53 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 连接上请求处理期间的内存分配器(请求头表、解码后的URL、路由参数、动态生成的响应实体等)
+// 从当前的块中顺序分配，不单独释放，发送队列清空或者连接重新初始化时Reset()整体回收；
+// 块取自当前线程的块池，Reset()时还给执行Reset()的线程，稳定状态下不会调用全局的malloc/free
+class Arena {
+public:
+  static const size_t BLOCK_SIZE = 64 * 1024;         // 块池中每个块的大小(包括块头)，能放下/metrics的实体
+  static const int MAX_POOLED_BLOCKS = 16;            // 每个线程的块池最多缓存的块数
+
+  Arena() : head_(nullptr), ptr_(nullptr), end_(nullptr), used_(0) {}
+  ~Arena() { Reset(); }
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // 分配size字节，超过一个块的大小时单独向全局分配器申请，Reset()时释放
+  void* Allocate(size_t size, size_t align = alignof(max_align_t));
+  char* Copy(const char* data, size_t len);           // 拷贝一段数据(末尾加'\0')
+  void Reset();                                       // 释放所有分配，块还给当前线程的块池
+  size_t Used() const { return used_; }               // 自上次Reset()以来分配的字节数
+
+  // 进程启动以来向全局分配器申请的块数(块池不够或者大块分配)，稳定状态下不应增长
+  static uint64_t HeapAllocations();
+
+private:
+  struct Block {
+    Block* next;
+    size_t size;        // 整个块的大小，BLOCK_SIZE的块还给块池，其他的直接释放
+  };
+
+  void* AllocateSlow(size_t size, size_t align);
+
+  Block* head_;         // 已经使用的块，head_是当前的块
+  char* ptr_;           // 当前块中下一个可用的位置
+  char* end_;
+  size_t used_;
+};
+
+inline void* Arena::Allocate(size_t size, size_t align) {
+  uintptr_t p = ((uintptr_t)ptr_ + align - 1) & ~(uintptr_t)(align - 1);
+  if (ptr_ && p + size <= (uintptr_t)end_) {
+    ptr_ = (char*)(p + size);
+    used_ += size;
+    return (void*)p;
+  }
+  return AllocateSlow(size, align);
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef BENCH_BENCH_H_
+#define BENCH_BENCH_H_
+
+// 微基准测试的公共函数
+// 每个结果输出为一行JSON，make bench把所有结果汇总到bench/results.json，
+// 不同提交的结果可以直接diff或者用jq按bench+case+param对比
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+inline int64_t BenchNowNs(clockid_t clock = CLOCK_MONOTONIC) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// param为该用例的规模(定时器数、线程数等)，没有时为0
+inline void BenchReport(const char* bench, const char* name, int param, double value,
+                        const char* unit) {
+  printf("{\"bench\":\"%s\",\"case\":\"%s\",\"param\":%d,\"value\":%.1f,\"unit\":\"%s\"}\n",
+         bench, name, param, value, unit);
+  fflush(stdout);
+}
+
+#endif
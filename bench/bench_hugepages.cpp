@@ -0,0 +1,100 @@
+// 连接表使用大页和普通页的对比:
+// 按服务器的布局分配MAX_FD个HttpConn大小的槽位，随机地访问各个槽位的读缓冲区和写缓冲区
+// (模拟大量连接上的Read()/ParseLine()/生成响应)，统计每次访问的耗时，
+// 内核允许时同时用perf_event_open统计dTLB缺失(每千次访问)
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "../http_conn.h"
+#include "../huge_pages.h"
+#include "bench.h"
+
+namespace {
+
+const int SLOTS = 65535;          // 与main.cpp中的MAX_FD相同
+const int ACCESSES = 20000000;
+
+// dTLB读缺失计数器，不支持时返回-1
+int OpenDtlbCounter() {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// 槽位之间按随机的顺序串成一个环，每次访问依赖上一次读到的下标，避免预取和并行的访存
+void RunCase(bool enable) {
+  const size_t stride = sizeof(HttpConn);
+  const size_t bytes = stride * SLOTS;
+  HUGE_BACKING backing;
+  char* table = (char*)HugePages::Alloc(bytes, enable, &backing);
+  if (!table) {
+    perror("HugePages::Alloc");
+    return;
+  }
+  std::vector<int> order(SLOTS);
+  for (int i = 0; i < SLOTS; ++i) {
+    order[i] = i;
+  }
+  uint64_t seed = 88172645463325252ULL;
+  for (int i = SLOTS - 1; i > 0; --i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    std::swap(order[i], order[seed % (i + 1)]);
+  }
+  // 下标放在读缓冲区的开头，访问时再读写缓冲区中的一个字节
+  const size_t read_offset = 64;
+  const size_t write_offset = read_offset + HttpConn::READ_BUFFER_SIZE + 512;
+  for (int i = 0; i < SLOTS; ++i) {
+    char* slot = table + (size_t)order[i] * stride;
+    *(int*)(slot + read_offset) = order[(i + 1) % SLOTS];
+    slot[write_offset] = 1;
+  }
+
+  int counter = OpenDtlbCounter();
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  int index = order[0];
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < ACCESSES; ++i) {
+    char* slot = table + (size_t)index * stride;
+    index = *(volatile int*)(slot + read_offset);
+    *(volatile char*)(slot + write_offset) += 1;
+  }
+  double ns = (double)(BenchNowNs() - start) / ACCESSES;
+  const char* name = HugePages::Name(backing);
+  BenchReport("hugepages", name, SLOTS, ns, "ns/access");
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t misses = 0;
+    if (read(counter, &misses, sizeof(misses)) == sizeof(misses)) {
+      BenchReport("hugepages_dtlb", name, SLOTS, misses * 1000.0 / ACCESSES,
+                  "misses/1000 accesses");
+    }
+    close(counter);
+  }
+  HugePages::Free(table, bytes);
+}
+
+}  // namespace
+
+int main() {
+  RunCase(false);
+  RunCase(true);
+  return 0;
+}
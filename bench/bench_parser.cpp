@@ -0,0 +1,255 @@
+// HTTP请求处理的微基准测试:
+// 通过socketpair把内存中的请求报文交给HttpConn，走与服务器相同的Read()/Process()路径
+// (解析、匹配路由、查找文件或者调用处理函数、生成响应并发送)，统计每个请求的耗时(纳秒，包括两端的系统调用)
+// 同时统计计时循环中的堆分配次数，稳定状态下的请求以及建立和关闭连接都不应该调用malloc，否则以1退出
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "../http_conn.h"
+#include "bench.h"
+
+extern const char* doc_root;   // http_conn.cpp
+
+// 替换malloc系列函数统计堆分配次数(operator new也经过malloc)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+std::atomic<long> heap_allocations(0);
+
+extern "C" void* malloc(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+namespace {
+
+const int ITERATIONS = 100000;
+
+struct Case {
+  const char* name;
+  const char* request;
+  int pipeline;          // 一次发送的请求个数
+};
+
+const Case cases[] = {
+  {"get_404",
+   "GET /missing.html HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n\r\n", 1},
+  {"get_200",
+   "GET /index.html HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n\r\n", 1},
+  {"get_browser_headers",
+   "GET /index.html HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+   "Chrome/120.0 Safari/537.36\r\n"
+   "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+   "Accept-Encoding: gzip, deflate, br\r\nAccept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+   "Cache-Control: max-age=0\r\nUpgrade-Insecure-Requests: 1\r\n"
+   "Cookie: session=0123456789abcdef; theme=dark\r\n\r\n", 1},
+  {"get_range",
+   "GET /index.html HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n"
+   "Range: bytes=0-99\r\n\r\n", 1},
+  {"get_metrics",
+   "GET /metrics HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n\r\n", 1},
+  {"get_healthz",
+   "GET /healthz HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n\r\n", 1},
+  {"get_route_params",
+   "GET /api/users/42/orders/7?fields=id HTTP/1.1\r\nHost: localhost:9006\r\n"
+   "Connection: keep-alive\r\n\r\n", 1},
+  {"pipelined_8_404",
+   "GET /missing.html HTTP/1.1\r\nHost: localhost:9006\r\nConnection: keep-alive\r\n\r\n", 8},
+};
+
+char response[256 * 1024];
+
+// 带参数的路由，生成一个小的JSON响应
+bool OrderHandler(const RouteRequest& request, RouteResponse* response, void* arg) {
+  const RouteParam* user = request.Param("user");
+  const RouteParam* order = request.Param("order");
+  char buf[128];
+  int len = snprintf(buf, sizeof(buf), "{\"user\":%.*s,\"order\":%.*s}\n",
+                     user->len, user->value, order->len, order->value);
+  response->SetContentType("application/json");
+  response->Append(buf, len);
+  return true;
+}
+
+// 除了内置的路由之外再注册一些路由，静态文件的请求也要经过路由的匹配
+bool AddRoutes() {
+  static const char* paths[] = {"/api/users/:user", "/api/users/:user/profile",
+                                "/api/orders/:order", "/static/*path", "/status"};
+  for (const char* path : paths) {
+    if (!Router::Add(HttpConn::GET, path, OrderHandler, NULL)) {
+      return false;
+    }
+  }
+  return HttpConn::InitRoutes() &&
+         Router::Add(HttpConn::GET, "/api/users/:user/orders/:order", OrderHandler, NULL);
+}
+
+// 读出客户端一侧收到的所有响应，返回字节数
+int Drain(int fd) {
+  int total = 0;
+  while (true) {
+    int n = recv(fd, response, sizeof(response), 0);
+    if (n <= 0) {
+      return total;
+    }
+    total += n;
+  }
+}
+
+// 主线程读到请求之后交给"工作线程"处理，这里在同一个线程中依次执行
+void Serve(HttpConn* conn) {
+  if (conn->Acquire(HttpConn::CONN_IN) && conn->HandleEvents(HttpConn::CONN_IN)) {
+    conn->Process();
+  }
+}
+
+// 返回每个请求的纳秒数，allocs返回计时循环中每个请求的堆分配次数
+double RunCase(HttpConn* conn, int client, const Case& c, double* allocs) {
+  std::string batch;
+  for (int i = 0; i < c.pipeline; ++i) {
+    batch += c.request;
+  }
+  // 预热，同时确认服务器一侧正常响应
+  send(client, batch.data(), batch.size(), 0);
+  Serve(conn);
+  if (Drain(client) <= 0) {
+    fprintf(stderr, "%s: 没有收到响应\n", c.name);
+    exit(1);
+  }
+  long allocations = heap_allocations.load();
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    send(client, batch.data(), batch.size(), 0);
+    Serve(conn);
+    Drain(client);
+  }
+  int64_t elapsed = BenchNowNs() - start;
+  *allocs = (double)(heap_allocations.load() - allocations) / ITERATIONS / c.pipeline;
+  return (double)elapsed / ITERATIONS / c.pipeline;
+}
+
+// 单独统计路由匹配的耗时，静态文件的请求在DoRequest()中多出的就是一次没有匹配的Match()
+double RunMatch(const char* url) {
+  RouteRequest request;
+  const int iterations = ITERATIONS * 10;
+  long matched = 0;
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < iterations; ++i) {
+    matched += Router::Match(HttpConn::GET, url, &request) != NULL;
+  }
+  int64_t elapsed = BenchNowNs() - start;
+  if (matched != 0 && matched != iterations) {
+    fprintf(stderr, "%s: 匹配的结果不稳定\n", url);
+    exit(1);
+  }
+  return (double)elapsed / iterations;
+}
+
+// 建立和关闭连接(Init()和CloseConn()，包括定时器的加入和取下)，allocs同上
+double RunConnCycle(HttpConn* conn, double* allocs) {
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  const int iterations = ITERATIONS / 10;
+  int64_t elapsed = 0;
+  long allocations = heap_allocations.load();
+  for (int i = 0; i < iterations; ++i) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int64_t start = BenchNowNs();
+    conn->Init(sv[0], addr);
+    if (conn->Acquire(HttpConn::CONN_HUP)) {
+      conn->CloseConn();
+    }
+    elapsed += BenchNowNs() - start;
+    close(sv[1]);
+  }
+  *allocs = (double)(heap_allocations.load() - allocations) / iterations;
+  return (double)elapsed / iterations;
+}
+
+}  // namespace
+
+int main() {
+  // 在临时目录中准备网站根目录
+  char root[] = "/tmp/bench_parser_XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string index = std::string(root) + "/index.html";
+  int fd = open(index.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  std::string page(1024, 'x');
+  write(fd, page.data(), page.size());
+  close(fd);
+  doc_root = root;
+
+  ResponseTemplate::Init();
+  if (!AddRoutes()) {
+    fprintf(stderr, "路由注册失败\n");
+    return 1;
+  }
+  HttpConn::epollfd_ = epoll_create1(0);
+  HttpConn::max_keep_alive_requests_ = INT_MAX;   // 所有请求都在同一个连接上发送
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+  fcntl(sv[1], F_SETFL, O_NONBLOCK);
+  HttpConn* conn = new HttpConn;
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  conn->Init(sv[0], addr);
+
+  bool allocated = false;
+  for (const Case& c : cases) {
+    double allocs;
+    BenchReport("parser", c.name, c.pipeline, RunCase(conn, sv[1], c, &allocs), "ns/request");
+    BenchReport("parser_allocs", c.name, c.pipeline, allocs, "allocs/request");
+    if (allocs > 0) {
+      fprintf(stderr, "%s: 稳定状态下每个请求有%.3f次堆分配\n", c.name, allocs);
+      allocated = true;
+    }
+  }
+
+  if (conn->Acquire(HttpConn::CONN_HUP)) {
+    conn->CloseConn();
+  }
+  close(sv[1]);
+
+  BenchReport("route_match", "static_miss", 1, RunMatch("/index.html"), "ns/match");
+  BenchReport("route_match", "api_miss", 1, RunMatch("/api/users/42/settings"), "ns/match");
+  BenchReport("route_match", "params", 2, RunMatch("/api/users/42/orders/7?fields=id"), "ns/match");
+
+  double allocs;
+  BenchReport("conn", "init_close", 1, RunConnCycle(conn, &allocs), "ns/connection");
+  BenchReport("conn_allocs", "init_close", 1, allocs, "allocs/connection");
+  if (allocs > 0) {
+    fprintf(stderr, "建立和关闭连接时每个连接有%.3f次堆分配\n", allocs);
+    allocated = true;
+  }
+  unlink(index.c_str());
+  rmdir(root);
+  return allocated ? 1 : 0;
+}
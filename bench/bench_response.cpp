@@ -0,0 +1,129 @@
+// 响应报文头部组装的微基准测试:
+// 对比原来的vsnprintf方式和预先生成模板+memcpy方式，每个响应所消耗的CPU时间
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../response_template.h"
+#include "bench.h"
+
+const int WRITE_BUFFER_SIZE = 1024;
+const int ITERATIONS = 1000000;
+
+struct Buffer {
+  char data[WRITE_BUFFER_SIZE];
+  int len;
+};
+
+// ---------------- 原来的实现(vsnprintf) ----------------
+bool AddResponse(Buffer* buf, const char* format, ...) {
+  va_list arg_list;
+  va_start(arg_list, format);
+  int len = vsnprintf(buf->data + buf->len, WRITE_BUFFER_SIZE - 1 - buf->len, format, arg_list);
+  va_end(arg_list);
+  if (len >= (WRITE_BUFFER_SIZE - 1 - buf->len)) {
+    return false;
+  }
+  buf->len += len;
+  return true;
+}
+
+void LegacyFileHeader(Buffer* buf, const struct stat& st) {
+  char date[64];
+  struct tm tm;
+  gmtime_r(&st.st_mtime, &tm);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  AddResponse(buf, "%s %d %s\r\n", "HTTP/1.1", 200, "OK");
+  AddResponse(buf, "Content-Length: %d\r\n", (int)st.st_size);
+  AddResponse(buf, "Connection: %s\r\n", "keep-alive");
+  AddResponse(buf, "Content-Type:%s\r\n", "text/html");
+  AddResponse(buf, "Accept-Ranges: bytes\r\nETag: \"%lx-%lx\"\r\nLast-Modified: %s\r\n",
+              (long)st.st_mtime, (long)st.st_size, date);
+  AddResponse(buf, "%s", "\r\n");
+}
+
+void LegacyErrorResponse(Buffer* buf) {
+  const char* form = "The requested file was not found on thi server.\n";
+  AddResponse(buf, "%s %d %s\r\n", "HTTP/1.1", 404, "Not Found");
+  AddResponse(buf, "Content-Length: %d\r\n", (int)strlen(form));
+  AddResponse(buf, "Connection: %s\r\n", "keep-alive");
+  AddResponse(buf, "Content-Type:%s\r\n", "text/html");
+  AddResponse(buf, "%s", "\r\n");
+  AddResponse(buf, "%s", form);
+}
+
+// ---------------- 模板+memcpy(与HttpConn中的实现相同) ----------------
+inline void AddPiece(Buffer* buf, const char* data, int len) {
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+inline void AddPiece(Buffer* buf, Piece piece) {
+  AddPiece(buf, piece.data, piece.len);
+}
+
+void TemplateFileHeader(Buffer* buf, const struct stat& st) {
+  AddPiece(buf, ResponseTemplate::StatusLine(200));
+  AddPiece(buf, ResponseTemplate::Date());
+  char line[160] = "Content-Length: ";
+  int len = 16;
+  len += ResponseTemplate::FormatUint(line + len, st.st_size);
+  line[len++] = '\r';
+  line[len++] = '\n';
+  AddPiece(buf, line, len);
+  AddPiece(buf, ResponseTemplate::Connection(true));
+  AddPiece(buf, ResponseTemplate::ContentType());
+  memcpy(line, "Accept-Ranges: bytes\r\nETag: \"", 29);
+  len = 29;
+  len += ResponseTemplate::FormatHex(line + len, st.st_mtime);
+  line[len++] = '-';
+  len += ResponseTemplate::FormatHex(line + len, st.st_size);
+  memcpy(line + len, "\"\r\nLast-Modified: ", 18);
+  len += 18;
+  len += ResponseTemplate::FormatHttpDate(line + len, st.st_mtime);
+  line[len++] = '\r';
+  line[len++] = '\n';
+  AddPiece(buf, line, len);
+  AddPiece(buf, "\r\n", 2);
+}
+
+void TemplateErrorResponse(Buffer* buf) {
+  AddPiece(buf, ResponseTemplate::StatusLine(404));
+  AddPiece(buf, ResponseTemplate::Date());
+  AddPiece(buf, ResponseTemplate::Connection(true));
+  AddPiece(buf, ResponseTemplate::ErrorTail(404));
+}
+
+// 返回每个响应消耗的CPU时间(纳秒)
+template <class F>
+double Run(F func) {
+  static Buffer buf;
+  volatile int sink = 0;
+  int64_t start = BenchNowNs(CLOCK_THREAD_CPUTIME_ID);
+  for (int i = 0; i < ITERATIONS; ++i) {
+    buf.len = 0;
+    func(&buf);
+    sink += buf.len;
+  }
+  return (double)(BenchNowNs(CLOCK_THREAD_CPUTIME_ID) - start) / ITERATIONS;
+}
+
+int main() {
+  ResponseTemplate::Init();
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_size = 67313;
+  st.st_mtime = 1681101712;
+
+  BenchReport("response", "file_header_vsnprintf", 0,
+              Run([&](Buffer* b) { LegacyFileHeader(b, st); }), "ns/op");
+  BenchReport("response", "file_header_template", 0,
+              Run([&](Buffer* b) { TemplateFileHeader(b, st); }), "ns/op");
+  BenchReport("response", "error_vsnprintf", 0,
+              Run([](Buffer* b) { LegacyErrorResponse(b); }), "ns/op");
+  BenchReport("response", "error_template", 0,
+              Run([](Buffer* b) { TemplateErrorResponse(b); }), "ns/op");
+  return 0;
+}
@@ -0,0 +1,76 @@
+// 线程池的微基准测试:
+// 不同线程数下，任务从Append()到工作线程开始处理的交接延迟，以及连续投递任务时的吞吐
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "../threadpool.h"
+#include "bench.h"
+
+namespace {
+
+const int THREADS[] = {1, 2, 4, 8};
+const int HANDOFFS = 20000;
+const int BATCH = 200000;
+
+std::atomic<int> completed(0);
+
+struct Job {
+  int64_t enqueue_ns;
+  int64_t latency_ns;
+  void Process() {
+    latency_ns = BenchNowNs() - enqueue_ns;
+    completed.fetch_add(1, std::memory_order_release);
+  }
+};
+
+void WaitCompleted(int count) {
+  while (completed.load(std::memory_order_acquire) < count) {
+    sched_yield();
+  }
+}
+
+// 每次只投递一个任务，等它被处理后再投递下一个(空闲线程被唤醒的延迟)
+void BenchHandoff(ThreadPool<Job>* pool, int threads) {
+  std::vector<int64_t> latencies(HANDOFFS);
+  Job job;
+  for (int i = 0; i < HANDOFFS; ++i) {
+    completed.store(0, std::memory_order_relaxed);
+    job.enqueue_ns = BenchNowNs();
+    pool->Append(&job);
+    WaitCompleted(1);
+    latencies[i] = job.latency_ns;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  BenchReport("threadpool", "handoff_p50", threads, latencies[HANDOFFS / 2], "ns");
+  BenchReport("threadpool", "handoff_p99", threads, latencies[HANDOFFS * 99 / 100], "ns");
+}
+
+// 连续投递任务(队列满时让出CPU重试)，直到全部处理完，返回每个任务的平均时间
+void BenchThroughput(ThreadPool<Job>* pool, int threads) {
+  std::vector<Job> jobs(BATCH);
+  completed.store(0, std::memory_order_relaxed);
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < BATCH; ++i) {
+    jobs[i].enqueue_ns = BenchNowNs();
+    while (!pool->Append(&jobs[i])) {
+      sched_yield();
+    }
+  }
+  WaitCompleted(BATCH);
+  BenchReport("threadpool", "throughput", threads, (double)(BenchNowNs() - start) / BATCH,
+              "ns/task");
+}
+
+}  // namespace
+
+int main() {
+  for (int threads : THREADS) {
+    // 线程池的工作线程是分离的，析构时不会等待它们退出，所以这里不释放线程池
+    ThreadPool<Job>* pool = new ThreadPool<Job>(threads, 10000);
+    BenchHandoff(pool, threads);
+    BenchThroughput(pool, threads);
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+// 定时器升序链表的微基准测试:
+// 不同链表长度下添加、调整和到期处理一个定时器的耗时(纳秒)
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "../timer.h"
+#include "bench.h"
+
+namespace {
+
+const int SIZES[] = {100, 1000, 10000};
+const int64_t WORK = 20000000;   // 每个用例大约遍历的节点数，决定迭代次数
+
+int expired = 0;
+
+void CountExpired(void*) {
+  ++expired;
+}
+
+// 定时器由调用者分配(服务器中嵌入在连接里)，链表只负责链接
+void InitTimer(Timer* timer, time_t expire) {
+  timer->cb_func_ = CountExpired;
+  timer->expire_ = expire;
+}
+
+// 与服务器相同，连接的超时时间分布在未来的3个时间间隔(15秒)内
+void Fill(SortTimerList* list, std::vector<Timer>* timers, int size, time_t base) {
+  timers->resize(size);
+  for (int i = 0; i < size; ++i) {
+    InitTimer(&(*timers)[i], base + i * 15 / size);
+    list->AddTimer(&(*timers)[i]);
+  }
+}
+
+// 新连接的超时时间最晚，要遍历整个链表插入到尾部
+double BenchAdd(int size) {
+  SortTimerList list;
+  std::vector<Timer> timers;
+  time_t base = time(NULL) + 3600;
+  Fill(&list, &timers, size, base);
+  int iterations = WORK / size;
+  Timer timer;
+  InitTimer(&timer, base + 15);
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < iterations; ++i) {
+    list.AddTimer(&timer);
+    list.DelTimer(&timer);
+  }
+  return (double)(BenchNowNs() - start) / iterations;
+}
+
+// 连接上有数据收发时超时时间延后到最晚，定时器从原来的位置移动到尾部附近
+double BenchAdjust(int size) {
+  SortTimerList list;
+  std::vector<Timer> timers;
+  time_t base = time(NULL) + 3600;
+  Fill(&list, &timers, size, base);
+  int iterations = WORK / size;
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < iterations; ++i) {
+    // 按链表顺序调整，每次调整的都是当前最早到期的定时器
+    list.AdjustTimer(&timers[i % size], base + 16 + i / size);
+  }
+  return (double)(BenchNowNs() - start) / iterations;
+}
+
+// 链表中的定时器全部到期，返回每个定时器的处理时间(取下和回调)
+double BenchTickExpired(int size) {
+  int rounds = WORK / size / 10 + 1;
+  int64_t total = 0;
+  std::vector<Timer> timers(size);
+  for (int r = 0; r < rounds; ++r) {
+    SortTimerList list;
+    // 超时时间递减，每次都插入到头部，避免准备链表的时间过长
+    time_t now = time(NULL);
+    for (int i = 0; i < size; ++i) {
+      InitTimer(&timers[i], now - 1 - i);
+      list.AddTimer(&timers[i]);
+    }
+    int64_t start = BenchNowNs();
+    list.Tick();
+    total += BenchNowNs() - start;
+  }
+  return (double)total / rounds / size;
+}
+
+// 没有定时器到期时每次Tick的开销
+double BenchTickIdle(int size) {
+  SortTimerList list;
+  std::vector<Timer> timers;
+  Fill(&list, &timers, size, time(NULL) + 3600);
+  int iterations = 1000000;
+  int64_t start = BenchNowNs();
+  for (int i = 0; i < iterations; ++i) {
+    list.Tick();
+  }
+  return (double)(BenchNowNs() - start) / iterations;
+}
+
+}  // namespace
+
+int main() {
+  for (int size : SIZES) {
+    BenchReport("timer", "add", size, BenchAdd(size), "ns/op");
+    BenchReport("timer", "adjust", size, BenchAdjust(size), "ns/op");
+    BenchReport("timer", "tick_expired", size, BenchTickExpired(size), "ns/timer");
+    BenchReport("timer", "tick_idle", size, BenchTickIdle(size), "ns/op");
+  }
+  return expired > 0 ? 0 : 1;
+}
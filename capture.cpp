@@ -0,0 +1,103 @@
+#include "capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+
+#include "locker.h"
+#include "log.h"
+
+bool Capture::enabled_ = false;
+
+namespace {
+
+FILE* capture_file = NULL;
+Locker capture_lock;          // 保护capture_file和written
+int64_t start_us = 0;
+int64_t written = 0;
+int64_t max_written = 0;
+std::atomic<uint32_t> next_conn(1);
+
+int64_t NowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+}  // namespace
+
+bool Capture::Init(const char* path, int64_t max_bytes) {
+  if (!path) {
+    return true;
+  }
+  capture_file = fopen(path, "w");
+  if (!capture_file) {
+    return false;
+  }
+  setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+  CaptureHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  start_us = NowUs();
+  header.start_us = start_us;
+  header.record_size = sizeof(CaptureRecord);
+  fwrite(&header, sizeof(header), 1, capture_file);
+  written = sizeof(header);
+  max_written = max_bytes;
+  enabled_ = true;
+  LOG_INFO("录制请求流量到%s，上限%lld字节", path, (long long)max_bytes);
+  return true;
+}
+
+void Capture::Write(uint32_t conn, CAPTURE_TYPE type, const char* data, int len) {
+  CaptureRecord record;
+  memset(&record, 0, sizeof(record));
+  record.conn = conn;
+  record.len = len;
+  record.type = type;
+  capture_lock.Lock();
+  record.time_us = NowUs() - start_us;   // 加锁后取时间，文件中的记录按时间排列
+  if (capture_file) {
+    if (written + (int64_t)sizeof(record) + len > max_written) {
+      // 达到上限，停止录制，已经录制的内容仍然完整可用
+      CloseFile();
+      LOG_WARN("流量录制文件达到上限%lld字节，停止录制", (long long)max_written);
+    } else {
+      fwrite(&record, sizeof(record), 1, capture_file);
+      if (len > 0) {
+        fwrite(data, 1, len, capture_file);
+      }
+      written += sizeof(record) + len;
+    }
+  }
+  capture_lock.UnLock();
+}
+
+void Capture::CloseFile() {
+  enabled_ = false;
+  if (capture_file) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+}
+
+void Capture::Stop() {
+  capture_lock.Lock();
+  CloseFile();
+  capture_lock.UnLock();
+}
+
+uint32_t Capture::Open() {
+  uint32_t conn = next_conn.fetch_add(1, std::memory_order_relaxed);
+  Write(conn, CAPTURE_OPEN, NULL, 0);
+  return conn;
+}
+
+void Capture::Data(uint32_t conn, const char* data, int len) {
+  Write(conn, CAPTURE_DATA, data, len);
+}
+
+void Capture::Close(uint32_t conn) {
+  Write(conn, CAPTURE_CLOSE, NULL, 0);
+}
@@ -0,0 +1,56 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+
+// 请求流量录制文件的格式(回放工具见webbench/replay.cpp)
+// 文件开头为CaptureHeader，之后是按时间顺序的记录，每条为CaptureRecord加上len字节的数据
+enum CAPTURE_TYPE {
+  CAPTURE_OPEN = 1,      // 新连接
+  CAPTURE_DATA = 2,      // Read()中一次recv读到的原始字节
+  CAPTURE_CLOSE = 3,     // 服务器关闭连接
+};
+
+struct CaptureHeader {
+  char magic[8];         // CAPTURE_MAGIC
+  int64_t start_us;      // 开始录制的时间(UNIX时间，微秒)
+  uint32_t record_size;  // sizeof(CaptureRecord)
+  char reserved[12];
+};
+
+static_assert(sizeof(CaptureHeader) == 32, "CaptureHeader must be 32 bytes");
+
+struct CaptureRecord {
+  int64_t time_us;       // 相对于开始录制的时间(微秒)
+  uint32_t conn;         // 连接的编号，从1开始，每个新连接递增
+  uint32_t len;          // 之后的数据长度(只有DATA有数据)
+  uint16_t type;         // CAPTURE_TYPE
+  char reserved[6];
+};
+
+static_assert(sizeof(CaptureRecord) == 24, "CaptureRecord must be 24 bytes");
+
+#define CAPTURE_MAGIC "WSCAPT01"
+
+// 把客户端发来的原始请求字节连同时间和连接的开闭一起录制下来，用于按真实的URL分布、
+// 请求头大小和长连接模式回放压测；记录在加锁后写入带缓冲的文件，只在录制时才有开销
+class Capture {
+public:
+  static const int64_t DEFAULT_MAX_BYTES = 1LL << 30;   // 文件达到上限后停止录制
+
+  // path为NULL时不录制
+  static bool Init(const char* path, int64_t max_bytes = DEFAULT_MAX_BYTES);
+  static void Stop();
+  static bool Enabled() { return enabled_; }
+  // 新连接，返回连接的编号
+  static uint32_t Open();
+  static void Data(uint32_t conn, const char* data, int len);
+  static void Close(uint32_t conn);
+
+private:
+  static void Write(uint32_t conn, CAPTURE_TYPE type, const char* data, int len);
+  static void CloseFile();     // 调用者持有锁
+  static bool enabled_;
+};
+
+#endif
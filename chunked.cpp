@@ -0,0 +1,149 @@
+#include "chunked.h"
+
+namespace {
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// 块扩展和尾部的一行中允许的字符: 制表符和可见字符(包括obs-text)，单独的\n和其他控制字符都不允许，
+// 否则把\n当作行结束的下游服务器会在别的位置切分chunked编码(请求走私)
+bool IsLineChar(char c) {
+  unsigned char u = (unsigned char)c;
+  return c == '\t' || (u >= 0x20 && u != 0x7f);
+}
+
+}  // namespace
+
+void ChunkedParser::Reset() {
+  state_ = SIZE;
+  remaining_ = 0;
+  digits_ = 0;
+}
+
+// 块的格式: 十六进制的大小[;扩展]\r\n 数据\r\n ... 0\r\n [尾部的头部\r\n...] \r\n
+ChunkedParser::RESULT ChunkedParser::Parse(const char* input, int len, int* consumed,
+                                           const char** data, int* data_len) {
+  int i = 0;
+  while (i < len && state_ != FINISHED) {
+    char c = input[i];
+    switch (state_) {
+      case SIZE: {
+        int value = HexValue(c);
+        if (value >= 0) {
+          if (digits_ >= 15) {
+            return CHUNK_ERROR;     // 块大小超过60位
+          }
+          remaining_ = remaining_ * 16 + value;
+          ++digits_;
+        } else if (digits_ == 0) {
+          return CHUNK_ERROR;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          state_ = EXTENSION;
+        } else if (c == '\r') {
+          state_ = SIZE_LF;
+        } else {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        break;
+      }
+      case EXTENSION: {
+        // 块扩展直接忽略
+        if (c == '\r') {
+          state_ = SIZE_LF;
+        } else if (!IsLineChar(c)) {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        break;
+      }
+      case SIZE_LF: {
+        if (c != '\n') {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        state_ = remaining_ == 0 ? TRAILER : DATA;
+        break;
+      }
+      case DATA: {
+        int n = (uint64_t)(len - i) < remaining_ ? len - i : (int)remaining_;
+        *data = input + i;
+        *data_len = n;
+        i += n;
+        remaining_ -= n;
+        if (remaining_ == 0) {
+          state_ = DATA_CR;
+        }
+        *consumed = i;
+        return CHUNK_DATA;
+      }
+      case DATA_CR: {
+        if (c != '\r') {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        state_ = DATA_LF;
+        break;
+      }
+      case DATA_LF: {
+        if (c != '\n') {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        state_ = SIZE;
+        digits_ = 0;
+        break;
+      }
+      case TRAILER: {
+        // 最后一个块之后是若干行尾部的头部，以空行结束
+        if (c == '\r') {
+          state_ = LAST_LF;
+        } else if (IsLineChar(c)) {
+          state_ = TRAILER_LINE;
+        } else {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        break;
+      }
+      case TRAILER_LINE: {
+        if (c == '\r') {
+          state_ = TRAILER_LF;
+        } else if (!IsLineChar(c)) {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        break;
+      }
+      case TRAILER_LF: {
+        if (c != '\n') {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        state_ = TRAILER;
+        break;
+      }
+      case LAST_LF: {
+        if (c != '\n') {
+          return CHUNK_ERROR;
+        }
+        ++i;
+        state_ = FINISHED;
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+  }
+  *consumed = i;
+  return state_ == FINISHED ? CHUNK_DONE : CHUNK_NEED_MORE;
+}
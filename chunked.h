@@ -0,0 +1,32 @@
+#ifndef CHUNKED_H_
+#define CHUNKED_H_
+
+#include <stdint.h>
+
+// chunked传输编码的增量解析器，输入可以在任意位置被切开，解析的进度保存在解析器中
+// 转发上游的响应时只需要找到消息的结尾，接收请求实体时还要取出每一段数据
+class ChunkedParser {
+public:
+  // Parse()的结果
+  // CHUNK_DATA: 处理的字节中最后data_len个是实体数据(从data开始)，后面可能还有输入需要继续调用
+  // CHUNK_NEED_MORE: 输入已经全部处理，需要更多的数据
+  // CHUNK_DONE: 最后一个块和尾部(trailer)都已经处理，后面的数据属于下一个消息
+  // CHUNK_ERROR: 编码有误
+  enum RESULT {CHUNK_DATA, CHUNK_NEED_MORE, CHUNK_DONE, CHUNK_ERROR};
+
+  ChunkedParser() { Reset(); }
+  void Reset();
+  // 解析input中的len个字节，consumed返回处理的字节数
+  RESULT Parse(const char* input, int len, int* consumed, const char** data, int* data_len);
+  bool Done() const { return state_ == FINISHED; }
+
+private:
+  enum STATE {SIZE, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF,
+              TRAILER, TRAILER_LINE, TRAILER_LF, LAST_LF, FINISHED};
+
+  STATE state_;
+  uint64_t remaining_;     // 当前块中还没有处理的数据
+  int digits_;             // 块大小已经读到的十六进制位数
+};
+
+#endif
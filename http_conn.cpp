@@ -1,24 +1,15 @@
 #include "http_conn.h"
 
-#define TEST 0  // 测试LOG宏
-#define LOG 0   // LOG宏
-
 // 初始化静态成员变量
 int HttpConn::epollfd_ = -1;
-int HttpConn::user_count_ = 0;
+std::atomic<int> HttpConn::user_count_(0);
 int HttpConn::timeslot_ = 5;
+int HttpConn::max_keep_alive_requests_ = 1000;
+int64_t HttpConn::max_body_size_ = 1024LL << 20;
+const char* HttpConn::upload_dir_ = NULL;
 SortTimerList HttpConn::timer_list_;  // 定时器链表
 
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on thi server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+// HTTP响应的状态信息和错误页面在response_template.cpp中，启动时预先生成
 // 网站根目录
 const char* doc_root = "/home/moksha/webserver/resources";  // 会自动加上字符串结束符
 
@@ -29,12 +20,180 @@ void TimerHandler() {
   alarm(HttpConn::timeslot_);  // 调用进程五秒收到一次SIGALARM信号(一次alarm调用只收到一次SIGALARM信号)
 }
 
-// 定时器回调函数，它将当前socket连接从epoll内核事件表中删除，并关闭该socket
-void CallBackFunc(int fd) {
-  epoll_ctl(HttpConn::epollfd_, EPOLL_CTL_DEL, fd, 0);
-  assert(fd >= 0);
-  close(fd);
-  printf("关闭客户端%d\n", fd);
+// 定时器回调函数(在主线程中执行)，它关闭超时的连接
+// 若连接正被工作线程处理，则只记录一个HUP事件，由工作线程在释放所有权之前关闭连接
+void CallBackFunc(void* user_data) {
+  HttpConn* conn = (HttpConn*)user_data;
+  if (conn->Acquire(HttpConn::CONN_HUP)) {
+    conn->CloseConn();
+  }
+  Metrics::Local()->timer_expirations.Add();
+  LOG_INFO("关闭超时的客户端");
+}
+
+namespace {
+
+// 与HttpConn::METHOD的顺序一致，转发请求时写回请求行
+const char* method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+// 路由匹配的结果在DoRequest()和ProcessWrite()之间传递，两者在同一个线程中依次执行
+thread_local RouteRequest route_request;
+// 缓存键和命中的响应也一样，cache_key_len为-1表示请求不能缓存
+thread_local char cache_key[MicroCache::MAX_KEY_SIZE];
+thread_local int cache_key_len = -1;
+thread_local CachedResponse cached_response;
+
+// 动态生成的响应实体先写在线程的缓冲区中，生成完毕后拷贝到连接的arena_中直到发送完毕
+// 预留的空间足够/metrics中所有直方图的区间都非空，计数变大时也不用重新分配
+std::string* RenderBuffer() {
+  static thread_local std::string render_buf;
+  if (render_buf.capacity() < 64 * 1024) {
+    render_buf.reserve(64 * 1024);
+  }
+  render_buf.clear();
+  return &render_buf;
+}
+
+// 内置的路由
+bool MetricsHandler(const RouteRequest& request, RouteResponse* response, void* arg) {
+  response->SetContentType("text/plain; version=0.0.4");
+  Metrics::Render(response->Body(), HttpConn::user_count_.load(std::memory_order_relaxed));
+  Proxy::RenderMetrics(response->Body());
+  MicroCache::RenderMetrics(response->Body());
+  return true;
+}
+
+bool HealthHandler(const RouteRequest& request, RouteResponse* response, void* arg) {
+  response->Append("ok\n", 3);
+  return true;
+}
+
+// 内置的上传路由: 实体先写到上传目录中的临时文件(.名字.序号.part)，完整地收到之后才改名，
+// 同名的文件被整个替换，接收失败时删除临时文件；名字不能包含'/'，也不能以'.'开头
+bool UploadHandler(const RouteRequest& request, RouteResponse* response, void* arg) {
+  static std::atomic<unsigned> seq(0);
+  const RouteParam* name = request.Param("name");
+  char path[HttpConn::FILENAME_LEN * 2];
+  switch (request.body_state) {
+    case RouteRequest::BODY_RECEIVED: {
+      char* temp = (char*)request.body_arg;
+      bool ok = close(request.body_fd) == 0;
+      snprintf(path, sizeof(path), "%s/%.*s", HttpConn::upload_dir_, name->len, name->value);
+      if (!ok || rename(temp, path) < 0) {
+        LOG_ERROR("保存上传的文件%s失败: %s", path, strerror(errno));
+        unlink(temp);
+        free(temp);
+        return false;
+      }
+      free(temp);
+      char text[64];
+      int len = snprintf(text, sizeof(text), "%lld bytes stored\n", (long long)request.body_len);
+      response->SetStatus(201);
+      response->Append(text, len);
+      return true;
+    }
+    case RouteRequest::BODY_FAILED: {
+      close(request.body_fd);
+      unlink((char*)request.body_arg);
+      free(request.body_arg);
+      return true;
+    }
+    default: {
+      break;
+    }
+  }
+  if (name->len == 0 || name->len >= HttpConn::FILENAME_LEN || name->value[0] == '.' ||
+      memchr(name->value, '/', name->len)) {
+    response->SetStatus(400);
+    response->Append("bad file name\n");
+    return true;
+  }
+  snprintf(path, sizeof(path), "%s/.%.*s.%u.part", HttpConn::upload_dir_, name->len, name->value,
+           seq.fetch_add(1, std::memory_order_relaxed));
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_ERROR("创建上传的临时文件%s失败: %s", path, strerror(errno));
+    return false;
+  }
+  response->ReceiveBody(fd, strdup(path));
+  return true;
+}
+
+// 复制到转发的请求中，空间不够时返回false
+bool AppendTo(char* buf, int size, int* len, const char* data, int n) {
+  if (*len + n > size) {
+    return false;
+  }
+  memcpy(buf + *len, data, n);
+  *len += n;
+  return true;
+}
+
+// 逐跳的请求头部只对客户端到这里的连接有效，不转发；100-continue由这里回复，chunked编码的实体原样转发时
+// 再加上Transfer-Encoding
+bool IsHopByHop(const char* line) {
+  static const char* names[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Upgrade:",
+                                "Trailer:", "Transfer-Encoding:", "Expect:"};
+  for (const char* name : names) {
+    if (strncasecmp(line, name, strlen(name)) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 保存到缓存中的头部: 状态行、Content-Type和处理函数附加的头部
+void FormatRouteHead(const RouteResponse& response, std::string* head) {
+  Piece status_line = ResponseTemplate::StatusLine(response.Status());
+  head->assign(status_line.data, status_line.len);
+  head->append("Content-Type: ");
+  head->append(response.ContentType());
+  head->append("\r\n");
+  head->append(response.Headers(), response.HeadersLen());
+}
+
+// 后台刷新线程中重新生成缓存的响应: 再次调用路由的处理函数，反向代理的路由同步地请求上游
+bool RefreshRoute(const RefreshJob& job, int* status, std::string* head, std::string* body) {
+  RouteRequest request;
+  const Route* route = Router::Match(HttpConn::GET, job.url.c_str(), &request);
+  if (!route) {
+    return false;
+  }
+  RouteResponse response(body);
+  if (!route->handler(request, &response, route->arg)) {
+    return false;
+  }
+  if (response.Upstream()) {
+    body->clear();
+    return !job.request.empty() &&
+           Proxy::Fetch(response.Upstream(), job.request.data(), job.request.size(),
+                        MicroCache::MaxEntrySize(), status, head, body);
+  }
+  *status = response.Status();
+  if (ResponseTemplate::StatusLine(*status).len == 0) {
+    return false;
+  }
+  FormatRouteHead(response, head);
+  return true;
+}
+
+}  // namespace
+
+bool HttpConn::InitRoutes() {
+  // 内置的路由也可以用缓存规则(-x)缓存
+  if (Metrics::Path() &&
+      !Router::Add(GET, Metrics::Path(), MetricsHandler, NULL, MicroCache::PolicyFor(Metrics::Path()))) {
+    return false;
+  }
+  if (upload_dir_ && !(Router::Add(PUT, "/upload/*name", UploadHandler, NULL) &&
+                       Router::Add(POST, "/upload/*name", UploadHandler, NULL))) {
+    return false;
+  }
+  return Router::Add(GET, "/healthz", HealthHandler, NULL, MicroCache::PolicyFor("/healthz"));
+}
+
+bool HttpConn::StartCache(size_t budget_bytes) {
+  return MicroCache::Start(budget_bytes, RefreshRoute);
 }
 
 // 设置文件描述符非阻塞
@@ -66,65 +225,130 @@ void Delfd(int epollfd, int fd) {
   close(fd);
 }
 
-// 第三个参数是事件
-void Modfd(int epollfd, int fd, int ev) {
+// 客户连接以ET模式同时注册读写事件，注册之后不再修改，不使用EPOLLONESHOT，
+// 同一时刻只有一个线程处理一个连接由连接的状态字保证(见HttpConn::Acquire())，
+// 每个请求不再需要调用epoll_ctl重新注册事件
+void AddConnfd(int epollfd, int fd) {
   epoll_event event;
   event.data.fd = fd;
-  event.events = ev | EPOLLONESHOT | EPOLLRDHUP | EPOLLET;
-  epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+  SetNonBlocking(fd);
 }
 
 void HttpConn::Init(int sockfd, const sockaddr_in& addr) {
-  printf("有新的客户端%d进来了\n", sockfd);
+  LOG_DEBUG("有新的客户端%d进来了", sockfd);
   sockfd_ = sockfd;
   address_ = addr;
+  PROBE_CONN_ACCEPT(sockfd, addr.sin_addr.s_addr, addr.sin_port);
 
-#if LOG  // 便于调试
-  // 端口复用
-  int reuse = 1;
-  setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-#endif
-
-  // 将与客户端连接的connfd加入内核事件表中
-  Addfd(epollfd_, sockfd_, true, true);
   user_count_++;
-  
+  state_.store(0, std::memory_order_relaxed);
+  capture_id_ = Capture::Enabled() ? Capture::Open() : 0;
   Init();
-  // 为客户连接成功socket创建定时器，初始化当前连接的定时器
-  timer_ = new Timer;
-  timer_->sockfd_ = sockfd;
-  timer_->cb_func_ = CallBackFunc;
+  // 初始化当前连接的定时器(上一个连接关闭时已经从链表中取下)
+  timer_.user_data_ = this;
+  timer_.cb_func_ = CallBackFunc;
   time_t cur = time(NULL);
-  timer_->expire_ = cur + 3 * timeslot_;
+  timer_.expire_ = cur + 3 * timeslot_;
+  last_adjust_ = cur;
   // 将该连接的定时器加入链表中
-  timer_list_.AddTimer(timer_);
+  timer_list_.AddTimer(&timer_);
+
+  // 将与客户端连接的connfd加入内核事件表中，同时监听读写事件，之后不再修改
+  AddConnfd(epollfd_, sockfd_);
 }
 
 void HttpConn::Init() {
+  read_idx_ = 0;
+  checked_idx_ = 0;
+  write_idx_ = 0;
+  bytes_have_send_ = 0;
+  close_after_flush_ = false;
+  request_pending_ = false;
+  read_more_ = false;
+  recv_us_ = 0;
+  ttlb_start_us_ = 0;
+  responses_queued_ = 0;
+  requests_served_ = 0;
+  nodelay_ = false;
+  close_requested_.store(false, std::memory_order_relaxed);
+  arena_.Reset();
+  memset(&trace_, 0, sizeof(trace_));
+  trace_pending_ = false;
+  out_queue_.Clear();
+  bzero(read_buf_, READ_BUFFER_SIZE);
+  bzero(write_buf_, WRITE_BUFFER_SIZE);
+  InitRequest();
+}
+
+// 一个请求处理完之后重置解析状态，读缓冲区中剩余的数据是流水线上的下一个请求，移到缓冲区的开头
+void HttpConn::InitRequest() {
+  if (checked_idx_ > 0 && checked_idx_ < read_idx_) {
+    memmove(read_buf_, read_buf_ + checked_idx_, read_idx_ - checked_idx_);
+    read_idx_ -= checked_idx_;
+  } else if (checked_idx_ >= read_idx_) {
+    read_idx_ = 0;
+  }
   check_state_ = CHECK_STATE_REQUESTLINE;
   checked_idx_ = 0;
   start_line_ = 0;
-  read_idx_ = 0;
-  write_idx_ = 0;
   url_ = 0;
   version_ = 0;
   method_ = GET;
   host_ = 0;
   port_ = 0;
   is_linger_ = false;
+  http11_ = false;
   content_length_ = 0;
-  bzero(read_buf_, READ_BUFFER_SIZE);
-  bzero(write_buf_, WRITE_BUFFER_SIZE);
-  bzero(real_file_, FILENAME_LEN);
+  content_length_seen_ = false;
+  body_chunked_ = false;
+  expect_continue_ = false;
+  stream_body_ = false;
+  range_ = 0;
+  if_range_ = 0;
+  range_start_ = 0;
+  range_end_ = -1;
+  route_ = NULL;
+  proxy_retried_ = false;
+  proxy_cache_ = NULL;
+  proxy_capture_ = false;
+  file_fd_ = -1;
+  real_file_[0] = '\0';
+  handle_us_ = 0;
+  status_ = 0;
 }
 
+// 只能由持有连接所有权的线程调用
 void HttpConn::CloseConn() {
   if (sockfd_ >= 0)  { 
-    Delfd(epollfd_, sockfd_);  // 从内核事件表中删除fd
+    // close会自动将fd从内核事件表中删除(没有dup过)，不需要再调用epoll_ctl
+    PROBE_CONN_CLOSE(sockfd_, bytes_have_send_);
+    if (body_.Active()) {
+      AbortBody();             // 接收实体到一半关闭，处理函数删除写了一半的文件
+    }
+    if (upstream_) {
+      // 转发到一半关闭，上游连接上可能还有没读完的响应，不能放回连接池
+      Proxy::Finish(upstream_, false, false);
+      upstream_ = NULL;
+    }
+    std::string().swap(cache_buf_);   // 转发到一半关闭时可能还保存着响应
+    if (capture_id_) {
+      Capture::Close(capture_id_);
+      capture_id_ = 0;
+    }
+    close(sockfd_);
+    if (RateLimiter::Enabled()) {
+      RateLimiter::Disconnect(address_.sin_addr.s_addr);   // 与main()中的Connect()对应
+    }
+    unmap();                   // 发送到一半关闭连接时也要释放文件资源
+    arena_.Reset();            // 块还给当前线程，不让空闲的连接占着
     sockfd_ = -1;
     user_count_--;  // 减少总的用户数
-    timer_ = nullptr;  // 重置定时器
+    timer_list_.DelTimer(&timer_);  // 移除连接的定时器(已经到期的定时器在Tick()中取下了)
   }
+  // 连接关闭后所有权也随之释放，之前记录的事件都属于已经关闭的连接
+  state_.store(0, std::memory_order_release);
 }
 
 bool HttpConn::Read() {
@@ -133,109 +357,357 @@ bool HttpConn::Read() {
   };
   // 读取到的字节
   int bytes_read = 0;
-  while (true) {  // ET模式要一直读
+  read_more_ = false;
+  uint64_t read_start = Tracer::Enabled() ? Tracer::Now() : 0;
+  bool new_request = false;
+  // ET模式要一直读，读缓冲区满了就先停下，剩余的数据在处理完已读的请求后再读(见read_more_)
+  while (true) {
+    if (read_idx_ >= READ_BUFFER_SIZE) {
+      read_more_ = true;
+      break;
+    }
     bytes_read = recv(sockfd_, read_buf_ + read_idx_, READ_BUFFER_SIZE - read_idx_, 0);
     if (bytes_read == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         // 没有数据
         break;  // 退出读循环
-      } else {
-        // 读错误，则关闭连接，并移除相应的定时器(不需要等到超时才移除)
-        CallBackFunc(sockfd_);
-        if (timer_) {
-          timer_list_.DelTimer(timer_);
-        }
-        return false;
       }
+      // 读错误，由调用者关闭连接，并移除相应的定时器(不需要等到超时才移除)
+      return false;
     } else if (bytes_read == 0) {  // EOF
       // 对方关闭连接
-      CallBackFunc(sockfd_);
-      if (timer_) {
-        timer_list_.DelTimer(timer_);
-      }
       return false;
-    } else {
-      // 客户端上有数据可读需要再调整该链接对应的定时器，以延迟该连接被关闭的时间
-      if (timer_) {
-        time_t cur = time(NULL);  // 获取系统当前时间
-        timer_->expire_ = cur + 3 * timeslot_;  // 调正该用户的绝对超时时间
-        printf("调整一次定时器的时间\n");
-        timer_list_.AdjustTimer(timer_);
-      }
-      read_idx_ += bytes_read;
     }
+    if (capture_id_) {
+      Capture::Data(capture_id_, read_buf_ + read_idx_, bytes_read);
+    }
+    if (!request_pending_) {
+      recv_us_ = Metrics::NowUs();  // 请求等待处理的时间从数据到达时开始计算
+      new_request = true;
+    }
+    read_idx_ += bytes_read;
+    request_pending_ = true;
+  }
+  if (new_request && read_start) {
+    // 新的请求从这次读取开始追踪
+    memset(trace_.ts, 0, sizeof(trace_.ts));
+    trace_.ts[TRACE_READ_START] = read_start;
+    Trace(TRACE_READ_END);
   }
-#if LOG
-  printf("\n读取到了HTTP请求报文:\n%s", read_buf_);
-#endif
+  // 客户端上有数据可读需要再调整该链接对应的定时器，以延迟该连接被关闭的时间
+  AdjustTimer();
+  LOG_DEBUG("读取到了HTTP请求报文:\n%.*s", read_idx_, read_buf_);
   return true;
 }
 
 bool HttpConn::Write() {
-  int bytes_num = 0;                 // 记录writev返回的写入的字节数
-  int bytes_have_send = 0;           // 已经从写缓冲中发送给客户端的字节数
-  int bytes_to_send = write_idx_;    // 写缓冲中的未发送数据(即未写入fd)的字节数
-  if (bytes_to_send == 0) {           
-    // 写缓冲中无数据，说明服务器端并没有检测到争取的HTTP请求报文，又因为ET模式因此需要重新注册读就绪事件，并重新初始化连接
-    Modfd(epollfd_, sockfd_, EPOLLIN);
-    Init();   
+  if (out_queue_.Empty()) {
     return true;
   }
-  while (1) {
-    // 成功时writev返回写入的字节数
-    bytes_num = writev(sockfd_, iv_, iv_count_);  // 将多块分散的内存写入连接fd中
-    if (bytes_num == -1) {  // 返回-1为error
-      if (errno == EAGAIN) {
-      // 如果TCP写缓冲没有时间，则等待下一轮EPOLLOUT事件
-        Modfd(epollfd_, sockfd_, EPOLLOUT);
-        return true;
-      }
-      unmap();  // 对资源文件映射到内存的部分进行释放
+  int64_t sent = 0;
+  OutQueue::FLUSH_STATUS status = out_queue_.Flush(sockfd_, &sent);
+  bytes_have_send_ += sent;
+  Metrics::Local()->bytes_out.Add(sent);
+  if (sent > 0) {
+    // 大文件的发送时间可能远超过超时时间，发送有进展时也要延迟该连接被关闭的时间
+    AdjustTimer();
+  }
+  if (status == OutQueue::FLUSH_AGAIN) {
+    if (trace_pending_ && !pending_trace_.ts[TRACE_WRITE_BLOCKED]) {
+      pending_trace_.ts[TRACE_WRITE_BLOCKED] = Tracer::Now();
+    }
+    // 如果TCP写缓冲没有空间，则等待下一次EPOLLOUT事件(ET模式下写缓冲有空间时才会触发)，
+    // 已发送的进度保存在发送队列中
+    return true;
+  } else if (status == OutQueue::FLUSH_ERROR) {
+    unmap();  // 释放发送队列中的文件
+    return false;
+  }
+  return OnFlushed(sent);
+}
+
+bool HttpConn::OnFlushed(int64_t sent) {
+  // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
+  write_idx_ = 0;    // 发送队列已空，写缓冲区可以从头开始使用
+  PROBE_WRITE_DONE(sockfd_, sent);
+  arena_.Reset();    // 发送队列中的内存段都已发送，回收请求处理期间分配的内存
+  if (trace_pending_) {
+    pending_trace_.ts[TRACE_DONE] = Tracer::Now();
+    Tracer::Finish(pending_trace_);
+    trace_pending_ = false;
+  }
+  if (responses_queued_ > 0) {
+    // 流水线上一起发送的响应都以其中最早的请求计时
+    int64_t ttlb = Metrics::NowUs() - ttlb_start_us_;
+    for (; responses_queued_ > 0; --responses_queued_) {
+      Metrics::Local()->ttlb_us.Record(ttlb > 0 ? ttlb : 0);
+    }
+  }
+  if (close_after_flush_) {
+    return false;    // 短连接则关闭当前socket释放资源
+  }
+  return true;
+}
+
+void HttpConn::AdjustTimer() {
+  time_t cur = time(NULL);  // 获取系统当前时间
+  if (last_adjust_ == cur) {
+    return;  // 同一秒内不需要重复调整
+  }
+  last_adjust_ = cur;
+  LOG_DEBUG("调整一次定时器的时间");
+  timer_list_.AdjustTimer(&timer_, cur + 3 * timeslot_);  // 调正该用户的绝对超时时间
+}
+
+bool HttpConn::Acquire(int events) {
+  // 其他线程持有所有权时，只把事件记录在状态字中，由持有者在释放之前处理
+  int prev = state_.fetch_or(events | CONN_BUSY, std::memory_order_acq_rel);
+  if (prev & CONN_BUSY) {
+    return false;
+  }
+  // 获得了所有权，事件由当前线程处理，状态字中只保留BUSY
+  state_.store(CONN_BUSY, std::memory_order_release);
+  return true;
+}
+
+int HttpConn::Release() {
+  int expected = CONN_BUSY;
+  if (state_.compare_exchange_strong(expected, 0, std::memory_order_acq_rel)) {
+    return 0;
+  }
+  // 持有期间有新的事件到达，继续持有所有权并返回这些事件
+  return state_.exchange(CONN_BUSY, std::memory_order_acq_rel) & ~CONN_BUSY;
+}
+
+bool HttpConn::HandleEvents(int events) {
+  while (events) {
+    if (events & CONN_HUP) {
+      // 对方异常断开或者错误等事件
+      CloseConn();
       return false;
     }
-    // 更新变量
-    bytes_have_send += bytes_num;
-    if (bytes_to_send <= bytes_have_send) {
-      // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-      unmap();           // 释放资源文件映射的内存空间
-      if (is_linger_) {  // 如果是长连接，就初始化当前连接
-        Init();   // 重新初始化当前连接
-        Modfd(epollfd_, sockfd_, EPOLLIN);
-        return true;
-      } else {
-        Modfd(epollfd_, sockfd_, EPOLLIN);
-        return false;  // 短连接则关闭当前socket释放资源
+    if (upstream_ || body_.Active()) {
+      // 正在转发请求或者接收实体，客户连接和上游连接上的I/O都交给工作线程(见ProxyIO()和BodyIO())
+      if (events & CONN_IN) {
+        read_more_ = true;
+      }
+      return true;
+    }
+    if (events & CONN_OUT) {
+      if (!Write()) {  // 继续发送上一次因为写缓冲满而没有发送完的数据
+        CloseConn();   // 关闭当前socket释放资源
+        return false;
+      }
+    }
+    if (events & CONN_IN) {
+      if (read_idx_ >= READ_BUFFER_SIZE) {
+        read_more_ = true;  // 读缓冲区已满，等工作线程处理完已读的请求后再读
+      } else if (!Read()) {
+        CloseConn();
+        return false;
       }
     }
+    if (out_queue_.Empty() && (request_pending_ || read_more_)) {
+      // 模拟Proactor模式，由主线程来处理I/O，工作线程处理业务逻辑(Process)
+      Trace(TRACE_ENQUEUE);
+      return true;
+    }
+    events = Release();
   }
+  return false;
 }
 
-void HttpConn::Process() {
-  // 处理业务逻辑
-  HTTP_CODE read_ret = ProcessRead();
-  #if TEST
-    // 测试效果
-    printf("\n=============test info==============\n");
-    printf("method: %d\n", method_);
-    printf("url: %s\n", url_);
-    printf("version: %s\n", version_);
-    printf("host_: %s\n", host_);
-    printf("port_: %s\n", port_);
-    printf("Linger: %d\n", is_linger_);
-    printf("Content length : %d\n", content_length_);
-    printf("====================================\n");
-  #endif
-  if (read_ret == NO_REQUEST) {  // 请求报文中的数据不完整需要继续读取客户数据
-     Modfd(epollfd_, sockfd_, EPOLLIN);
-     return;
-  }
-  // 根据解析HTTP请求报文得到的结果，进行生成响应报文
-  bool write_ret = ProcessWrite(read_ret);
-  if (!write_ret) {
+// 只有主线程调用Acquire()，EvictIdle()也在主线程中执行，持有所有权期间不会记录新的事件
+bool HttpConn::Evict() {
+  if (!Acquire(0)) {
+    // 工作线程正在处理请求，下一个响应带上Connection: close
+    if (!close_requested_.exchange(true, std::memory_order_relaxed)) {
+      Metrics::Local()->evict_requested.Add();
+    }
+    return false;
+  }
+  if (sockfd_ < 0) {
+    Release();
+    return false;
+  }
+  if (read_idx_ == 0 && out_queue_.Empty()) {
+    // 没有读到一半的请求，也没有没发送完的响应，直接关闭
     CloseConn();
-  } else {
-    Modfd(epollfd_, sockfd_, EPOLLOUT);  // 响应报文生成后工作线程注册写就绪事件
+    Metrics::Local()->evicted_idle.Add();
+    return true;
+  }
+  if (!close_requested_.exchange(true, std::memory_order_relaxed)) {
+    Metrics::Local()->evict_requested.Add();
   }
+  Release();
+  return false;
+}
+
+int HttpConn::EvictIdle(int count, int scan) {
+  void* oldest[256];
+  if (scan > 256) {
+    scan = 256;
+  }
+  // 取出之后才逐个关闭，CloseConn()中删除定时器要获取定时器链表的锁；
+  // 连接槽位不会释放，新连接也只在主线程中建立，取出的指针一直有效
+  int n = timer_list_.Oldest(oldest, scan);
+  int evicted = 0;
+  for (int i = 0; i < n && evicted < count; ++i) {
+    if (((HttpConn*)oldest[i])->Evict()) {
+      ++evicted;
+    }
+  }
+  if (evicted > 0) {
+    LOG_INFO("连接数接近上限，关闭了%d个空闲连接", evicted);
+  }
+  return evicted;
+}
+
+void HttpConn::Process() {
+  // 工作线程持有连接的所有权，处理完读缓冲区中的请求并发送响应之后才释放
+  Trace(TRACE_DEQUEUE);
+  int events = 0;
+  while (true) {
+    if (events & CONN_HUP) {
+      CloseConn();
+      return;
+    }
+    if (events & CONN_IN) {
+      read_more_ = true;  // socket中有新数据，先处理完读缓冲区中的请求再读
+    }
+    events = 0;
+    if (upstream_ || body_.Active()) {
+      if (!(upstream_ ? ProxyIO() : BodyIO())) {
+        CloseConn();
+        return;
+      }
+      if (upstream_ || body_.Active()) {
+        // 等待上游的响应、请求实体或者客户端的EPOLLOUT，事件到达时主线程再把连接交给工作线程
+        events = Release();
+        if (!events) {
+          return;
+        }
+        continue;
+      }
+    }
+    if (out_queue_.Empty() && request_pending_ && !ProcessRequests()) {
+      return;  // 连接已经关闭
+    }
+    if (upstream_ || body_.Active()) {
+      continue;  // 开始转发或者接收实体，流水线上的后续请求等结束后再处理
+    }
+    if (out_queue_.Empty() && read_more_) {
+      // 读缓冲区已满的情况下仍然没有完整的请求，Read()会返回false，说明请求过大
+      if (!Read()) {
+        CloseConn();
+        return;
+      }
+      if (request_pending_) {
+        continue;
+      }
+    }
+    // 直接在工作线程中发送响应，只有写缓冲满(EAGAIN)时才需要等待EPOLLOUT事件
+    if (!Write()) {
+      CloseConn();
+      return;
+    }
+    if (out_queue_.Empty() && (request_pending_ || read_more_)) {
+      continue;  // 流水线上还有请求没有处理
+    }
+    events = Release();
+    if (!events) {
+      return;
+    }
+  }
+}
+
+// 处理读缓冲区中所有完整的请求，返回false表示连接已经关闭
+bool HttpConn::ProcessRequests() {
+  request_pending_ = false;
+  if (close_after_flush_) {
+    return true;  // 短连接的最后一个响应已经生成，后面的请求不再处理
+  }
+  // 客户端可能在一次发送中流水线式地发送了多个请求，逐个处理读缓冲区中的完整请求，
+  // 它们的响应都加入发送队列，最后一起发送
+  while (true) {
+    // 处理业务逻辑
+    int64_t start_us = Metrics::NowUs();
+    Trace(TRACE_PARSE_START);
+    PROBE_PARSE_START(sockfd_);
+    HTTP_CODE read_ret = ProcessRead();
+    LOG_DEBUG("method: %d url: %s version: %s host: %s linger: %d content length: %lld",
+              method_, url_, version_, host_, is_linger_, (long long)content_length_);
+    if (read_ret == NO_REQUEST) {  // 请求报文中的数据不完整需要继续读取客户数据
+      return true;
+    }
+    // 请求有误时后面的数据无法确定请求的边界，关闭连接；
+    // 连接上的请求数达到上限时最后一个响应带上Connection: close，避免一个客户端一直占用连接；
+    // 连接数紧张时被要求关闭的连接也在这个响应之后关闭；
+    // 没有读入的请求实体只有路由的处理函数可以接收，其他情况下实体还在socket中，也要关闭
+    if (read_ret == BAD_REQUEST || read_ret == PAYLOAD_TOO_LARGE ||
+        (stream_body_ && read_ret != ROUTE_REQUEST) || ++requests_served_ >= max_keep_alive_requests_ ||
+        close_requested_.load(std::memory_order_relaxed)) {
+      is_linger_ = false;
+    }
+    Trace(TRACE_HANDLE_END);
+    if (Tracer::Enabled() && !trace_.ts[TRACE_PARSE_END]) {
+      trace_.ts[TRACE_PARSE_END] = trace_.ts[TRACE_HANDLE_END];  // 请求有误，没有经过DoRequest()
+    }
+    // 根据解析HTTP请求报文得到的结果，进行生成响应报文
+    int64_t queued = out_queue_.Bytes();
+    bool write_ret = ProcessWrite(read_ret);
+    if (!write_ret) {
+      CloseConn();
+      return false;
+    }
+    if (upstream_ || body_.Active()) {
+      // 请求转发给了上游服务器或者正在接收实体，结束后再记录这个请求(见EndProxy()和EndBody())
+      proxy_start_us_ = start_us;
+      return true;
+    }
+    if (!FinishRequest(start_us, out_queue_.Bytes() - queued)) {
+      return true;
+    }
+  }
+}
+
+bool HttpConn::FinishRequest(int64_t start_us, int64_t bytes) {
+  Trace(TRACE_RESPONSE);
+  PROBE_PARSE_END(sockfd_, status_, url_);
+  int64_t end_us = Metrics::NowUs();
+  // 请求行有误时没有经过DoRequest()
+  if (!handle_us_) {
+    handle_us_ = end_us;
+  }
+  ThreadMetrics* metrics = Metrics::Local();
+  metrics->requests[status_].Add();
+  metrics->parse_us.Record(handle_us_ > start_us ? handle_us_ - start_us : 0);
+  if (responses_queued_++ == 0) {
+    ttlb_start_us_ = recv_us_;
+    if (Tracer::Enabled()) {
+      // 流水线上一起发送的响应只追踪第一个
+      SavePendingTrace(bytes);
+    }
+  }
+  if (AccessLog::Enabled()) {
+    LogAccess(start_us, end_us, bytes);
+  }
+  if (!is_linger_) {
+    // 短连接，发送完响应后关闭连接，后面的请求不再处理
+    close_after_flush_ = true;
+    read_more_ = false;
+    return false;
+  }
+  InitRequest();
+  if (read_idx_ == 0) {
+    return false;
+  }
+  if (WRITE_BUFFER_SIZE - write_idx_ < MIN_RESPONSE_ROOM || out_queue_.FreeSegments() < 2) {
+    // 写缓冲区或者发送队列没有空间了，等发送完之后再处理剩下的请求
+    request_pending_ = true;
+    return false;
+  }
+  return true;
 }
 
 // 主状态机，解析请求
@@ -266,8 +738,8 @@ HttpConn::HTTP_CODE HttpConn::ProcessRead()
       }
       case CHECK_STATE_HEADER: {
         ret = ParseHeader(text);       // 解析请求头
-        if (ret == BAD_REQUEST) {
-          return BAD_REQUEST;
+        if (ret == BAD_REQUEST || ret == PAYLOAD_TOO_LARGE) {
+          return ret;
         } else if (ret == GET_REQUEST) {
           // 在请求行和请求头都解析成功之后就可以进行响应了(HTTP请求报文可以没有请求实体)
           return DoRequest();  // 进行响应
@@ -293,70 +765,132 @@ HttpConn::HTTP_CODE HttpConn::ProcessRead()
 }
 
 bool HttpConn::ProcessWrite(HTTP_CODE ret) {
+  int header_start = write_idx_;  // 写缓冲区中可能还有流水线上前面的响应尚未发送
   switch (ret) {
     case INTERNAL_ERROR: {
-      AddStatusLine(500, error_500_title);
-      AddHeaders(strlen(error_500_form));  // 传入响应实体的长度作为content-length返回
-      if (!AddContent(error_500_form)) {
+      if (!AddErrorResponse(500)) {
         // HTTP响应报文(加上响应实体后)超出写缓冲区的大小
         return false;
       }
       break;
     }
     case BAD_REQUEST: {
-      AddStatusLine(400, error_400_title);
-      AddHeaders(strlen(error_400_form));
-      if (!AddContent(error_400_form)) {
+      if (!AddErrorResponse(400)) {
         return false;
       }
       break;
     }
     case NO_RESOURCE: {
-      AddStatusLine(400, error_404_title);
-      AddHeaders(strlen(error_404_form));
-      if (!AddContent(error_404_form)) {
+      if (!AddErrorResponse(404)) {
+        return false;
+      }
+      break;
+    }
+    case TOO_MANY_REQUESTS: {
+      if (!AddErrorResponse(429)) {
+        return false;
+      }
+      break;
+    }
+    case METHOD_NOT_ALLOWED: {
+      if (!AddErrorResponse(405)) {
+        return false;
+      }
+      break;
+    }
+    case PAYLOAD_TOO_LARGE: {
+      if (!AddErrorResponse(413)) {
         return false;
       }
       break;
     }
     case FORBIDDEN_REQUEST: {
-      AddStatusLine(400, error_403_title);
-      AddHeaders(strlen(error_403_form));
-      if (!AddContent(error_403_form)) {
+      if (!AddErrorResponse(403)) {
+        return false;
+      }
+      break;
+    }
+    case RANGE_NOT_SATISFIABLE: {
+      // 416响应需要通过Content-Range: bytes */size告知客户端文件的实际大小
+      AddStatusLine(416);
+      AddDate();
+      AddLinger();
+      AddContentRange();
+      if (!AddPiece(ResponseTemplate::ErrorTail(416))) {
         return false;
       }
       break;
     }
+    case ROUTE_REQUEST: {
+      return AddRouteResponse();
+    }
+    case CACHED_RESPONSE: {
+      return AddCachedResponse();
+    }
+    case PARTIAL_REQUEST:
     case FILE_REQUEST: {
-      AddStatusLine(200, ok_200_title);
+      AddStatusLine(ret == PARTIAL_REQUEST ? 206 : 200);
+      AddDate();
       if (file_stat_.st_size != 0) {  // 资源文件中有相应的内容
-        AddHeaders(file_stat_.st_size);  // 传入的HTTP响应体长度，包括HTML文件的大小(以字节为单位)
-        // 设置要分散写入的内存的起始地址和长度，以及写入块的数量
-        // 准备将资源文件(响应实体)和写缓冲区中的内容(响应行和响应报文)写入连接fd中
-        iv_[0].iov_base = write_buf_;
-        iv_[0].iov_len = write_idx_;
-        iv_[1].iov_base = file_address_;
-        iv_[1].iov_len = file_stat_.st_size;
-        iv_count_ = 2;
-        return true;
+        off_t body_len = range_end_ - range_start_ + 1;  // 响应实体的长度(Range请求时只是文件的一部分)
+        AddContentLength(body_len);
+        AddLinger();
+        AddContentType();
+        AddValidators();
+        if (ret == PARTIAL_REQUEST) {
+          AddContentRange();
+        }
+        AddBlankLine();
+        // 将写缓冲区中的内容(响应行和响应报文)和资源文件(响应实体)加入发送队列
+        // 文件交给发送队列管理，发送时按窗口映射，发送完后关闭
+        int fd = file_fd_;
+        file_fd_ = -1;
+        return out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start) &&
+               out_queue_.AddFile(fd, range_start_, body_len);
       } else {
         // 资源文件存在但没有内容
-        const char* ok_string = "<html><body></body></html>";
-        AddHeaders(strlen(ok_string)); 
-        if (!AddContent(ok_string)) {
+        static const char ok_string[] = "<html><body></body></html>";
+        AddHeaders(sizeof(ok_string) - 1);
+        if (!AddPiece(ok_string, sizeof(ok_string) - 1)) {
           return false;
         }
       }
+      break;
     }
     default: {
       return false;
     }
   }
   // 若没有获取资源文件，只需要将写缓冲区的内容(即响应行和响应头部)写到连接fd中即可
-  iv_[0].iov_base = write_buf_;
-  iv_[0].iov_len = write_idx_;
-  iv_count_ = 1;
-  return true;
+  return out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start);
+}
+
+void HttpConn::SavePendingTrace(int64_t bytes) {
+  pending_trace_ = trace_;
+  pending_trace_.fd = sockfd_;
+  pending_trace_.status = status_;
+  pending_trace_.bytes = bytes;
+  snprintf(pending_trace_.url, sizeof(pending_trace_.url), "%s", url_ ? url_ : "-");
+  trace_pending_ = true;
+  // 流水线上的后续请求与这个请求共享读取和排队阶段
+  memset(trace_.ts + TRACE_PARSE_START, 0, (TRACE_PHASE_COUNT - TRACE_PARSE_START) * sizeof(uint64_t));
+}
+
+void HttpConn::LogAccess(int64_t start_us, int64_t end_us, int64_t bytes) {
+  int64_t handle_us = handle_us_;
+  AccessRecord record;
+  memset(&record, 0, sizeof(record));
+  record.time_us = recv_us_;
+  record.bytes = bytes;
+  record.client_ip = address_.sin_addr.s_addr;
+  record.wait_us = start_us > recv_us_ ? start_us - recv_us_ : 0;
+  record.parse_us = handle_us > start_us ? handle_us - start_us : 0;
+  record.handle_us = end_us > handle_us ? end_us - handle_us : 0;
+  record.client_port = address_.sin_port;
+  record.status = status_;
+  record.method = method_;
+  record.flags = (is_linger_ ? ACCESS_KEEP_ALIVE : 0) | (status_ == 206 ? ACCESS_RANGE : 0);
+  AccessLog::Append(&record, url_);
 }
 
 // 解析HTTP请求行，获得请求方法，目标URL，HTTP版本
@@ -372,12 +906,15 @@ HttpConn::HTTP_CODE HttpConn::ParseRequestLine(char *text)
   *url_++ = '\0';
   char* method = text;  // 得到请求方法(因为遇到字符串结束符)
   // strcasecmp大小写不敏感
-  // 这个版本只解析GET
-  if (strcasecmp(method, "GET") == 0) {
-    method_ = GET;
-  } else {
+  int i = 0;
+  while (i < Router::METHODS && strcasecmp(method, method_names[i]) != 0) {
+    ++i;
+  }
+  // TRACE会把请求(包括Cookie)原样返回，CONNECT用于建立隧道，都不支持
+  if (i == Router::METHODS || i == TRACE || i == CONNECT) {
     return BAD_REQUEST;
   }
+  method_ = (METHOD)i;
   // /index.html HTTP/1.1
   version_ = strpbrk(url_, " \t");
   if (!version_) {
@@ -385,9 +922,15 @@ HttpConn::HTTP_CODE HttpConn::ParseRequestLine(char *text)
   }
   // /index.html\0HTTP/1.1
   *version_++ = '\0';
-  if (strcasecmp(version_, "HTTP/1.1") != 0) {
+  // RFC 7230: HTTP/1.1默认是长连接，HTTP/1.0只有带Connection: keep-alive时才是
+  if (strcasecmp(version_, "HTTP/1.1") == 0) {
+    http11_ = true;
+  } else if (strcasecmp(version_, "HTTP/1.0") == 0) {
+    http11_ = false;
+  } else {
     return BAD_REQUEST;
   }
+  is_linger_ = http11_;
   // http://192.168.1.1:10000/index.html  有的url是这种类型的
   if (strncasecmp(url_, "http://", 7) == 0) {
     // 192.168.1.1:10000/indel.html
@@ -401,6 +944,7 @@ HttpConn::HTTP_CODE HttpConn::ParseRequestLine(char *text)
     return BAD_REQUEST;
   }
   
+  header_start_ = start_line_;        // ProcessRead()已经把start_line_移到了下一行
   check_state_ = CHECK_STATE_HEADER;  // 主状态机变成检查请求头
   return NO_REQUEST;
 }
@@ -409,8 +953,28 @@ HttpConn::HTTP_CODE HttpConn::ParseHeader(char *text)
 {
   // 遇到空行，表示头部字段解析完毕
   if (text[0] == '\0') {  // 这里'\0'是在parseline中插入的
+    if (http11_ && !host_) {
+      return BAD_REQUEST;   // HTTP/1.1的请求必须带Host
+    }
+    if (body_chunked_ && content_length_seen_) {
+      return BAD_REQUEST;   // 两者同时出现时(包括Content-Length: 0)前后的代理可能对实体的边界理解不同(请求走私)
+    }
+    if (content_length_ > max_body_size_) {
+      return PAYLOAD_TOO_LARGE;
+    }
+    // 读缓冲区放不下的实体和chunked编码的实体不读入内存，由路由的处理函数决定是否接收(见StartBody())
+    if (body_chunked_ || checked_idx_ + content_length_ > READ_BUFFER_SIZE) {
+      stream_body_ = true;
+      return GET_REQUEST;
+    }
     // 若HTTP还有消息体，则需要将状态机转移到CONTENT状态
     if (content_length_ != 0) {
+      if (expect_continue_ && http11_ && read_idx_ == checked_idx_) {
+        // 客户端在等待100 Continue才发送实体
+        static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        out_queue_.AddBuffer(continue_line, sizeof(continue_line) - 1);
+        expect_continue_ = false;
+      }
       check_state_ = CHECK_STATE_CONTENT;
       return NO_REQUEST;
     } else {
@@ -419,32 +983,66 @@ HttpConn::HTTP_CODE HttpConn::ParseHeader(char *text)
     }
   } else if (strncasecmp(text, "Host:", 5) == 0) {
     text += 5;
-    host_ = strchr(text, ' ');
-    if (!host_) {
-      return BAD_REQUEST;
-    }
-    host_++;
-    port_ = strpbrk(host_, ":");
-    if (!port_) {
-      return BAD_REQUEST;
+    host_ = text + strspn(text, " \t");
+    // 端口是可选的，不截断host_，转发请求时头部要保持原样
+    port_ = strchr(host_, ':');
+    if (port_) {
+      ++port_;
     }
-    *port_++ = '\0';
   } else if (strncasecmp(text, "Connection:", 11) == 0) {
     text += 11;
-    // 跳过第一个空字符或者"\t"
-    text += strspn(text, " \t");
-    if (strcasecmp(text, "keep-alive") == 0) {
-      is_linger_ = true;
+    // 值是逗号分隔的选项列表(如"keep-alive, Upgrade")，close优先
+    while (*text) {
+      text += strspn(text, " \t,");
+      int len = strcspn(text, " \t,");
+      if (len == 5 && strncasecmp(text, "close", 5) == 0) {
+        is_linger_ = false;
+        break;
+      } else if (len == 10 && strncasecmp(text, "keep-alive", 10) == 0) {
+        is_linger_ = true;
+      }
+      text += len;
     }
+  } else if (strncasecmp(text, "Range:", 6) == 0) {
+    // 只记录下来，等到DoRequest()获取文件大小后再解析
+    text += 6;
+    text += strspn(text, " \t");
+    range_ = text;
+  } else if (strncasecmp(text, "If-Range:", 9) == 0) {
+    text += 9;
+    text += strspn(text, " \t");
+    if_range_ = text;
   } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
     text += 15;
     // 跳过第一个空字符或者"\t"
     text += strspn(text, " \t");
-    content_length_ = atol(text);
+    char* end = NULL;
+    errno = 0;
+    long long length = strtoll(text, &end, 10);
+    if (end == text || length < 0 || errno == ERANGE || *(end + strspn(end, " \t")) != '\0') {
+      return BAD_REQUEST;
+    }
+    // 多个值不同的Content-Length无法确定实体的边界(RFC 7230 3.3.2)，上游可能取另一个值
+    if (content_length_seen_ && length != content_length_) {
+      return BAD_REQUEST;
+    }
+    content_length_ = length;
+    content_length_seen_ = true;
+  } else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0) {
+    text += 18;
+    text += strspn(text, " \t");
+    // 只支持chunked，其他编码(gzip等)不解码就无法确定实体的边界
+    int len = strcspn(text, " \t");
+    if (len != 7 || strncasecmp(text, "chunked", 7) != 0 || *(text + len + strspn(text + len, " \t")) != '\0') {
+      return BAD_REQUEST;
+    }
+    body_chunked_ = true;
+  } else if (strncasecmp(text, "Expect:", 7) == 0) {
+    text += 7;
+    text += strspn(text, " \t");
+    expect_continue_ = strcasecmp(text, "100-continue") == 0;
   } else {
-#if LOG
-    printf("未考虑解析的头部: %s\n", text);
-#endif
+    LOG_DEBUG("未考虑解析的头部: %s", text);
   }
   return NO_REQUEST;
 }
@@ -453,8 +1051,9 @@ HttpConn::HTTP_CODE HttpConn::ParseHeader(char *text)
 HttpConn::HTTP_CODE HttpConn::ParseContent(char *text)
 {
   // content_length_为请求实体的长度
+  // 请求实体不加字符串结束符，后面紧接着的可能是流水线上的下一个请求
   if (read_idx_ >= (content_length_ + checked_idx_)) {  // 说明有请求实体
-    text[content_length_] = '\0';
+    checked_idx_ += content_length_;  // 跳过请求实体，后面的数据属于流水线上的下一个请求
     return GET_REQUEST;
   } else {
     return NO_REQUEST;
@@ -499,6 +1098,31 @@ HttpConn::LINE_STATUS HttpConn::ParseLine()
 
 HttpConn::HTTP_CODE HttpConn::DoRequest()
 {
+  handle_us_ = Metrics::NowUs();
+  Trace(TRACE_PARSE_END);
+  // 超过速率限制的请求在查找文件之前就返回预先生成的429
+  if (RateLimiter::Enabled() && !RateLimiter::AllowRequest(address_.sin_addr.s_addr)) {
+    return TOO_MANY_REQUESTS;
+  }
+  // 没有注册路由时不做匹配；没有匹配的路由时按静态文件处理
+  if (!Router::Empty()) {
+    route_ = Router::Match(method_, url_, &route_request);
+    cache_key_len = -1;
+    if (route_) {
+      if (stream_body_) {
+        route_request.body_state = RouteRequest::BODY_STREAMING;
+      } else if (content_length_ > 0) {
+        // ParseContent()已经跳过了实体
+        route_request.body_state = RouteRequest::BODY_BUFFERED;
+        route_request.body = read_buf_ + checked_idx_ - content_length_;
+        route_request.body_len = content_length_;
+      }
+      return route_->cache && LookupCache() ? CACHED_RESPONSE : ROUTE_REQUEST;
+    }
+  }
+  if (method_ != GET) {
+    return METHOD_NOT_ALLOWED;   // 静态文件只支持GET
+  }
   // "/home/moksha/webserver/resources"  服务器资源
   strcpy(real_file_, doc_root);
   int len = strlen(doc_root);
@@ -515,73 +1139,804 @@ HttpConn::HTTP_CODE HttpConn::DoRequest()
     // 请求的资源得是一个文件而不是目录
     return BAD_REQUEST;
   }
-  // 以只读权限打开资源
-  int fd = open(real_file_, O_RDONLY);
-  // PORT_READ描述该映射区域的保护权限(Protection)
-  // mmap成功时将返回指向该映射区域的指针
-  // 将资源文件映射到内存中。第一个参数为NULL内核会自动选择一个地址进行映射
-  // MAP_PRIVATE表示更新这段区域对其他进程是不可见的
-  file_address_ = mmap(NULL, file_stat_.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);  // mmap成功返回后要用close关闭fd
-  return FILE_REQUEST;  // 返回文件请求成功状态
+  // 默认发送整个文件
+  HTTP_CODE ret = FILE_REQUEST;
+  range_start_ = 0;
+  range_end_ = file_stat_.st_size - 1;
+  // 带有Range请求头且If-Range校验通过时只发送请求的范围
+  if (range_ && IfRangeMatch()) {
+    ret = ParseRange();
+    if (ret == RANGE_NOT_SATISFIABLE) {
+      range_end_ = -1;  // 416响应中的Content-Range为bytes */size
+      return ret;
+    }
+  }
+  if (file_stat_.st_size == 0) {
+    return ret;
+  }
+  // 以只读权限打开资源，文件在发送时才按窗口映射到内存中(见MapWindow())
+  file_fd_ = open(real_file_, O_RDONLY);
+  if (file_fd_ < 0) {
+    return NO_RESOURCE;
+  }
+  return ret;  // 返回文件请求成功状态
+}
+
+// 解析Range请求头，目前只支持单个范围:
+// bytes=first-last, bytes=first-(到文件末尾), bytes=-suffix(最后suffix个字节)
+// 语法错误或者多个范围时忽略Range，返回整个文件(RFC 7233允许服务器忽略Range)
+HttpConn::HTTP_CODE HttpConn::ParseRange() {
+  const char* text = range_;
+  off_t size = file_stat_.st_size;
+  if (strncasecmp(text, "bytes=", 6) != 0) {
+    return FILE_REQUEST;
+  }
+  text += 6;
+  text += strspn(text, " \t");
+  if (strchr(text, ',')) {
+    // 多个范围需要multipart/byteranges响应，暂不支持
+    return FILE_REQUEST;
+  }
+  char* end = NULL;
+  off_t first = -1, last = -1;
+  if (*text == '-') {
+    // bytes=-suffix
+    ++text;
+    if (*text < '0' || *text > '9') {
+      return FILE_REQUEST;
+    }
+    off_t suffix = strtoll(text, &end, 10);
+    if (*(end + strspn(end, " \t")) != '\0') {
+      return FILE_REQUEST;
+    }
+    if (suffix == 0) {
+      return RANGE_NOT_SATISFIABLE;
+    }
+    first = suffix >= size ? 0 : size - suffix;
+    last = size - 1;
+  } else {
+    if (*text < '0' || *text > '9') {
+      return FILE_REQUEST;
+    }
+    first = strtoll(text, &end, 10);
+    if (*end != '-') {
+      return FILE_REQUEST;
+    }
+    text = end + 1;
+    if (*text >= '0' && *text <= '9') {
+      last = strtoll(text, &end, 10);
+      if (last < first) {
+        return FILE_REQUEST;
+      }
+    } else {
+      end = (char*)text;
+      last = size - 1;
+    }
+    if (*(end + strspn(end, " \t")) != '\0') {
+      return FILE_REQUEST;
+    }
+  }
+  if (first >= size) {
+    return RANGE_NOT_SATISFIABLE;
+  }
+  if (last >= size) {
+    last = size - 1;
+  }
+  range_start_ = first;
+  range_end_ = last;
+  return PARTIAL_REQUEST;
+}
+
+// If-Range的值可以是ETag也可以是HTTP日期，与当前文件的验证器完全相同时Range才生效，
+// 否则说明文件已经改变，需要发送整个文件
+bool HttpConn::IfRangeMatch() {
+  if (!if_range_) {
+    return true;
+  }
+  if (if_range_[0] == '"') {
+    char etag[64];
+    int len = FormatETag(etag);
+    return strncmp(if_range_, etag, len) == 0 && if_range_[len] == '\0';
+  }
+  if (strncmp(if_range_, "W/", 2) == 0) {
+    // 弱验证器不能用于If-Range
+    return false;
+  }
+  struct tm tm;
+  bzero(&tm, sizeof(tm));
+  if (!strptime(if_range_, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+    return false;
+  }
+  return timegm(&tm) == file_stat_.st_mtime;
 }
 
 void HttpConn::unmap() {
-  if (file_address_ != (void*)(-1)) {  // mmap失败时返回-1
-    munmap(file_address_, file_stat_.st_size);
-    file_address_ = 0;
+  out_queue_.Clear();
+  if (file_fd_ >= 0) {
+    close(file_fd_);
+    file_fd_ = -1;
   }
 }
 
-// 可变参数函数，format为printf所需要的格式符
-bool HttpConn::AddResponse(const char* format, ...) {
-  if (write_idx_ >= WRITE_BUFFER_SIZE) {   
+// 响应报文的各个部分都是直接memcpy到写缓冲区中
+bool HttpConn::AddPiece(const char* data, int len) {
+  if (write_idx_ + len > WRITE_BUFFER_SIZE) {
     // 若写入写缓冲区的数据大于写缓冲的大小
     return false;
   }
-  // 需要用到以下宏支持可变参数
-  va_list arg_list;
-  // va_start第二个参数为可变参数之前的参数。初始化可变参数列表，将arg_list指向第一个可变参数
-  va_start(arg_list, format);
+  memcpy(write_buf_ + write_idx_, data, len);
+  write_idx_ += len;  // 更新已写入缓冲区的字节数(char刚好为1字节)
+  return true;
+}
+
+bool HttpConn::AddPiece(Piece piece) {
+  return AddPiece(piece.data, piece.len);
+}
+
+bool HttpConn::AddStatusLine(int status) {
+  status_ = status;
+  return AddPiece(ResponseTemplate::StatusLine(status));
+}
+
+// 错误响应只有Date和Connection头部是变化的，其余部分(包括错误页面)都是预先生成的
+bool HttpConn::AddErrorResponse(int status) {
+  return AddStatusLine(status) && AddDate() && AddLinger() &&
+         AddPiece(ResponseTemplate::ErrorTail(status));
+}
+
+// 处理函数返回之后才知道状态码和头部，响应实体拷贝到arena_中，与头部一起加入发送队列
+bool HttpConn::AddRouteResponse() {
+  int header_start = write_idx_;
+  RouteResponse response(RenderBuffer());
+  bool ok = route_->handler(route_request, &response, route_->arg);
+  // 实体接收完之后的第二次调用(见EndBody())只生成响应
+  bool first_call = route_request.body_state != RouteRequest::BODY_RECEIVED;
+  if (ok && first_call && response.BodyFd() >= 0) {
+    body_fd_ = response.BodyFd();
+    body_arg_ = response.BodyArg();
+    StartBody(body_fd_, false);
+    return true;
+  }
+  if (ok && first_call && response.Upstream()) {
+    if (cache_key_len >= 0) {
+      // 转发的响应边转发边保存，转发期间可能换线程，键复制到连接中
+      proxy_cache_ = route_->cache;
+      cache_key_.assign(cache_key, cache_key_len);
+    }
+    if (StartProxy(response.Upstream(), false, NULL)) {
+      return true;
+    }
+    // 没有健康的上游服务器或者连接失败
+    if (stream_body_) {
+      is_linger_ = false;
+    }
+    if (LookupStale(cache_key, cache_key_len)) {
+      return AddCachedResponse();
+    }
+    return AddErrorResponse(502) &&
+           out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start);
+  }
+  if (stream_body_ && first_call) {
+    is_linger_ = false;   // 处理函数没有接收实体，实体还在socket中
+  }
+  if (!ok || ResponseTemplate::StatusLine(response.Status()).len == 0 || response.Status() >= 500) {
+    if (LookupStale(cache_key, cache_key_len)) {
+      return AddCachedResponse();
+    }
+  }
+  if (!ok || ResponseTemplate::StatusLine(response.Status()).len == 0) {
+    return AddErrorResponse(500) &&
+           out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start);
+  }
+  const std::string& body = *response.Body();
+  if (cache_key_len >= 0) {
+    static thread_local std::string head;
+    FormatRouteHead(response, &head);
+    if (MicroCache::Cacheable(response.Status(), head.data(), head.size())) {
+      MicroCache::Store(cache_key, cache_key_len, route_->cache, response.Status(), head.data(), head.size(),
+                        body.data(), body.size());
+    }
+  }
+  const char* data = NULL;
+  bool no_body = response.Status() == 204 || response.Status() == 304;
+  if (!body.empty() && !no_body) {
+    data = arena_.Copy(body.data(), body.size());
+    if (!data) {
+      return false;
+    }
+  }
+  const char* type = response.ContentType();
+  if (!(AddStatusLine(response.Status()) && AddDate() && (no_body || AddContentLength(body.size())) &&
+        AddLinger() && AddPiece("Content-Type: ", 14) && AddPiece(type, strlen(type)) &&
+        AddPiece("\r\n", 2) && AddPiece(response.Headers(), response.HeadersLen()) &&
+        AddBlankLine())) {
+    return false;
+  }
+  return out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start) &&
+         (!data || out_queue_.AddBuffer(data, body.size()));
+}
 
-  // 将可变参数(响应报文的字符串信息)打印到write_buf_中, 成功返回打印的字符个数
-  // 传入的参数都为字符串类型
-  int len = vsnprintf(write_buf_ + write_idx_, WRITE_BUFFER_SIZE - 1 - write_idx_, format, arg_list);
-  if (len >= (WRITE_BUFFER_SIZE - 1 - write_idx_)) {  // 若超出了写缓冲区的大小
+// 缓存键: 方法、URL、Host和Accept-Encoding(上游可能按它压缩)，用'\n'分隔；只缓存GET，
+// 带Authorization或者Cookie的请求的响应可能因人而异，不查找也不保存；没有Host时后台刷新无法转发，也不缓存
+int HttpConn::FormatCacheKey(char* buf, int size) {
+  if (method_ != GET || !host_) {
+    return -1;
+  }
+  const char* encoding = "";
+  for (const char* line = read_buf_ + header_start_; *line; line += strlen(line) + 2) {
+    if (strncasecmp(line, "Authorization:", 14) == 0 || strncasecmp(line, "Cookie:", 7) == 0) {
+      return -1;
+    } else if (strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+      encoding = line + 16 + strspn(line + 16, " \t");
+    }
+  }
+  int len = 0;
+  bool ok = AppendTo(buf, size, &len, "GET ", 4) && AppendTo(buf, size, &len, url_, strlen(url_)) &&
+            AppendTo(buf, size, &len, "\n", 1) && AppendTo(buf, size, &len, host_, strlen(host_)) &&
+            AppendTo(buf, size, &len, "\n", 1) && AppendTo(buf, size, &len, encoding, strlen(encoding));
+  return ok ? len : -1;
+}
+
+// 新鲜的响应直接回复；过期但在stale-while-revalidate窗口内的也直接回复，第一个看到过期的请求提交后台刷新
+bool HttpConn::LookupCache() {
+  cache_key_len = FormatCacheKey(cache_key, sizeof(cache_key));
+  if (cache_key_len < 0) {
     return false;
   }
-  write_idx_ += len;  // 更新已写入缓冲区的字节数(char刚好为1字节)
-  va_end(arg_list);   // 清理va_list变量的内存，将arg_list置为NULL
+  bool refresh = false;
+  MicroCache::RESULT result = MicroCache::Lookup(cache_key, cache_key_len, false, &arena_,
+                                                 &cached_response, &refresh);
+  ThreadMetrics* metrics = Metrics::Local();
+  if (result == MicroCache::CACHE_MISS) {
+    metrics->cache_misses.Add();
+    return false;
+  }
+  (result == MicroCache::CACHE_HIT ? metrics->cache_hits : metrics->cache_stale).Add();
+  if (refresh) {
+    RefreshJob* job = new RefreshJob;
+    job->key.assign(cache_key, cache_key_len);
+    job->url = url_;
+    job->policy = route_->cache;
+    // 路由是反向代理时刷新线程转发这个请求，先按转发的格式直接写进任务
+    job->request.resize(UpstreamConn::BUFFER_SIZE);
+    int len = FormatUpstreamRequest(&job->request[0], (int)job->request.size(), NULL);
+    job->request.resize(len > 0 ? len : 0);
+    MicroCache::Refresh(job);
+  }
   return true;
 }
 
-bool HttpConn::AddStatusLine(int status, const char* title) {
-  return AddResponse("%s %d %s\r\n", "HTTP/1.1", status, title);
+bool HttpConn::LookupStale(const char* key, int key_len) {
+  bool refresh = false;
+  if (key_len < 0 ||
+      MicroCache::Lookup(key, key_len, true, &arena_, &cached_response, &refresh) == MicroCache::CACHE_MISS) {
+    return false;
+  }
+  Metrics::Local()->cache_stale_errors.Add();
+  return true;
 }
 
-void HttpConn::AddHeaders(int content_length) {
+// 命中的响应复制在arena_中，头部之后预留的空间写上Date等变化的头部，头部和实体两段加入发送队列
+bool HttpConn::AddCachedResponse() {
+  const CachedResponse& cached = cached_response;
+  status_ = cached.status;
+  int header_start = write_idx_;
+  char age[32] = "Age: ";
+  int age_len = 5;
+  age_len += ResponseTemplate::FormatUint(age + age_len, cached.age);
+  age[age_len++] = '\r';
+  age[age_len++] = '\n';
+  if (!(AddDate() && AddContentLength(cached.body_len) && AddPiece(age, age_len) &&
+        (cached.stale ? AddPiece("X-Cache: STALE\r\n", 16) : AddPiece("X-Cache: HIT\r\n", 14)) &&
+        AddLinger() && AddBlankLine())) {
+    return false;
+  }
+  int extra = write_idx_ - header_start;
+  if (extra > MicroCache::EXTRA_HEADERS_SIZE) {
+    return false;
+  }
+  memcpy(cached.head + cached.head_len, write_buf_ + header_start, extra);
+  write_idx_ = header_start;
+  return out_queue_.AddBuffer(cached.head, cached.head_len + extra) &&
+         (cached.body_len == 0 || out_queue_.AddBuffer(cached.body, cached.body_len));
+}
+
+void HttpConn::StartBody(int sink, bool raw) {
+  if (expect_continue_ && http11_ && stream_body_ && checked_idx_ == read_idx_) {
+    // 客户端在等待100 Continue才发送实体，处理函数决定接收之后才回复
+    static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    out_queue_.AddBuffer(continue_line, sizeof(continue_line) - 1);
+    expect_continue_ = false;
+  }
+  if (!stream_body_) {
+    checked_idx_ -= content_length_;   // 已经读入的实体也经过RequestBody写出，ParseContent()跳过了它
+  }
+  body_base_ = checked_idx_;
+  body_.Start(body_chunked_ ? -1 : content_length_, max_body_size_, sink, raw);
+}
+
+// 读缓冲区中[checked_idx_, read_idx_)是还没有处理的数据，实体结束之后checked_idx_指向流水线上的下一个请求
+RequestBody::STATUS HttpConn::PumpBody() {
+  int64_t received = body_.Received();
+  RequestBody::STATUS status = body_.Pump(sockfd_, read_buf_, body_base_, READ_BUFFER_SIZE,
+                                          &checked_idx_, &read_idx_);
+  if (body_.Received() != received) {
+    Metrics::Local()->body_bytes_in.Add(body_.Received() - received);
+    AdjustTimer();   // 大的实体接收时间可能远超过超时时间
+  }
+  return status;
+}
+
+bool HttpConn::BodyIO() {
+  if (!Write()) {    // 100 Continue
+    return false;
+  }
+  RequestBody::STATUS status = PumpBody();
+  if (status == RequestBody::BODY_AGAIN) {
+    return true;     // 等待客户连接上的EPOLLIN
+  } else if (status == RequestBody::BODY_SINK_AGAIN) {
+    status = RequestBody::BODY_SINK_ERROR;   // 接收方是文件，没有可写事件可以等待
+  }
+  return EndBody(status);
+}
+
+bool HttpConn::EndBody(RequestBody::STATUS status) {
+  int64_t received = body_.Received();
+  int header_start = write_idx_;
+  int64_t queued = out_queue_.Bytes();
+  if (status != RequestBody::BODY_DONE) {
+    LOG_WARN("接收请求实体失败(%d)，已经收到%lld字节", status, (long long)received);
+    AbortBody();
+    if (status == RequestBody::BODY_CLOSED) {
+      return false;
+    }
+    // 实体没有读完，后面的数据无法确定请求的边界，回复之后关闭连接
+    is_linger_ = false;
+    int code = status == RequestBody::BODY_TOO_LARGE ? 413 : status == RequestBody::BODY_BAD ? 400 : 500;
+    if (!AddErrorResponse(code) || !out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start)) {
+      return false;
+    }
+  } else {
+    body_.Finish();
+    // 接收期间可能换了工作线程，线程的RouteRequest要重新匹配
+    route_ = Router::Match(method_, url_, &route_request);
+    if (!route_) {
+      return false;
+    }
+    cache_key_len = -1;
+    route_request.body_state = RouteRequest::BODY_RECEIVED;
+    route_request.body_len = received;
+    route_request.body_fd = body_fd_;
+    route_request.body_arg = body_arg_;
+    body_fd_ = -1;
+    if (!AddRouteResponse()) {
+      return false;
+    }
+  }
+  read_more_ = true;   // Content-Length的实体之后socket中可能还有流水线上的请求
+  if (FinishRequest(proxy_start_us_, out_queue_.Bytes() - queued)) {
+    request_pending_ = true;
+  }
+  return true;
+}
+
+void HttpConn::AbortBody() {
+  body_.Finish();
+  if (body_fd_ < 0) {
+    return;          // 转发给上游的实体随上游连接一起关闭
+  }
+  RouteRequest request;
+  const Route* route = Router::Match(method_, url_, &request);
+  if (route) {
+    request.body_state = RouteRequest::BODY_FAILED;
+    request.body_len = body_.Received();
+    request.body_fd = body_fd_;
+    request.body_arg = body_arg_;
+    std::string body;
+    RouteResponse response(&body);
+    route->handler(request, &response, route->arg);
+  } else {
+    close(body_fd_);
+  }
+  body_fd_ = -1;
+}
+
+bool HttpConn::StartProxy(UpstreamGroup* group, bool fresh, const Backend* avoid) {
+  UpstreamConn* up = Proxy::Connect(group, this, epollfd_, fresh, avoid);
+  if (!up) {
+    return false;
+  }
+  int len = FormatUpstreamRequest(up->Buffer(), UpstreamConn::BUFFER_SIZE, up->GetBackend());
+  if (len < 0) {
+    Proxy::Finish(up, false, false);
+    return false;
+  }
+  up->StartRequest(len, method_ == HEAD, stream_body_);
+  if (stream_body_) {
+    // 实体在请求头部发送之后转发(见ProxyIO()中的SEND_BODY)，chunked编码原样转发
+    body_fd_ = -1;
+    StartBody(up->Fd(), true);
+  }
+  if (!nodelay_) {
+    // 转发的响应分多次写出(头部、实体、splice)，最后不满一个报文段的数据不能等前面的ACK
+    int on = 1;
+    setsockopt(sockfd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    nodelay_ = true;
+  }
+  upstream_ = up;
+  upstream_group_ = group;
+  proxy_bytes_ = 0;
+  proxy_dechunk_ = !http11_;
+  return true;
+}
+
+// 转发的请求: 请求行改为HTTP/1.1，去掉逐跳的头部，加上X-Forwarded-For，放不下时返回-1
+int HttpConn::FormatUpstreamRequest(char* buf, int size, const Backend* backend) {
+  char client_ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address_.sin_addr, client_ip, sizeof(client_ip));
+  int ip_len = strlen(client_ip);
+  const char* method = method_names[method_];
+  int len = 0;
+  bool ok = AppendTo(buf, size, &len, method, strlen(method)) && AppendTo(buf, size, &len, " ", 1) &&
+            AppendTo(buf, size, &len, url_, strlen(url_)) && AppendTo(buf, size, &len, " HTTP/1.1\r\n", 11);
+  bool forwarded = false;
+  // ParseLine()把每行结尾的\r\n换成了两个'\0'
+  for (const char* line = read_buf_ + header_start_; ok && *line; line += strlen(line) + 2) {
+    // Content-Length在后面按解析出的长度写一个，客户端重复的头部不原样转发
+    if (IsHopByHop(line) || strncasecmp(line, "Content-Length:", 15) == 0) {
+      continue;
+    }
+    ok = AppendTo(buf, size, &len, line, strlen(line));
+    if (strncasecmp(line, "X-Forwarded-For:", 16) == 0) {
+      // 前面还有其他代理，追加客户端的地址
+      ok = ok && AppendTo(buf, size, &len, ", ", 2) && AppendTo(buf, size, &len, client_ip, ip_len);
+      forwarded = true;
+    }
+    ok = ok && AppendTo(buf, size, &len, "\r\n", 2);
+  }
+  if (!forwarded) {
+    ok = ok && AppendTo(buf, size, &len, "X-Forwarded-For: ", 17) &&
+         AppendTo(buf, size, &len, client_ip, ip_len) && AppendTo(buf, size, &len, "\r\n", 2);
+  }
+  if (!host_ && backend) {
+    // HTTP/1.0的请求可以没有Host，上游是HTTP/1.1，用上游的地址
+    ok = ok && AppendTo(buf, size, &len, "Host: ", 6) &&
+         AppendTo(buf, size, &len, backend->name, strlen(backend->name)) && AppendTo(buf, size, &len, "\r\n", 2);
+  }
+  if (content_length_seen_ && !body_chunked_) {
+    // chunked编码的实体只带Transfer-Encoding转发
+    char length[48] = "Content-Length: ";
+    int length_len = 16;
+    length_len += ResponseTemplate::FormatUint(length + length_len, content_length_);
+    length[length_len++] = '\r';
+    length[length_len++] = '\n';
+    ok = ok && AppendTo(buf, size, &len, length, length_len);
+  }
+  if (stream_body_) {
+    // 流式接收的实体由ProxyIO()在头部之后转发
+    ok = ok && (!body_chunked_ || AppendTo(buf, size, &len, "Transfer-Encoding: chunked\r\n", 28)) &&
+         AppendTo(buf, size, &len, "\r\n", 2);
+    return ok ? len : -1;
+  }
+  // 请求实体紧跟在空行之后，ParseContent()已经跳过了它
+  ok = ok && AppendTo(buf, size, &len, "\r\n", 2) &&
+       AppendTo(buf, size, &len, read_buf_ + checked_idx_ - content_length_, content_length_);
+  return ok ? len : -1;
+}
+
+// 发送队列中的数据先发送完，再转发上游的下一段数据；转发的实体经过arena_或者管道，
+// 发送队列和管道都清空之前不再读取上游，客户端的接收速度决定了从上游读取的速度
+bool HttpConn::ProxyIO() {
+  while (upstream_) {
+    if (!Write()) {
+      return false;
+    }
+    if (!out_queue_.Empty()) {
+      return true;   // 等待客户连接上的EPOLLOUT
+    }
+    UpstreamConn* up = upstream_;
+    if (up->PipeBytes() > 0) {
+      // 管道中的实体直接转移到客户连接，不经过用户空间
+      ssize_t n = splice(up->PipeRead(), NULL, sockfd_, NULL, up->PipeBytes(),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      up->PipeDrained(n);
+      proxy_bytes_ += n;
+      bytes_have_send_ += n;
+      Metrics::Local()->bytes_out.Add(n);
+      AdjustTimer();
+      continue;
+    }
+    UpstreamConn::IO_STATUS status = UpstreamConn::IO_OK;
+    switch (up->State()) {
+      case UpstreamConn::SEND_REQUEST: {
+        status = up->Send();
+        break;
+      }
+      case UpstreamConn::SEND_BODY: {
+        RequestBody::STATUS body = PumpBody();
+        if (body == RequestBody::BODY_DONE) {
+          body_.Finish();
+          read_more_ = true;   // Content-Length的实体之后socket中可能还有流水线上的请求
+          up->BodySent();
+        } else if (body == RequestBody::BODY_AGAIN || body == RequestBody::BODY_SINK_AGAIN) {
+          status = UpstreamConn::IO_AGAIN;
+        } else if (body == RequestBody::BODY_SINK_ERROR) {
+          status = UpstreamConn::IO_ERROR;
+        } else {
+          // 客户端的实体有误、超过上限或者连接关闭，上游连接上的请求不完整，不复用
+          Proxy::Finish(up, false, false);
+          upstream_ = NULL;
+          body_.Finish();
+          if (body == RequestBody::BODY_CLOSED) {
+            return false;
+          }
+          is_linger_ = false;
+          int header_start = write_idx_;
+          int64_t queued = out_queue_.Bytes();
+          if (!AddErrorResponse(body == RequestBody::BODY_TOO_LARGE ? 413 : 400) ||
+              !out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start)) {
+            return false;
+          }
+          proxy_bytes_ += out_queue_.Bytes() - queued;
+          return EndProxy();
+        }
+        break;
+      }
+      case UpstreamConn::READ_HEAD: {
+        status = up->ReadHead();
+        if (status == UpstreamConn::IO_OK && up->Status() >= 500 && proxy_cache_ &&
+            LookupStale(cache_key_.data(), cache_key_.size())) {
+          // 上游出错时回复stale-if-error窗口内的旧响应，上游连接上还有没读的实体，不复用
+          Proxy::Finish(up, false, false);
+          upstream_ = NULL;
+          int64_t queued = out_queue_.Bytes();
+          if (!AddCachedResponse()) {
+            return false;
+          }
+          proxy_bytes_ += out_queue_.Bytes() - queued;
+          return EndProxy();
+        }
+        // 和头部一起读到的实体也一起发送(MSG_MORE合并成一个报文段)
+        if (status == UpstreamConn::IO_OK &&
+            (!AddProxyHead() || (up->DataLen() > 0 && !AddProxyBody()))) {
+          return false;
+        }
+        break;
+      }
+      case UpstreamConn::READ_BODY: {
+        if (up->DataLen() > 0) {
+          if (!AddProxyBody()) {
+            return false;
+          }
+        } else if (up->BodyType() == UpstreamConn::BODY_CHUNKED || proxy_capture_) {
+          // chunked编码要解析才能找到结尾，要缓存的响应要经过用户空间，都不能splice
+          status = up->Recv();
+        } else {
+          status = up->SpliceIn(up->BodyType() == UpstreamConn::BODY_LENGTH ?
+                                up->Remaining() : UpstreamConn::PIPE_SIZE);
+        }
+        break;
+      }
+      case UpstreamConn::DONE: {
+        if (proxy_capture_) {
+          MicroCache::Store(cache_key_.data(), cache_key_.size(), proxy_cache_, status_, cache_buf_.data(),
+                            cache_head_len_, cache_buf_.data() + cache_head_len_,
+                            cache_buf_.size() - cache_head_len_);
+          proxy_capture_ = false;
+          if (cache_buf_.capacity() > Arena::BLOCK_SIZE) {
+            std::string().swap(cache_buf_);   // 大的响应不让空闲的连接一直占着
+          }
+        }
+        Proxy::Finish(up, true, false);
+        return EndProxy();
+      }
+    }
+    if (status == UpstreamConn::IO_AGAIN) {
+      return true;   // 等待上游连接上的事件
+    } else if (status == UpstreamConn::IO_ERROR && !ProxyError()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool HttpConn::AddProxyHead() {
+  UpstreamConn* up = upstream_;
+  status_ = up->Status();
+  bool dechunk = proxy_dechunk_ && up->BodyType() == UpstreamConn::BODY_CHUNKED;
+  if (up->BodyType() == UpstreamConn::BODY_UNTIL_CLOSE || dechunk) {
+    is_linger_ = false;   // 响应实体没有长度，以关闭连接结束
+  }
+  char* head = (char*)arena_.Allocate(up->HeadLen(), 1);
+  if (!head) {
+    return false;
+  }
+  int len = up->CopyHead(head, dechunk);
+  // 有Content-Length(或者没有实体)、大小不超过上限的可缓存响应边转发边保存
+  UpstreamConn::BODY_TYPE type = up->BodyType();
+  proxy_capture_ = proxy_cache_ &&
+                   (type == UpstreamConn::BODY_NONE ||
+                    (type == UpstreamConn::BODY_LENGTH &&
+                     up->Remaining() + up->DataLen() <= (int64_t)MicroCache::MaxEntrySize())) &&
+                   MicroCache::Cacheable(status_, head, len);
+  if (proxy_capture_) {
+    cache_buf_.assign(head, len);
+    cache_head_len_ = len;
+  }
+  // Connection由这里决定，加上结尾的空行
+  int header_start = write_idx_;
+  if (!AddLinger() || !AddBlankLine()) {
+    return false;
+  }
+  proxy_bytes_ += len + write_idx_ - header_start;
+  return out_queue_.AddBuffer(head, len) &&
+         out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start);
+}
+
+bool HttpConn::AddProxyBody() {
+  UpstreamConn* up = upstream_;
+  char* body = (char*)arena_.Allocate(up->DataLen(), 1);
+  if (!body) {
+    return false;
+  }
+  int len = up->TakeBody(body, proxy_dechunk_);
+  if (len < 0) {
+    LOG_WARN("上游服务器%s的chunked编码有误", up->GetBackend()->name);
+    return false;
+  }
+  proxy_bytes_ += len;
+  if (proxy_capture_) {
+    cache_buf_.append(body, len);
+  }
+  return len == 0 || out_queue_.AddBuffer(body, len);
+}
+
+bool HttpConn::ProxyError() {
+  UpstreamConn* up = upstream_;
+  upstream_ = NULL;
+  if (up->State() == UpstreamConn::READ_BODY) {
+    // 响应头部已经发送给客户端，只能关闭连接让客户端知道响应不完整
+    LOG_WARN("上游服务器%s的响应没有完整地转发", up->GetBackend()->name);
+    Proxy::Finish(up, false, true);
+    return false;
+  }
+  // 请求一个字节也没有发出(连接被拒绝)时换一个上游服务器重试；连接池中的连接可能在空闲时已经被上游关闭，
+  // 还没有收到响应时用新的连接重试，POST和PATCH不是幂等的，上游可能已经处理过，不重试；都只重试一次
+  // 流式接收的实体读出之后就没有了，只有请求头部还没有发出时(实体还没有开始读)才能重试
+  bool stale = up->Reused() && !up->ResponseStarted();
+  bool retry = !proxy_retried_ &&
+               (!up->RequestSent() || (stale && !stream_body_ && method_ != POST && method_ != PATCH));
+  bool body_unread = body_.Active();
+  if (body_unread) {
+    body_.Finish();         // 重试时重新开始
+  }
+  Backend* backend = up->GetBackend();
+  Proxy::Finish(up, false, !stale);
+  if (retry) {
+    proxy_retried_ = true;
+    if (StartProxy(upstream_group_, true, stale ? NULL : backend)) {
+      return true;
+    }
+  }
+  if (body_unread) {
+    is_linger_ = false;     // 实体没有转发完，剩下的部分还在socket中
+  }
+  int header_start = write_idx_;
+  int64_t queued = out_queue_.Bytes();
+  if (proxy_cache_ && LookupStale(cache_key_.data(), cache_key_.size())) {
+    // stale-if-error窗口内回复旧的响应
+    if (!AddCachedResponse()) {
+      return false;
+    }
+  } else if (!AddErrorResponse(502) ||
+             !out_queue_.AddBuffer(write_buf_ + header_start, write_idx_ - header_start)) {
+    return false;
+  }
+  proxy_bytes_ += out_queue_.Bytes() - queued;
+  return EndProxy();
+}
+
+bool HttpConn::EndProxy() {
+  upstream_ = NULL;
+  if (FinishRequest(proxy_start_us_, proxy_bytes_)) {
+    request_pending_ = true;
+  }
+  if (out_queue_.Empty()) {
+    // 响应已经发送完毕(管道中的实体不经过发送队列)
+    return OnFlushed(0);
+  }
+  return true;
+}
+
+void HttpConn::AddHeaders(off_t content_length) {
   AddContentLength(content_length);
   AddLinger();
   AddContentType();
   AddBlankLine();
 }
 
-bool HttpConn::AddContentLength(int content_length) {
-  return AddResponse("Content-Length: %d\r\n", content_length);
+bool HttpConn::AddContentLength(off_t content_length) {
+  char buf[48] = "Content-Length: ";
+  int len = 16;
+  len += ResponseTemplate::FormatUint(buf + len, content_length);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  return AddPiece(buf, len);
 }
 
 bool HttpConn::AddLinger() {
-  return AddResponse("Connection: %s\r\n", is_linger_ == true? "keep-alive": "close");
+  if (!AddPiece(ResponseTemplate::Connection(is_linger_))) {
+    return false;
+  }
+  if (!is_linger_) {
+    return true;
+  }
+  // 告诉客户端空闲多久会被关闭以及连接上还能发送的请求数，
+  // 定时器最早在3个时间间隔后关闭空闲连接，调整定时器的粒度是1秒，所以少报1秒
+  char buf[64] = "Keep-Alive: timeout=";
+  int len = 20;
+  len += ResponseTemplate::FormatUint(buf + len, 3 * timeslot_ - 1);
+  memcpy(buf + len, ", max=", 6);
+  len += 6;
+  len += ResponseTemplate::FormatUint(buf + len, max_keep_alive_requests_ - requests_served_);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  return AddPiece(buf, len);
 }
 
-bool HttpConn::AddBlankLine() {
-  return AddResponse("%s", "\r\n");
+bool HttpConn::AddDate() {
+  return AddPiece(ResponseTemplate::Date());
 }
 
-bool HttpConn::AddContent(const char* content) {
-  return AddResponse("%s", content);
+bool HttpConn::AddBlankLine() {
+  return AddPiece("\r\n", 2);
 }
 
 bool HttpConn::AddContentType() {
-  return AddResponse("Content-Type:%s\r\n", "text/html");
+  return AddPiece(ResponseTemplate::ContentType());
+}
+
+bool HttpConn::AddContentRange() {
+  char buf[96] = "Content-Range: bytes ";
+  int len = 21;
+  if (range_end_ < range_start_) {
+    // 416响应
+    buf[len++] = '*';
+  } else {
+    len += ResponseTemplate::FormatUint(buf + len, range_start_);
+    buf[len++] = '-';
+    len += ResponseTemplate::FormatUint(buf + len, range_end_);
+  }
+  buf[len++] = '/';
+  len += ResponseTemplate::FormatUint(buf + len, file_stat_.st_size);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  return AddPiece(buf, len);
+}
+
+// ETag由文件的修改时间和大小组成: "mtime-size"(十六进制)
+int HttpConn::FormatETag(char* buf) {
+  int len = 0;
+  buf[len++] = '"';
+  len += ResponseTemplate::FormatHex(buf + len, file_stat_.st_mtime);
+  buf[len++] = '-';
+  len += ResponseTemplate::FormatHex(buf + len, file_stat_.st_size);
+  buf[len++] = '"';
+  return len;
+}
+
+bool HttpConn::AddValidators() {
+  // If-Range请求会用ETag或Last-Modified来判断文件是否改变
+  char buf[160] = "Accept-Ranges: bytes\r\nETag: ";
+  int len = 28;
+  len += FormatETag(buf + len);
+  memcpy(buf + len, "\r\nLast-Modified: ", 17);
+  len += 17;
+  len += ResponseTemplate::FormatHttpDate(buf + len, file_stat_.st_mtime);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  return AddPiece(buf, len);
 }
@@ -17,25 +17,46 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <assert.h>
+#include <atomic>
 
 #include "locker.h"
 #include "timer.h"
+#include "response_template.h"
+#include "out_queue.h"
+#include "log.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "arena.h"
+#include "rate_limit.h"
+#include "router.h"
+#include "proxy.h"
+#include "micro_cache.h"
+#include "request_body.h"
+#include "probes.h"
+#include <string>
 
 class HttpConn {
 public:
   // 静态成员变量是共享的
   static int epollfd_;  // 所有的socket上的事件都被注册到同一个epollfd指向的内核事件表中
-  static int user_count_;  // 统计用户的数量
+  static std::atomic<int> user_count_;  // 统计用户的数量(主线程和工作线程都会修改)
   static const int READ_BUFFER_SIZE = 2048;
-  static const int WRITE_BUFFER_SIZE = 1024;
+  static const int WRITE_BUFFER_SIZE = 2048;
   static const int FILENAME_LEN = 200;
+  static const int MIN_RESPONSE_ROOM = 384;     // 流水线上继续生成下一个响应所需的写缓冲区空间
   static SortTimerList timer_list_;  // 定时器链表
   static int timeslot_;               // 5s触发一次定时
-  // HTTP请求放啊，但我们只支持GET
+  static int max_keep_alive_requests_;  // 长连接上最多处理的请求数，最后一个响应带Connection: close
+  static int64_t max_body_size_;        // 请求实体的上限，超过时回复413并关闭连接
+  static const char* upload_dir_;       // 内置的上传路由(PUT/POST /upload/名字)保存文件的目录，NULL表示不启用
+  // HTTP请求方法，静态文件只支持GET，其他方法要有注册的路由(或者转发给上游)
   // 默认情况下枚举值从0开始，然后递增
-  enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
+  enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH};
 
   /* 在解析客户端请求时，主状态机的状态
   CHECK_STATE_REQUESTLINE:当前正在分析请求行
@@ -56,21 +77,62 @@ public:
     FILE_REQUEST:      文件请求，获取文件成功
     INTERNAL_ERROR:    表示服务器内部错误
     CLOSED_CONNECTION: 表示客户端已经关闭连接
+    PARTIAL_REQUEST:   Range请求，只返回文件的一部分(206)
+    RANGE_NOT_SATISFIABLE: Range请求的范围超出了文件大小(416)
+    TOO_MANY_REQUESTS: 客户端IP的请求速率超过了限制(429)
+    ROUTE_REQUEST:     匹配到注册的路由，由处理函数生成响应
+    METHOD_NOT_ALLOWED: 没有路由的路径上使用了GET以外的方法(405)
+    CACHED_RESPONSE:   路由的响应在缓存中(见MicroCache)，已经复制到arena_中
+    PAYLOAD_TOO_LARGE: 请求实体超过了max_body_size_(413)
   */
+  /* 连接的状态字state_中的标志位
+    CONN_BUSY: 连接正被某个线程(主线程或者工作线程)处理，该线程持有连接的所有权
+    CONN_IN/CONN_OUT/CONN_HUP: 持有期间到达的可读/可写/断开事件，由持有者在释放之前处理
+    CONN_UPSTREAM: 正在使用的上游连接上有事件(转发请求时)
+  */
+  enum CONN_STATE {CONN_BUSY = 1, CONN_IN = 2, CONN_OUT = 4, CONN_HUP = 8, CONN_UPSTREAM = 16};
+
   enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST,
-                  INTERNAL_ERROR, CLOSED_CONNECTION};
+                  INTERNAL_ERROR, CLOSED_CONNECTION, PARTIAL_REQUEST, RANGE_NOT_SATISFIABLE,
+                  ROUTE_REQUEST, TOO_MANY_REQUESTS, METHOD_NOT_ALLOWED, CACHED_RESPONSE, PAYLOAD_TOO_LARGE};
 
   HttpConn() {}
   ~HttpConn() {}
-  void Process();           // 解析客户端的请求报文(Proactor模式下)
+  void Process();           // 解析客户端的请求报文并发送响应(工作线程中执行)
   void Init(int sockfd, const sockaddr_in& addr);  // 初始化连接I/O相关信息
   void CloseConn();         // 关闭连接
   bool Read();              // 非阻塞读
-  bool Write();             // 非阻塞写
+  bool Write();             // 非阻塞写(发送队列中的数据)
+  // 主线程获取连接的所有权，失败时events记录在状态字中由当前的持有者处理
+  bool Acquire(int events);
+  // 释放所有权，返回0表示已释放；否则返回持有期间到达的事件，所有权仍然保留
+  int Release();
+  // 主线程持有所有权时处理连接上的事件，返回true表示有请求需要交给工作线程(所有权随之转移)
+  bool HandleEvents(int events);
+  // 连接数接近上限时(主线程中调用)按LRU顺序检查最多scan个连接，关闭其中最多count个空闲的连接，
+  // 正在处理请求的连接在下一个响应中带上Connection: close，返回关闭的连接数
+  static int EvictIdle(int count, int scan);
+  // 注册内置的路由(指标和健康检查)，在解析完命令行参数之后、创建工作线程之前调用
+  static bool InitRoutes();
+  // 所有路由注册完之后启动响应缓存(有缓存规则时)，budget_bytes是内存上限
+  static bool StartCache(size_t budget_bytes);
 private:
   void Init();                             // 初始化连接HTTP的相关信息
+  void InitRequest();                      // 处理完一个请求后重置解析状态，保留流水线上的后续请求
+  bool ProcessRequests();                  // 处理读缓冲区中所有完整的请求，生成的响应加入发送队列
+  bool FinishRequest(int64_t start_us, int64_t bytes);  // 记录一个请求并重置解析状态，返回true表示继续处理下一个请求
+  bool OnFlushed(int64_t sent);            // 发送队列已经清空，返回false表示需要关闭连接
   HTTP_CODE ProcessRead();                 // 解析HTTP请求
+  void AdjustTimer();                      // 连接上有数据收发时延迟定时器的超时时间
   bool ProcessWrite(HTTP_CODE);            // 生成HTTP响应
+  void LogAccess(int64_t start_us, int64_t end_us, int64_t bytes);  // 写一条访问日志
+  void SavePendingTrace(int64_t bytes);    // 保存等待发送完毕的请求的追踪信息
+  bool Evict();                            // 空闲时关闭连接，否则要求在下一个响应后关闭
+  void Trace(TRACE_PHASE phase) {
+    if (Tracer::Enabled()) {
+      trace_.ts[phase] = Tracer::Now();
+    }
+  }
 
   // 被ProcessRead()调用分析HTTP请求
   HTTP_CODE ParseRequestLine(char* text);   // 解析HTTP首行
@@ -79,16 +141,46 @@ private:
   LINE_STATUS ParseLine();                  // 解析一行(请求头或请求行)，并在末尾加上字符串结束符，方便提取
   char* GetLineAddr() {return read_buf_ + start_line_;} // 获取当前正在解析的行的地址
   HTTP_CODE DoRequest();                    // 对客户端进行响应
+  HTTP_CODE ParseRange();                   // 解析Range请求头，确定要发送的文件范围
+  bool IfRangeMatch();                      // If-Range校验，资源未改变时Range才生效
 
   // 被ProcessWrite()调用以生成HTTP响应
-  void unmap();                                        // 对内存映射区执行unmap操作
-  bool AddResponse(const char* format, ...);
-  bool AddContent(const char* content);
-  bool AddStatusLine(int status, const char* title);
-  void AddHeaders(int content_length);
-  bool AddContentLength(int content_length);
+  void unmap();                                        // 释放发送队列中的文件映射，并关闭文件
+  bool AddPiece(const char* data, int len);           // 将一段报文拷贝到写缓冲区
+  bool AddPiece(Piece piece);
+  bool AddStatusLine(int status);
+  bool AddErrorResponse(int status);                   // 预先生成的错误响应
+  bool AddRouteResponse();                             // 调用路由的处理函数生成响应
+
+  // 路由响应的缓存(见MicroCache)
+  int FormatCacheKey(char* buf, int size);             // 请求的缓存键，不能缓存的请求返回-1
+  bool LookupCache();                                  // 查找缓存，命中时响应已经复制到arena_中
+  bool LookupStale(const char* key, int key_len);      // 源站出错时查找stale-if-error窗口内的响应
+  bool AddCachedResponse();                            // 把命中的响应加入发送队列
+
+  // 流式接收的请求实体(见RequestBody)，接收期间连接不处理流水线上的后续请求
+  void StartBody(int sink, bool raw);                  // 开始接收实体，需要时先回复100 Continue
+  RequestBody::STATUS PumpBody();                      // 把实体写给接收方，有进展时延迟定时器
+  bool BodyIO();                                       // 接收实体的I/O，返回false表示需要关闭连接
+  bool EndBody(RequestBody::STATUS status);            // 实体接收结束，再次调用处理函数生成响应
+  void AbortBody();                                    // 关闭连接时放弃接收，通知处理函数清理
+
+  // 反向代理(见Proxy)，转发期间连接不处理流水线上的后续请求
+  bool StartProxy(UpstreamGroup* group, bool fresh, const Backend* avoid);  // 取一个上游连接并写好转发的请求
+  int FormatUpstreamRequest(char* buf, int size, const Backend* backend);
+  bool ProxyIO();                                      // 转发的I/O，返回false表示需要关闭连接
+  bool AddProxyHead();                                 // 把上游的响应头部加入发送队列
+  bool AddProxyBody();                                 // 把上游连接缓冲区中的响应实体加入发送队列
+  bool ProxyError();                                   // 转发出错: 重试、回复502或者关闭连接
+  bool EndProxy();                                     // 转发结束，记录请求并继续处理后续的请求
+  void AddHeaders(off_t content_length);
+  bool AddContentLength(off_t content_length);
   bool AddContentType();
+  bool AddContentRange();
+  bool AddValidators();                     // Accept-Ranges, ETag和Last-Modified
+  int FormatETag(char* buf);
   bool AddLinger();
+  bool AddDate();
   bool AddBlankLine();
 
   int sockfd_ = -1;                  // 当前个http连接的套接字
@@ -97,6 +189,7 @@ private:
   int read_idx_;                     // 从读缓冲区中读入的字节数
   int checked_idx_;                  // 当前正在分析的字符在读缓冲区的位置
   int start_line_;                   // 正在解析的行的起始位置
+  int header_start_;                 // 第一个头部的位置(每行以两个'\0'结尾，空行结束)，转发时逐行复制
   char write_buf_[WRITE_BUFFER_SIZE];
   int write_idx_;                    // 往写缓冲中写入的字节数
   CHECK_STATE check_state_;          // 主状态机所处的状态
@@ -108,14 +201,59 @@ private:
   // 请求头部的关键字
   char* host_;                       // 主机名
   char* port_;                       // 端口号
-  bool is_linger_;                   // HTTP是否要保持TCP连接
-  int content_length_;               // HTTP请求实体的长度
+  bool is_linger_;                   // HTTP是否要保持TCP连接(HTTP/1.1默认保持，HTTP/1.0需要keep-alive)
+  bool http11_;                      // 请求的版本是HTTP/1.1(必须带Host)
+  int requests_served_;              // 连接上已经处理的请求数
+  std::atomic<bool> close_requested_{false};  // 主线程要求在下一个响应后关闭连接(EvictIdle())
+  int64_t content_length_;           // HTTP请求实体的长度
+  bool content_length_seen_;         // 请求带有Content-Length头部(值可以是0)
+  bool body_chunked_;                // 请求实体是chunked编码
+  bool expect_continue_;             // 请求带有Expect: 100-continue
+  bool stream_body_;                 // 请求实体不能整个读入读缓冲区，由处理函数决定是否接收(流式)
+  char* range_;                      // Range请求头的值(如bytes=0-1023)
+  char* if_range_;                   // If-Range请求头的值(ETag或者HTTP日期)
   // 响应信息
-  void* file_address_;               // 客户请求的目标文件被mmap到内存中的起始位置
+  int file_fd_;                      // 客户请求的目标文件，生成响应后交给发送队列
   struct stat file_stat_;            // 资源文件的元数据结构体
-  struct iovec iv_[2];               // 支持分散读/写
-  int iv_count_;                     // 表示被写内存块的数量
-  Timer* timer_;                     // 属于连接的定时器
+  off_t range_start_;                // 要发送的文件范围的起始偏移
+  off_t range_end_;                  // 要发送的文件范围的结束偏移(包含该字节)
+  const Route* route_;               // DoRequest()匹配到的路由，参数在工作线程的RouteRequest中
+  UpstreamConn* upstream_ = nullptr;  // 正在转发的请求使用的上游连接
+  UpstreamGroup* upstream_group_;    // 重试时从同一组中再取一个连接
+  int64_t proxy_start_us_;           // 转发或者接收实体的请求开始处理的时间
+  RequestBody body_;                 // 正在接收的请求实体
+  int body_base_;                    // 读缓冲区中请求头部的结尾，chunked编码的实体读到它之后
+  int body_fd_ = -1;                 // 处理函数指定的接收实体的文件，转发给上游时为-1
+  void* body_arg_;
+  int64_t proxy_bytes_;              // 转发的响应发送给客户端的字节数
+  bool proxy_dechunk_;               // HTTP/1.0的客户端不支持chunked，只转发数据并在结束时关闭连接
+  bool proxy_retried_;               // 这个请求已经重试过一次
+  bool nodelay_;                     // 已经在客户连接上设置了TCP_NODELAY(第一次转发时)
+  const CachePolicy* proxy_cache_;   // 转发的请求可以缓存时的策略，否则为NULL
+  bool proxy_capture_;               // 转发的响应可以缓存，边转发边保存(实体不用splice)
+  std::string cache_key_;            // 转发的请求的缓存键(转发期间可能换工作线程，不能用线程的缓冲区)
+  std::string cache_buf_;            // 保存下来的响应头部和实体
+  int cache_head_len_;
+  OutQueue out_queue_;               // 发送队列，流水线上多个响应的头部和文件一起发送
+  int64_t bytes_have_send_;          // 已经发送的字节数
+  bool close_after_flush_;           // 发送队列发送完毕后关闭连接(短连接)
+  bool request_pending_;             // 读缓冲区中有还未处理的数据
+  bool read_more_;                   // 读缓冲区满了，socket中可能还有数据没有读
+  Timer timer_;                      // 属于连接的定时器，和连接槽位一起分配，不在每次连接时new
+  time_t last_adjust_;               // 上一次调整定时器的时间
+  // 访问日志中各阶段的时间(微秒)
+  int64_t recv_us_;                  // 读缓冲区中待处理的数据到达的时间
+  int64_t handle_us_;                // 请求解析完毕，开始查找文件的时间
+  int status_;                       // 当前响应的状态码
+  int64_t ttlb_start_us_;            // 发送队列中最早的请求到达的时间
+  int responses_queued_;             // 发送队列中的响应数，全部发送完后记录time to last byte
+  Arena arena_;                      // 请求处理期间的内存(动态生成的响应实体等)，发送队列清空时回收
+  // 请求阶段追踪(Tracer::Enabled()时才记录)
+  RequestTrace trace_;               // 正在处理的请求
+  RequestTrace pending_trace_;       // 发送队列中第一个响应对应的请求，发送完毕后提交
+  bool trace_pending_;
+  uint32_t capture_id_;              // 流量录制中的连接编号，0表示不录制
+  std::atomic<int> state_{0};        // 连接的状态字(CONN_STATE)
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "huge_pages.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+namespace {
+
+size_t RoundUp(size_t bytes) {
+  return (bytes + HugePages::HUGE_PAGE_SIZE - 1) & ~(HugePages::HUGE_PAGE_SIZE - 1);
+}
+
+// THP设置为never时madvise(MADV_HUGEPAGE)也会成功，但不会使用大页
+bool ThpAvailable() {
+  FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (!fp) {
+    return false;
+  }
+  char buf[128] = {0};
+  fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  return strstr(buf, "[never]") == NULL;
+}
+
+}  // namespace
+
+void* HugePages::Alloc(size_t bytes, bool enable, HUGE_BACKING* backing) {
+  size_t len = RoundUp(bytes);
+  if (enable) {
+    void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      *backing = HUGE_HUGETLB;
+      return addr;
+    }
+  }
+  // 多映射一个大页，把起始地址对齐到2MB之后释放两端多余的部分，THP才能用大页映射整个区域
+  size_t map_len = enable ? len + HUGE_PAGE_SIZE : len;
+  char* addr = (char*)mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+  *backing = HUGE_NONE;
+  if (!enable) {
+    return addr;
+  }
+  char* aligned = (char*)RoundUp((uintptr_t)addr);
+  if (aligned > addr) {
+    munmap(addr, aligned - addr);
+  }
+  size_t tail = (addr + map_len) - (aligned + len);
+  if (tail > 0) {
+    munmap(aligned + len, tail);
+  }
+  if (ThpAvailable() && madvise(aligned, len, MADV_HUGEPAGE) == 0) {
+    *backing = HUGE_THP;
+  }
+  return aligned;
+}
+
+void HugePages::Free(void* addr, size_t bytes) {
+  if (addr) {
+    munmap(addr, RoundUp(bytes));
+  }
+}
+
+const char* HugePages::Name(HUGE_BACKING backing) {
+  switch (backing) {
+    case HUGE_HUGETLB: return "hugetlb";
+    case HUGE_THP: return "thp";
+    default: return "4k";
+  }
+}
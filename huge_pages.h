@@ -0,0 +1,27 @@
+#ifndef HUGE_PAGES_H_
+#define HUGE_PAGES_H_
+
+#include <stddef.h>
+
+// 大块常驻内存(连接表，每个连接的读写缓冲区都在其中)的分配
+// 连接表有几百MB并且被随机访问，用4KB的页时TLB覆盖不了，Read()和ParseLine()中大量dTLB缺失；
+// 优先使用预留的大页(MAP_HUGETLB)，没有预留时按2MB对齐映射并madvise(MADV_HUGEPAGE)交给THP，
+// 都不可用时使用普通页
+enum HUGE_BACKING {
+  HUGE_HUGETLB,     // 预留的大页(/proc/sys/vm/nr_hugepages)
+  HUGE_THP,         // 透明大页
+  HUGE_NONE,        // 普通页
+};
+
+class HugePages {
+public:
+  static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  // 分配bytes字节(按大页对齐，内容为0)，enable为false时只使用普通页，backing返回实际使用的方式
+  // 失败时返回NULL
+  static void* Alloc(size_t bytes, bool enable, HUGE_BACKING* backing);
+  static void Free(void* addr, size_t bytes);
+  static const char* Name(HUGE_BACKING backing);
+};
+
+#endif
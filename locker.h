@@ -23,6 +23,7 @@ private:
 };
 
 class Cond {
+public:
   Cond() {
     if (pthread_cond_init(&cond_, NULL) != 0)
       throw std::exception();
@@ -0,0 +1,262 @@
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace {
+
+const char* level_names[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+int64_t LocalDay(time_t t, struct tm* tm) {
+  localtime_r(&t, tm);
+  return (tm->tm_year + 1900) * 10000 + (tm->tm_mon + 1) * 100 + tm->tm_mday;
+}
+
+}  // namespace
+
+void LogBuffer::CopyIn(uint64_t pos, const void* src, uint32_t len) {
+  uint32_t index = pos & (SIZE - 1);
+  uint32_t first = len < SIZE - index ? len : SIZE - index;
+  memcpy(data_ + index, src, first);
+  memcpy(data_, (const char*)src + first, len - first);   // 绕回缓冲区开头的部分
+}
+
+void LogBuffer::CopyOut(uint64_t pos, void* dst, uint32_t len) {
+  uint32_t index = pos & (SIZE - 1);
+  uint32_t first = len < SIZE - index ? len : SIZE - index;
+  memcpy(dst, data_ + index, first);
+  memcpy((char*)dst + first, data_, len - first);
+}
+
+bool LogBuffer::Push(const Record& record, const char* text) {
+  uint32_t total = sizeof(Record) + record.len;
+  uint64_t head = head_.load(std::memory_order_relaxed);
+  uint64_t tail = tail_.load(std::memory_order_acquire);
+  if (head - tail + total > SIZE) {
+    // 后台线程来不及写出时丢弃日志而不是阻塞工作线程
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  CopyIn(head, &record, sizeof(Record));
+  CopyIn(head + sizeof(Record), text, record.len);
+  // release保证消费者看到新的head_时，日志内容已经写入
+  head_.store(head + total, std::memory_order_release);
+  return true;
+}
+
+bool LogBuffer::Pop(Record* record, char* text) {
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+  uint64_t head = head_.load(std::memory_order_acquire);
+  if (tail == head) {
+    return false;
+  }
+  CopyOut(tail, record, sizeof(Record));
+  CopyOut(tail + sizeof(Record), text, record->len);
+  tail_.store(tail + sizeof(Record) + record->len, std::memory_order_release);
+  return true;
+}
+
+Log* Log::Instance() {
+  static Log log;
+  return &log;
+}
+
+bool Log::Init(const char* dir, const char* prefix, int64_t max_file_size, int flush_interval_ms) {
+  snprintf(dir_, sizeof(dir_), "%s", dir);
+  snprintf(prefix_, sizeof(prefix_), "%s", prefix);
+  max_file_size_ = max_file_size;
+  flush_interval_ms_ = flush_interval_ms;
+  if (mkdir(dir_, 0755) != 0 && errno != EEXIST) {
+    return false;
+  }
+  struct tm tm;
+  if (!OpenFile(LocalDay(time(NULL), &tm))) {
+    return false;
+  }
+  running_.store(true);
+  if (pthread_create(&thread_, NULL, Flusher, this) != 0) {
+    running_.store(false);
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void Log::Stop() {
+  if (!running_.load()) {
+    return;
+  }
+  lock_.Lock();
+  running_.store(false);
+  cond_.Signal();
+  lock_.UnLock();
+  pthread_join(thread_, NULL);
+  close(fd_);
+  fd_ = -1;
+}
+
+LogBuffer* Log::ThreadBuffer() {
+  static thread_local LogBuffer* buffer = nullptr;
+  if (!buffer) {
+    // 每个线程只在第一次写日志时加锁注册一次
+    buffer = new LogBuffer(syscall(SYS_gettid));
+    lock_.Lock();
+    buffers_.push_back(buffer);
+    lock_.UnLock();
+  }
+  return buffer;
+}
+
+void Log::Write(int level, const char* format, ...) {
+  if (!running_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // 在调用线程中格式化，时间和级别的格式化留给后台线程
+  char text[MAX_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+  if (len >= MAX_LINE_SIZE) {
+    len = MAX_LINE_SIZE - 1;
+  }
+  while (len > 0 && text[len - 1] == '\n') {
+    --len;    // 换行由后台线程统一加上
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  LogBuffer::Record record;
+  record.time_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  record.len = len;
+  record.level = level;
+  ThreadBuffer()->Push(record, text);
+}
+
+void* Log::Flusher(void* args) {
+  Log* log = (Log*)args;
+  while (log->running_.load()) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)log->flush_interval_ms_ * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    log->lock_.Lock();
+    if (log->running_.load()) {
+      log->cond_.TimeWait(log->lock_.Get(), &deadline);
+    }
+    log->lock_.UnLock();
+    log->Drain();
+  }
+  log->Drain();   // 停止之前写出剩余的日志
+  return NULL;
+}
+
+void Log::Drain() {
+  lock_.Lock();
+  std::vector<LogBuffer*> buffers = buffers_;
+  lock_.UnLock();
+  char text[MAX_LINE_SIZE];
+  LogBuffer::Record record;
+  for (LogBuffer* buffer : buffers) {
+    while (buffer->Pop(&record, text)) {
+      Append(record, buffer->Tid(), text);
+    }
+    uint64_t dropped = buffer->TakeDropped();
+    if (dropped > 0) {
+      int len = snprintf(text, sizeof(text), "日志缓冲区已满，丢弃了%llu条日志",
+                         (unsigned long long)dropped);
+      record.len = len;
+      record.level = LOG_LEVEL_WARN;
+      Append(record, buffer->Tid(), text);
+    }
+  }
+  FlushOut();
+}
+
+void Log::Append(const LogBuffer::Record& record, int tid, const char* text) {
+  int64_t second = record.time_us / 1000000;
+  if (second != last_second_) {
+    // 时间前缀每秒只格式化一次
+    last_second_ = second;
+    struct tm tm;
+    int64_t day = LocalDay(second, &tm);
+    snprintf(time_prefix_, sizeof(time_prefix_), "%04d-%02d-%02d %02d:%02d:%02d",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if (day > file_day_) {
+      // 日期变化，换一个新的日志文件
+      FlushOut();
+      file_index_ = 0;
+      OpenFile(day);
+    }
+  }
+  // 前缀最多约60字节
+  if (out_len_ + 64 + (int)record.len + 1 > (int)sizeof(out_)) {
+    FlushOut();
+  }
+  out_len_ += snprintf(out_ + out_len_, sizeof(out_) - out_len_, "%s.%06d %s [%d] ",
+                       time_prefix_, (int)(record.time_us % 1000000), level_names[record.level], tid);
+  memcpy(out_ + out_len_, text, record.len);
+  out_len_ += record.len;
+  out_[out_len_++] = '\n';
+}
+
+void Log::FlushOut() {
+  int written = 0;
+  while (fd_ >= 0 && written < out_len_) {
+    ssize_t n = write(fd_, out_ + written, out_len_ - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;    // 写日志失败时丢弃这一批日志
+    }
+    written += n;
+  }
+  file_size_ += written;
+  out_len_ = 0;
+  if (file_size_ >= max_file_size_) {
+    // 当前文件写满，滚动到同一天的下一个文件
+    ++file_index_;
+    OpenFile(file_day_);
+  }
+}
+
+bool Log::OpenFile(int64_t day) {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  file_day_ = day;
+  char path[sizeof(dir_) + sizeof(prefix_) + 32];
+  while (true) {
+    if (file_index_ == 0) {
+      snprintf(path, sizeof(path), "%s/%s_%lld.log", dir_, prefix_, (long long)day);
+    } else {
+      snprintf(path, sizeof(path), "%s/%s_%lld.%d.log", dir_, prefix_, (long long)day, file_index_);
+    }
+    fd_ = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+    // 重启后接着写已有的文件，已经写满的跳过
+    struct stat st;
+    file_size_ = fstat(fd_, &st) == 0 ? st.st_size : 0;
+    if (file_size_ < max_file_size_) {
+      return true;
+    }
+    close(fd_);
+    fd_ = -1;
+    ++file_index_;
+  }
+}
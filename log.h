@@ -0,0 +1,123 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "locker.h"
+
+// 日志级别
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF   4
+
+// 编译期的日志级别，低于该级别的日志语句编译后什么都不剩(参数也不会求值)
+// 例如 make clean && make LOG_LEVEL=0 打开调试日志
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// 线程的日志环形缓冲区，只有一个生产者(所属线程)和一个消费者(后台写日志线程)，不需要加锁
+class LogBuffer {
+public:
+  static const int SIZE = 1 << 16;  // 缓冲区大小(64KB)，必须是2的幂
+
+  // 每条日志记录的头部，后面紧跟len字节的日志内容
+  struct Record {
+    int64_t time_us;   // 写日志时的时间(微秒)
+    uint32_t len;
+    uint32_t level;
+  };
+
+  explicit LogBuffer(int tid) : tid_(tid), head_(0), tail_(0), dropped_(0) {}
+  bool Push(const Record& record, const char* text);   // 缓冲区已满时丢弃该条日志，返回false
+  // 取出下一条日志，text至少要有Log::MAX_LINE_SIZE字节，缓冲区为空时返回false
+  bool Pop(Record* record, char* text);
+  int Tid() const { return tid_; }
+  uint64_t TakeDropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+private:
+  void CopyIn(uint64_t pos, const void* src, uint32_t len);
+  void CopyOut(uint64_t pos, void* dst, uint32_t len);
+
+  int tid_;
+  char data_[SIZE];
+  // head_和tail_是一直增长的位置，对SIZE取模得到在data_中的下标
+  // 分别放在不同的缓存行中，避免生产者和消费者互相使对方的缓存行失效
+  alignas(64) std::atomic<uint64_t> head_;     // 生产者写入的位置
+  alignas(64) std::atomic<uint64_t> tail_;     // 消费者读取的位置
+  std::atomic<uint64_t> dropped_;               // 缓冲区满时丢弃的日志条数
+};
+
+// 异步日志，工作线程只把格式化好的日志放入本线程的环形缓冲区，
+// 由后台线程定期取出，加上时间和级别后批量写入日志文件，
+// 日志文件按天和大小滚动: dir/prefix_YYYYMMDD.log, dir/prefix_YYYYMMDD.1.log, ...
+class Log {
+public:
+  static const int MAX_LINE_SIZE = 1024;   // 单条日志的最大长度，超出部分被截断
+
+  static Log* Instance();
+  // 打开日志文件并启动后台线程，在此之前写的日志会被丢弃
+  bool Init(const char* dir, const char* prefix, int64_t max_file_size = 64 << 20,
+            int flush_interval_ms = 100);
+  void Stop();              // 写出所有缓冲的日志，停止后台线程
+  void Write(int level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+private:
+  Log() : running_(false), fd_(-1), file_size_(0), file_day_(0), file_index_(0),
+          last_second_(-1), out_len_(0) {}
+  static void* Flusher(void* args);
+  LogBuffer* ThreadBuffer();      // 当前线程的缓冲区，第一次写日志时创建
+  void Drain();                   // 取出所有缓冲区中的日志写入文件
+  void Append(const LogBuffer::Record& record, int tid, const char* text);
+  void FlushOut();
+  bool OpenFile(int64_t day);
+
+  std::atomic<bool> running_;
+  pthread_t thread_;
+  Locker lock_;                         // 保护buffers_和stop时的唤醒
+  Cond cond_;
+  std::vector<LogBuffer*> buffers_;     // 所有线程的缓冲区，线程退出后仍保留
+  char dir_[256];
+  char prefix_[64];
+  int64_t max_file_size_;
+  int flush_interval_ms_;
+  // 以下成员只由后台线程访问
+  int fd_;
+  int64_t file_size_;
+  int64_t file_day_;                    // 当前文件对应的日期(YYYYMMDD)
+  int file_index_;
+  int64_t last_second_;                 // 缓存的时间前缀对应的秒
+  char time_prefix_[32];                // "2024-01-02 03:04:05"
+  char out_[1 << 16];                   // 写文件的缓冲
+  int out_len_;
+};
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) Log::Instance()->Write(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) Log::Instance()->Write(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) Log::Instance()->Write(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) Log::Instance()->Write(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(format, ...) do {} while (0)
+#endif
+
+#endif
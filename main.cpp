@@ -9,16 +9,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <exception>
+#include <new>
 #include <sys/epoll.h>
 #include <signal.h>
 #include <assert.h>
+#include <sys/resource.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "huge_pages.h"
 
 #define MAX_FD 65535             // 最大的文件名描述符个数
 #define MAX_EVENT_NUM 10000      // epoll最大监听事件数量
+#define FD_RESERVE 256           // 留给监听socket、日志和响应中打开的文件的文件描述符
+#define EVICT_BATCH 8            // 连接数超过高水位时每次关闭的空闲连接数
+#define EVICT_SCAN 64            // 每次按LRU顺序检查的连接数(正在处理请求的连接跳过)
 
 static int pipefd[2];  // 用于读写信号的管道
 
@@ -29,13 +35,13 @@ extern void Delfd(int epollfd, int fd);
 // 添加文件描述符到epoll中
 extern void Addfd(int epollfd, int fd, bool one_shot, bool et);
 
-// 修改文件描述符，重置socket上EPOLLONESHOT事件(只触发一次)，以确保下一次可读时，EPOLLIN事件被触法
-extern void Modfd(int epollfd, int fd, int ev);
-
 extern int SetNonBlocking(int fd);
 
 extern void TimerHandler();
 
+// 网站根目录，可以用-r指定
+extern const char* doc_root;
+
 void SigHandler(int sig) {
   int save_errno = errno;
   int msg = sig;
@@ -58,22 +64,206 @@ void AddSig(int sig, void(handler)(int)) {
 // 模拟Proactor模式(主线程监听并读数据)
 // main函数中执行的就是主线程
 int main(int argc, char** argv) {
-  if (argc <= 1) {
-    printf("请按照如下格式运行：%s 端口号\n", basename(argv[0]));
+  // 可选参数: -a 访问日志目录(不指定时不记录访问日志)
+  //           -m 指标的URL路径(默认/metrics，为空时不提供指标)
+  //           -s 每N个请求采样追踪一个  -S 慢请求阈值(毫秒)  -t 追踪文件(默认./log/trace.json)
+  //           -w 工作线程数(默认8)  -q 请求队列容量(默认10000)  -r 网站根目录
+  //           -c 录制请求流量的文件(用webbench/replay回放)  -C 录制文件的上限(MB，默认1024)
+  //           -H 连接表不使用大页(用于对比)  -k 长连接上最多处理的请求数(默认1000)
+  //           -l 每个客户端IP的最大连接数  -b 每个客户端IP每秒的请求数[:突发数](超过时返回429)
+  //           -u 把路径前缀转发给上游服务器: 前缀=地址:端口[,地址:端口...](可以指定多个)
+  //           -U 上游服务器的健康检查路径(默认/)
+  //           -x 缓存路由的响应: 路径=TTL毫秒[,stale-while-revalidate毫秒[,stale-if-error毫秒]](可以指定多个)
+  //           -X 缓存的内存上限(MB，默认64)
+  //           -B 请求实体的上限(MB，默认1024)  -P 上传目录(PUT/POST /upload/名字保存到这个目录)
+  const char* access_log_dir = NULL;
+  const char* trace_path = "./log/trace.json";
+  int trace_sample = 0;
+  int trace_slow_ms = 0;
+  int worker_threads = 8;
+  int max_requests = 10000;
+  const char* capture_path = NULL;
+  int64_t capture_max_bytes = Capture::DEFAULT_MAX_BYTES;
+  bool huge_pages = true;
+  int ip_max_conns = 0;
+  double ip_rate = 0;
+  double ip_burst = 0;
+  size_t cache_bytes = 64 << 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:m:s:S:t:w:q:r:c:C:Hk:l:b:u:U:x:X:B:P:")) != -1) {
+    switch (opt) {
+      case 's': {
+        trace_sample = atoi(optarg);
+        break;
+      }
+      case 'S': {
+        trace_slow_ms = atoi(optarg);
+        break;
+      }
+      case 't': {
+        trace_path = optarg;
+        break;
+      }
+      case 'a': {
+        access_log_dir = optarg;
+        break;
+      }
+      case 'm': {
+        Metrics::SetPath(optarg[0] ? optarg : NULL);
+        break;
+      }
+      case 'w': {
+        worker_threads = atoi(optarg);
+        break;
+      }
+      case 'q': {
+        max_requests = atoi(optarg);
+        break;
+      }
+      case 'r': {
+        doc_root = optarg;
+        break;
+      }
+      case 'c': {
+        capture_path = optarg;
+        break;
+      }
+      case 'C': {
+        capture_max_bytes = atoll(optarg) << 20;
+        break;
+      }
+      case 'H': {
+        huge_pages = false;
+        break;
+      }
+      case 'k': {
+        HttpConn::max_keep_alive_requests_ = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      }
+      case 'l': {
+        ip_max_conns = atoi(optarg);
+        break;
+      }
+      case 'b': {
+        ip_rate = atof(optarg);
+        const char* burst = strchr(optarg, ':');
+        ip_burst = burst ? atof(burst + 1) : 0;
+        break;
+      }
+      case 'u': {
+        if (!Proxy::AddUpstream(optarg)) {
+          printf("上游服务器的格式有误: %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      }
+      case 'U': {
+        Proxy::SetHealthCheck(optarg, 0);
+        break;
+      }
+      case 'x': {
+        if (!MicroCache::AddRule(optarg)) {
+          printf("缓存规则的格式有误: %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      }
+      case 'X': {
+        cache_bytes = (size_t)atoll(optarg) << 20;
+        break;
+      }
+      case 'B': {
+        HttpConn::max_body_size_ = atoll(optarg) << 20;
+        break;
+      }
+      case 'P': {
+        HttpConn::upload_dir_ = optarg;
+        break;
+      }
+      default: {
+        argc = 0;  // 参数有误，打印用法
+        break;
+      }
+    }
+  }
+  if (optind >= argc) {
+    printf("请按照如下格式运行：%s [-a 访问日志目录] [-m 指标路径] [-s 采样间隔] [-S 慢请求毫秒] [-t 追踪文件] [-w 工作线程数] [-q 队列容量] [-r 网站根目录] [-c 录制文件] [-C 录制上限MB] [-H] [-k 长连接最多请求数] [-l 每IP连接数] [-b 每IP请求速率[:突发数]] [-u 前缀=上游地址:端口[,...]] [-U 健康检查路径] [-x 路径=TTL毫秒[,SWR毫秒[,SIE毫秒]]] [-X 缓存上限MB] [-B 请求实体上限MB] [-P 上传目录] 端口号\n", basename(argv[0]));
+    exit(-1);
+  }
+  int port = atoi(argv[optind]);
+
+  // 启动异步日志，日志写入./log目录
+  if (!Log::Instance()->Init("./log", "server")) {
+    perror("log init error");
+  }
+  if (!AccessLog::Init(access_log_dir)) {
+    perror("access log init error");
+    exit(-1);
+  }
+  if (!Tracer::Init(trace_path, trace_sample, trace_slow_ms)) {
+    perror("trace init error");
+    exit(-1);
+  }
+  if (!Capture::Init(capture_path, capture_max_bytes)) {
+    perror("capture init error");
+    exit(-1);
+  }
+
+  RateLimiter::Init(ip_max_conns, ip_rate, ip_burst);
+
+  // 预先生成响应报文的模板(工作线程只读)
+  ResponseTemplate::Init();
+
+  // 注册路由(工作线程只读)
+  if (!HttpConn::InitRoutes()) {
+    printf("路由注册失败，请检查指标路径\n");
+    exit(-1);
+  }
+  // 反向代理的前缀也注册为路由，健康检查线程开始探测上游服务器
+  if (!Proxy::Start()) {
+    printf("反向代理启动失败，请检查转发的前缀\n");
+    exit(-1);
+  }
+  // 路由都注册完之后检查缓存规则，启动后台刷新线程
+  if (!HttpConn::StartCache(cache_bytes)) {
+    printf("缓存启动失败，请检查缓存规则\n");
     exit(-1);
   }
-  int port = atoi(argv[1]);
 
   // 创建线程池，并初始化
   ThreadPool<HttpConn>* pool = NULL;
   try {
-    pool = new ThreadPool<HttpConn>;
+    pool = new ThreadPool<HttpConn>(worker_threads, max_requests);
   } catch(...) {  // (...)表示处理任何类型的异常
     exit(-1);
   }
 
-  // 创建一个数组用于保存所有的客户信息
-  HttpConn* users = new HttpConn[MAX_FD];
+  // 创建一个数组用于保存所有的客户信息，连接的读写缓冲区都在其中，放在大页上减少TLB缺失
+  HUGE_BACKING backing;
+  size_t users_bytes = sizeof(HttpConn) * MAX_FD;
+  HttpConn* users = (HttpConn*)HugePages::Alloc(users_bytes, huge_pages, &backing);
+  if (!users) {
+    perror("alloc connection table error");
+    exit(-1);
+  }
+  for (int i = 0; i < MAX_FD; ++i) {
+    new (&users[i]) HttpConn;
+  }
+  printf("连接表%zuMB，使用%s页\n", users_bytes >> 20, HugePages::Name(backing));
+  fflush(stdout);
+  LOG_INFO("连接表%zuMB，使用%s页", users_bytes >> 20, HugePages::Name(backing));
+
+  // 连接数的上限受文件描述符上限的限制，超过高水位(95%)时按LRU顺序关闭空闲的长连接，
+  // 让活跃的客户端优先得到服务
+  int max_conns = MAX_FD;
+  rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY &&
+      (int64_t)nofile.rlim_cur - FD_RESERVE < max_conns) {
+    max_conns = nofile.rlim_cur > FD_RESERVE ? nofile.rlim_cur - FD_RESERVE : 1;
+  }
+  int high_water = max_conns - max_conns / 20;
+  // 文件描述符用完时用这个预留的描述符接受并立即关闭新连接，避免监听socket一直可读
+  int reserve_fd = open("/dev/null", O_RDONLY);
 
   // 创建监听的套接字
   int listenfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -98,8 +288,9 @@ int main(int argc, char** argv) {
     exit(-1);
   }
 
-  // 监听
-  ret = listen(listenfd, 5);
+  // 监听，主线程每次epoll_wait只accept一个连接，连接集中到达时队列太短会丢弃SYN，
+  // 客户端要等1秒以上重传，所以使用系统允许的最大长度
+  ret = listen(listenfd, SOMAXCONN);
   if (ret != 0) {
     perror("listen error\n");
     exit(-1);
@@ -151,24 +342,46 @@ int main(int argc, char** argv) {
         socklen_t client_addrlen = sizeof(client_addr);
         int connfd = accept(sockfd, (struct sockaddr*)&client_addr, &client_addrlen);
         if (connfd < 0) {
+          if (errno == EMFILE || errno == ENFILE) {
+            // 文件描述符用完了，先关闭空闲的连接，新连接留到下一次accept；
+            // 没有可以关闭的空闲连接时用预留的描述符拒绝这个连接
+            if (HttpConn::EvictIdle(EVICT_BATCH, EVICT_SCAN) == 0 && reserve_fd >= 0) {
+              close(reserve_fd);
+              connfd = accept(sockfd, NULL, NULL);
+              if (connfd >= 0) {
+                close(connfd);
+              }
+              reserve_fd = open("/dev/null", O_RDONLY);
+              LOG_WARN("文件描述符用完，拒绝新的连接");
+              Metrics::Local()->rejected_fd_limit.Add();
+            }
+            continue;
+          }
+          if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) {
+            continue;
+          }
           perror("accept error\n");
           exit(-1);
         }
-        if (HttpConn::user_count_ >= MAX_FD) {
+        if (HttpConn::user_count_ >= high_water) {
+          HttpConn::EvictIdle(EVICT_BATCH, EVICT_SCAN);
+        }
+        if (HttpConn::user_count_ >= max_conns || connfd >= MAX_FD) {
           // 目前的连接数满了，给客户端提示信息：服务器正忙
           close(connfd);
-          printf("服务器正忙\n");
+          LOG_WARN("服务器正忙，拒绝新的连接");
+          Metrics::Local()->rejected_fd_limit.Add();
+          continue;
+        }
+        if (RateLimiter::Enabled() && !RateLimiter::Connect(client_addr.sin_addr.s_addr)) {
+          // 这个客户端IP的连接数已经达到上限，直接关闭
+          close(connfd);
+          Metrics::Local()->rejected_ip_limit.Add();
           continue;
         }
         // 将新的客户的数据初始化，放到数组中
+        Metrics::Local()->accepted.Add();
         users[connfd].Init(connfd, client_addr);
-      } else if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
-        // 对方异常断开或者错误等事件
-        users[sockfd].CloseConn();
-      } else if (events[i].events & EPOLLOUT) {
-        if (!users[sockfd].Write()) {  // 一次性写完所有数据
-          users[sockfd].CloseConn();   // 关闭当前socket释放资源
-        }
       } else if ((sockfd == pipefd[0]) && (events[i].events & EPOLLIN)) {
         // 处理信号(管道读端有数据)
         // int sig;  // linux标准信号编号为1~31用一个整型32bit就可以通过掩码区分出具体的信号了
@@ -196,13 +409,34 @@ int main(int argc, char** argv) {
             }
           }
         }
-      } else if (events[i].events & EPOLLIN) {
-        // 模拟Preactor模式，由主线程来处理I/O，工作线程处理业务逻辑(Process)
-        if (users[sockfd].Read()) {     
-          // 一次性把所有数据都读完
-          pool->Append(&users[sockfd]);  // 主线程将事件放入请求队列交给工作线程中
-        } else {
-          users[sockfd].CloseConn();
+      } else {
+        // 客户连接上的事件，连接正被工作线程处理时事件记录在连接的状态字中，由工作线程处理
+        int ev = 0;
+        if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+          ev |= HttpConn::CONN_HUP;   // 对方异常断开或者错误等事件
+        }
+        if (events[i].events & EPOLLIN) {
+          ev |= HttpConn::CONN_IN;
+        }
+        if (events[i].events & EPOLLOUT) {
+          ev |= HttpConn::CONN_OUT;
+        }
+        HttpConn* conn = &users[sockfd];
+        void* owner = NULL;
+        if (Proxy::Enabled() && Proxy::OnEvent(sockfd, ev & HttpConn::CONN_HUP, &owner)) {
+          // 上游连接上的事件交给正在使用它的客户连接处理，空闲的连接上的事件忽略
+          if (!owner) {
+            continue;
+          }
+          conn = (HttpConn*)owner;
+          ev = HttpConn::CONN_UPSTREAM;
+        }
+        if (conn->Acquire(ev) && conn->HandleEvents(ev)) {
+          // 主线程已经把数据都读完，将连接放入请求队列交给工作线程处理
+          if (!pool->Append(conn)) {
+            conn->CloseConn();  // 请求队列满了
+            Metrics::Local()->rejected_queue_full.Add();
+          }
         }
       }
     }
@@ -212,9 +446,18 @@ int main(int argc, char** argv) {
     }
   }
   // 释放所有资源
+  MicroCache::Stop();
+  Proxy::Stop();
+  Tracer::Stop();
+  Capture::Stop();
+  Log::Instance()->Stop();
   close(epollfd);
   close(listenfd);
-  delete[] users;
+  close(reserve_fd);
+  for (int i = 0; i < MAX_FD; ++i) {
+    users[i].~HttpConn();
+  }
+  HugePages::Free(users, users_bytes);
   delete pool;
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include "arena.h"
+#include "locker.h"
+
+const char* Metrics::path_ = "/metrics";
+
+namespace {
+
+Locker registry_lock;
+std::vector<ThreadMetrics*> registry;   // 所有线程的指标，线程退出后仍保留
+
+void AppendHeader(std::string* out, const char* name, const char* type, const char* help) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  *out += buf;
+}
+
+void AppendValue(std::string* out, const char* name, const char* labels, uint64_t value) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s%s %llu\n", name, labels, (unsigned long long)value);
+  *out += buf;
+}
+
+void AppendCounter(std::string* out, const char* name, const char* help,
+                   const std::vector<ThreadMetrics*>& all, Counter ThreadMetrics::*member) {
+  uint64_t total = 0;
+  for (ThreadMetrics* m : all) {
+    total += (m->*member).Value();
+  }
+  AppendHeader(out, name, "counter", help);
+  AppendValue(out, name, "", total);
+}
+
+// 直方图以秒为单位输出，只输出到最后一个非空的区间为止
+void AppendHistogram(std::string* out, const char* name, const char* help,
+                     const std::vector<ThreadMetrics*>& all, Histogram ThreadMetrics::*member) {
+  uint64_t buckets[Histogram::BUCKETS] = {0};
+  uint64_t sum_us = 0;
+  int last = -1;
+  for (ThreadMetrics* m : all) {
+    const Histogram& h = m->*member;
+    for (int i = 0; i < Histogram::BUCKETS; ++i) {
+      buckets[i] += h.buckets_[i].Value();
+    }
+    sum_us += h.sum_.Value();
+  }
+  for (int i = 0; i < Histogram::BUCKETS; ++i) {
+    if (buckets[i]) {
+      last = i;
+    }
+  }
+  AppendHeader(out, name, "histogram", help);
+  char buf[256];
+  uint64_t cumulative = 0;
+  for (int i = 0; i <= last; ++i) {
+    cumulative += buckets[i];
+    snprintf(buf, sizeof(buf), "%s_bucket{le=\"%.6f\"} %llu\n", name,
+             Histogram::UpperBound(i) / 1e6, (unsigned long long)cumulative);
+    *out += buf;
+  }
+  // 各区间之和作为count，保证和+Inf区间一致
+  snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n",
+           name, (unsigned long long)cumulative, name, sum_us / 1e6,
+           name, (unsigned long long)cumulative);
+  *out += buf;
+}
+
+}  // namespace
+
+int Histogram::Index(uint64_t us) {
+  if (us < SUB_BUCKETS) {
+    return us;   // 小的值每个值一个区间
+  }
+  if (us > 0xffffffffULL) {
+    us = 0xffffffffULL;
+  }
+  int msb = 63 - __builtin_clzll(us);
+  int shift = msb - SUB_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((us >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t Histogram::UpperBound(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+ThreadMetrics* Metrics::Register() {
+  ThreadMetrics* metrics = new ThreadMetrics;
+  registry_lock.Lock();
+  registry.push_back(metrics);
+  registry_lock.UnLock();
+  return metrics;
+}
+
+void Metrics::SetPath(const char* path) {
+  path_ = path;
+}
+
+void Metrics::Render(std::string* out, int connections) {
+  // 线程的副本重复使用，请求/metrics时不分配内存
+  static thread_local std::vector<ThreadMetrics*> all;
+  registry_lock.Lock();
+  all = registry;
+  registry_lock.UnLock();
+
+  AppendHeader(out, "webserver_connections", "gauge", "Open client connections.");
+  AppendValue(out, "webserver_connections", "", connections);
+  AppendCounter(out, "webserver_connections_accepted_total", "Accepted client connections.",
+                all, &ThreadMetrics::accepted);
+
+  uint64_t fd_limit = 0;
+  uint64_t queue_full = 0;
+  uint64_t ip_limit = 0;
+  for (ThreadMetrics* m : all) {
+    fd_limit += m->rejected_fd_limit.Value();
+    queue_full += m->rejected_queue_full.Value();
+    ip_limit += m->rejected_ip_limit.Value();
+  }
+  AppendHeader(out, "webserver_connections_rejected_total", "counter",
+               "Connections closed because of resource limits.");
+  AppendValue(out, "webserver_connections_rejected_total", "{reason=\"fd_limit\"}", fd_limit);
+  AppendValue(out, "webserver_connections_rejected_total", "{reason=\"queue_full\"}", queue_full);
+  AppendValue(out, "webserver_connections_rejected_total", "{reason=\"ip_limit\"}", ip_limit);
+
+  uint64_t evicted = 0;
+  uint64_t evict_requested = 0;
+  for (ThreadMetrics* m : all) {
+    evicted += m->evicted_idle.Value();
+    evict_requested += m->evict_requested.Value();
+  }
+  AppendHeader(out, "webserver_connections_evicted_total", "counter",
+               "Keep-alive connections closed to make room under fd pressure.");
+  AppendValue(out, "webserver_connections_evicted_total", "{state=\"idle\"}", evicted);
+  AppendValue(out, "webserver_connections_evicted_total", "{state=\"in_flight\"}", evict_requested);
+
+  uint64_t upstream_connects = 0;
+  uint64_t upstream_reused = 0;
+  uint64_t upstream_errors = 0;
+  for (ThreadMetrics* m : all) {
+    upstream_connects += m->upstream_connects.Value();
+    upstream_reused += m->upstream_reused.Value();
+    upstream_errors += m->upstream_errors.Value();
+  }
+  if (upstream_connects + upstream_reused > 0) {
+    AppendHeader(out, "webserver_upstream_connections_total", "counter",
+                 "Upstream connections used by proxied requests.");
+    AppendValue(out, "webserver_upstream_connections_total", "{state=\"new\"}", upstream_connects);
+    AppendValue(out, "webserver_upstream_connections_total", "{state=\"reused\"}", upstream_reused);
+    AppendHeader(out, "webserver_upstream_errors_total", "counter",
+                 "Proxied requests that failed because of the upstream.");
+    AppendValue(out, "webserver_upstream_errors_total", "", upstream_errors);
+  }
+
+  uint64_t cache_hits = 0;
+  uint64_t cache_stale = 0;
+  uint64_t cache_stale_errors = 0;
+  uint64_t cache_misses = 0;
+  for (ThreadMetrics* m : all) {
+    cache_hits += m->cache_hits.Value();
+    cache_stale += m->cache_stale.Value();
+    cache_stale_errors += m->cache_stale_errors.Value();
+    cache_misses += m->cache_misses.Value();
+  }
+  if (cache_hits + cache_stale + cache_stale_errors + cache_misses > 0) {
+    AppendHeader(out, "webserver_cache_requests_total", "counter",
+                 "Cacheable route requests by cache lookup result.");
+    AppendValue(out, "webserver_cache_requests_total", "{result=\"hit\"}", cache_hits);
+    AppendValue(out, "webserver_cache_requests_total", "{result=\"stale\"}", cache_stale);
+    AppendValue(out, "webserver_cache_requests_total", "{result=\"stale_if_error\"}", cache_stale_errors);
+    AppendValue(out, "webserver_cache_requests_total", "{result=\"miss\"}", cache_misses);
+  }
+
+  AppendHeader(out, "webserver_requests_total", "counter", "Requests by response status.");
+  for (int status = 0; status < ThreadMetrics::MAX_STATUS; ++status) {
+    uint64_t total = 0;
+    for (ThreadMetrics* m : all) {
+      total += m->requests[status].Value();
+    }
+    if (total) {
+      char labels[32];
+      snprintf(labels, sizeof(labels), "{status=\"%d\"}", status);
+      AppendValue(out, "webserver_requests_total", labels, total);
+    }
+  }
+
+  AppendCounter(out, "webserver_response_bytes_total", "Bytes written to client sockets.",
+                all, &ThreadMetrics::bytes_out);
+  AppendCounter(out, "webserver_request_body_bytes_total", "Streamed request body bytes read from clients.",
+                all, &ThreadMetrics::body_bytes_in);
+  AppendCounter(out, "webserver_timer_expirations_total", "Connections closed by the idle timer.",
+                all, &ThreadMetrics::timer_expirations);
+  AppendHeader(out, "webserver_arena_heap_allocations_total", "counter",
+               "Request arena blocks taken from the global allocator.");
+  AppendValue(out, "webserver_arena_heap_allocations_total", "", Arena::HeapAllocations());
+  AppendHistogram(out, "webserver_parse_seconds", "Time spent parsing the request.",
+                  all, &ThreadMetrics::parse_us);
+  AppendHistogram(out, "webserver_queue_wait_seconds", "Time a connection waited in the thread pool queue.",
+                  all, &ThreadMetrics::queue_wait_us);
+  AppendHistogram(out, "webserver_ttlb_seconds", "Time from receiving a request to sending the last response byte.",
+                  all, &ThreadMetrics::ttlb_us);
+}
@@ -0,0 +1,96 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+// 只有一个写者(所属线程)的计数器，加一只是普通的读和写(relaxed)，没有加锁的原子操作，
+// 读取方(抓取/metrics的线程)可能读到稍旧的值，但不会读到撕裂的值
+class Counter {
+public:
+  void Add(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  uint64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// HDR风格的延迟直方图(微秒)，每个2的幂区间再分为SUB_BUCKETS个等宽的小区间，
+// 相对误差不超过1/SUB_BUCKETS，记录一个值只需要计算最高位
+class Histogram {
+public:
+  static const int SUB_BITS = 2;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int BUCKETS = (32 - SUB_BITS + 1) * SUB_BUCKETS;   // 覆盖0~2^32微秒
+
+  void Record(uint64_t us) {
+    buckets_[Index(us)].Add();
+    count_.Add();
+    sum_.Add(us);
+  }
+  static int Index(uint64_t us);
+  static uint64_t UpperBound(int index);   // 区间中的最大值(包含)
+
+  Counter buckets_[BUCKETS];
+  Counter count_;
+  Counter sum_;
+};
+
+// 每个线程一份指标，只由该线程修改，抓取时才把所有线程的指标加起来
+struct ThreadMetrics {
+  static const int MAX_STATUS = 600;
+
+  Counter accepted;                // 接受的连接数
+  Counter rejected_fd_limit;       // 连接数达到上限而拒绝的连接数
+  Counter rejected_queue_full;     // 请求队列满而关闭的连接数
+  Counter rejected_ip_limit;       // 客户端IP的连接数达到上限而拒绝的连接数
+  Counter evicted_idle;            // 连接数接近上限时关闭的空闲连接数
+  Counter evict_requested;         // 连接数接近上限时要求在下一个响应后关闭的连接数
+  Counter requests[MAX_STATUS];    // 按状态码统计的请求数
+  Counter bytes_out;               // 发送的字节数
+  Counter body_bytes_in;           // 流式接收的请求实体的字节数
+  Counter timer_expirations;       // 超时关闭的连接数
+  Counter upstream_connects;       // 反向代理新建的上游连接数
+  Counter upstream_reused;         // 反向代理从连接池中取出的上游连接数
+  Counter upstream_errors;         // 上游服务器出错的请求数(连接失败、响应有误等)
+  Counter cache_hits;              // 缓存中新鲜的响应直接回复的请求数
+  Counter cache_stale;             // 回复过期的响应(stale-while-revalidate)的请求数
+  Counter cache_stale_errors;      // 源站出错时回复过期的响应(stale-if-error)的请求数
+  Counter cache_misses;            // 可以缓存但缓存中没有的请求数
+  Histogram parse_us;              // 解析请求的时间
+  Histogram queue_wait_us;         // 在线程池请求队列中等待的时间
+  Histogram ttlb_us;               // 收到请求到响应的最后一个字节发送完毕(time to last byte)
+};
+
+class Metrics {
+public:
+  // 当前线程的指标，第一次调用时创建并注册
+  static ThreadMetrics* Local() {
+    static thread_local ThreadMetrics* local = nullptr;
+    if (!local) {
+      local = Register();
+    }
+    return local;
+  }
+  // 汇总所有线程的指标，按Prometheus文本格式(0.0.4)追加到out中，connections为当前的连接数
+  static void Render(std::string* out, int connections);
+  static void SetPath(const char* path);   // 为NULL时不提供指标
+  static const char* Path() { return path_; }
+  // 各阶段计时使用的时间(UNIX时间，微秒)，与访问日志中的时间一致
+  static int64_t NowUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  }
+
+private:
+  static ThreadMetrics* Register();
+  static const char* path_;
+};
+
+#endif
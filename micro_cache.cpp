@@ -0,0 +1,484 @@
+#include "micro_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+#include "locker.h"
+#include "log.h"
+
+bool MicroCache::enabled_ = false;
+size_t MicroCache::max_entry_size_ = 0;
+
+namespace {
+
+// 表项和键、头部、实体在同一次分配中，键紧跟在Entry之后，然后是头部和实体
+struct Entry {
+  uint64_t hash;
+  Entry* hash_next;         // 哈希值相同的下一个表项
+  Entry* prev;              // LRU链表，表头是最近使用的
+  Entry* next;
+  size_t size;              // 计入内存上限的字节数
+  int key_len;
+  int head_len;
+  int body_len;
+  int status;
+  int64_t stored_ms;
+  int64_t fresh_until_ms;
+  int64_t revalidate_until_ms;
+  int64_t error_until_ms;
+  bool refreshing;          // 已经提交了后台刷新
+
+  char* Key() { return (char*)(this + 1); }
+  char* Head() { return Key() + key_len; }
+  char* Body() { return Head() + head_len; }
+};
+
+const size_t NODE_OVERHEAD = 64;     // 哈希表节点的大致开销
+
+struct Shard {
+  Locker lock;
+  std::unordered_map<uint64_t, Entry*> table;
+  Entry* lru_head = nullptr;
+  Entry* lru_tail = nullptr;
+  size_t bytes = 0;
+};
+
+struct Rule {
+  std::string path;
+  CachePolicy policy;
+  bool used;
+};
+
+Shard* shards = nullptr;
+size_t shard_budget = 0;
+std::vector<Rule*> rules;
+
+std::atomic<int64_t> total_bytes(0);
+std::atomic<int64_t> total_entries(0);
+std::atomic<uint64_t> evictions(0);
+std::atomic<uint64_t> refresh_ok(0);
+std::atomic<uint64_t> refresh_failed(0);
+std::atomic<uint64_t> refresh_dropped(0);
+
+// 后台刷新
+RefreshFunc refresh_func = nullptr;
+pthread_t refresh_thread;
+std::atomic<bool> running(false);
+Locker queue_lock;
+Cond queue_cond;
+std::deque<RefreshJob*> queue;
+std::atomic<int> pending(0);     // queue的长度，在queue_lock内更新，Lookup不加锁读取
+
+int64_t NowMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// FNV-1a，高位选分片
+uint64_t Hash(const char* key, int len) {
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < len; ++i) {
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+inline Shard& ShardOf(uint64_t hash) {
+  return shards[hash >> 60];   // SHARDS = 16
+}
+
+Entry* Find(Shard& shard, uint64_t hash, const char* key, int key_len) {
+  auto it = shard.table.find(hash);
+  if (it == shard.table.end()) {
+    return nullptr;
+  }
+  for (Entry* entry = it->second; entry; entry = entry->hash_next) {
+    if (entry->key_len == key_len && memcmp(entry->Key(), key, key_len) == 0) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+void Unlink(Shard& shard, Entry* entry) {
+  (entry->prev ? entry->prev->next : shard.lru_head) = entry->next;
+  (entry->next ? entry->next->prev : shard.lru_tail) = entry->prev;
+}
+
+void PushFront(Shard& shard, Entry* entry) {
+  entry->prev = nullptr;
+  entry->next = shard.lru_head;
+  (shard.lru_head ? shard.lru_head->prev : shard.lru_tail) = entry;
+  shard.lru_head = entry;
+}
+
+void Remove(Shard& shard, Entry* entry) {
+  auto it = shard.table.find(entry->hash);
+  Entry** link = &it->second;
+  while (*link != entry) {
+    link = &(*link)->hash_next;
+  }
+  *link = entry->hash_next;
+  if (!it->second) {
+    shard.table.erase(it);
+  }
+  Unlink(shard, entry);
+  shard.bytes -= entry->size;
+  total_bytes.fetch_sub(entry->size, std::memory_order_relaxed);
+  total_entries.fetch_sub(1, std::memory_order_relaxed);
+  free(entry);
+}
+
+bool HasPrefix(const char* line, const char* name) {
+  return strncasecmp(line, name, strlen(name)) == 0;
+}
+
+// 命中时重新生成的头部，保存时去掉
+bool IsVolatile(const char* line) {
+  static const char* names[] = {"Date:", "Content-Length:", "Age:", "X-Cache:", "Connection:",
+                                "Keep-Alive:"};
+  for (const char* name : names) {
+    if (HasPrefix(line, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 复制头部并去掉会变化的头部，返回长度
+int CopyHead(char* out, const char* head, int len) {
+  int out_len = 0;
+  const char* end = head + len;
+  for (const char* line = head; line < end;) {
+    const char* line_end = (const char*)memchr(line, '\n', end - line);
+    line_end = line_end ? line_end + 1 : end;
+    if (line == head || !IsVolatile(line)) {
+      memcpy(out + out_len, line, line_end - line);
+      out_len += line_end - line;
+    }
+    line = line_end;
+  }
+  return out_len;
+}
+
+void ClearRefreshing(const std::string& key) {
+  uint64_t hash = Hash(key.data(), key.size());
+  Shard& shard = ShardOf(hash);
+  shard.lock.Lock();
+  Entry* entry = Find(shard, hash, key.data(), key.size());
+  if (entry) {
+    entry->refreshing = false;
+  }
+  shard.lock.UnLock();
+}
+
+void* Refresher(void*) {
+  std::string head;
+  std::string body;
+  while (true) {
+    queue_lock.Lock();
+    while (running.load() && queue.empty()) {
+      queue_cond.Wait(queue_lock.Get());
+    }
+    if (!running.load()) {
+      queue_lock.UnLock();
+      break;
+    }
+    RefreshJob* job = queue.front();
+    queue.pop_front();
+    pending.store(queue.size(), std::memory_order_relaxed);
+    queue_lock.UnLock();
+
+    int status = 0;
+    head.clear();
+    body.clear();
+    if (refresh_func(*job, &status, &head, &body) &&
+        MicroCache::Cacheable(status, head.data(), head.size())) {
+      // 替换旧的表项，同时清除refreshing
+      MicroCache::Store(job->key.data(), job->key.size(), job->policy, status, head.data(), head.size(),
+                        body.data(), body.size());
+      refresh_ok.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      // 旧的响应继续使用到窗口结束，之后的命中再提交刷新
+      ClearRefreshing(job->key);
+      refresh_failed.fetch_add(1, std::memory_order_relaxed);
+      LOG_WARN("后台刷新%s失败", job->url.c_str());
+    }
+    delete job;
+    if (body.capacity() > MicroCache::MaxEntrySize()) {
+      std::string().swap(body);
+    }
+  }
+  return NULL;
+}
+
+}  // namespace
+
+bool MicroCache::AddRule(const char* spec) {
+  const char* eq = strchr(spec, '=');
+  if (!eq || spec[0] != '/') {
+    return false;
+  }
+  int values[3] = {0, 0, 0};
+  const char* p = eq + 1;
+  for (int i = 0; i < 3; ++i) {
+    char* end;
+    long value = strtol(p, &end, 10);
+    if (end == p || value < 0 || value > 86400000) {
+      return false;
+    }
+    values[i] = value;
+    if (*end == '\0') {
+      break;
+    }
+    if (*end != ',' || i == 2) {
+      return false;
+    }
+    p = end + 1;
+  }
+  if (values[0] == 0) {
+    return false;
+  }
+  Rule* rule = new Rule;
+  rule->path.assign(spec, eq - spec);
+  rule->policy.ttl_ms = values[0];
+  rule->policy.stale_while_revalidate_ms = values[1];
+  rule->policy.stale_if_error_ms = values[2];
+  rule->used = false;
+  rules.push_back(rule);
+  enabled_ = true;
+  return true;
+}
+
+const CachePolicy* MicroCache::PolicyFor(const char* path) {
+  for (Rule* rule : rules) {
+    if (rule->path == path) {
+      rule->used = true;
+      return &rule->policy;
+    }
+  }
+  return NULL;
+}
+
+bool MicroCache::Start(size_t budget_bytes, RefreshFunc refresh) {
+  if (!enabled_) {
+    return true;
+  }
+  for (Rule* rule : rules) {
+    if (!rule->used) {
+      fprintf(stderr, "缓存规则%s没有对应的路由\n", rule->path.c_str());
+      return false;
+    }
+  }
+  shards = new Shard[SHARDS];
+  shard_budget = budget_bytes / SHARDS;
+  // 单个响应不超过分片上限的1/4，避免一个大响应把整个分片清空
+  max_entry_size_ = shard_budget / 4;
+  refresh_func = refresh;
+  running.store(true);
+  if (pthread_create(&refresh_thread, NULL, Refresher, NULL) != 0) {
+    running.store(false);
+    return false;
+  }
+  return true;
+}
+
+void MicroCache::Stop() {
+  if (!running.load()) {
+    return;
+  }
+  queue_lock.Lock();
+  running.store(false);
+  queue_cond.Signal();
+  queue_lock.UnLock();
+  pthread_join(refresh_thread, NULL);
+  for (RefreshJob* job : queue) {
+    delete job;
+  }
+  queue.clear();
+  pending.store(0, std::memory_order_relaxed);
+}
+
+MicroCache::RESULT MicroCache::Lookup(const char* key, int key_len, bool error, Arena* arena,
+                                      CachedResponse* out, bool* refresh) {
+  uint64_t hash = Hash(key, key_len);
+  Shard& shard = ShardOf(hash);
+  int64_t now = NowMs();
+  RESULT result = CACHE_MISS;
+  shard.lock.Lock();
+  Entry* entry = Find(shard, hash, key, key_len);
+  if (entry) {
+    if (now < entry->fresh_until_ms) {
+      result = CACHE_HIT;
+    } else if (error ? now < entry->error_until_ms : now < entry->revalidate_until_ms) {
+      result = CACHE_STALE;
+      if (!error && !entry->refreshing) {
+        // 刷新队列已满时不让调用者构造刷新任务，之后的命中再提交
+        if (pending.load(std::memory_order_relaxed) < MAX_PENDING_REFRESH) {
+          entry->refreshing = true;
+          *refresh = true;
+        } else {
+          refresh_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    } else if (now >= entry->revalidate_until_ms && now >= entry->error_until_ms) {
+      Remove(shard, entry);
+      entry = nullptr;
+    }
+  }
+  char* buf = nullptr;
+  if (result != CACHE_MISS) {
+    buf = (char*)arena->Allocate(entry->head_len + EXTRA_HEADERS_SIZE + entry->body_len, 1);
+    if (!buf) {
+      // 复制不了就按没有命中处理，交给源站；刷新也不由这个请求提交
+      result = CACHE_MISS;
+      if (*refresh) {
+        entry->refreshing = false;
+        *refresh = false;
+      }
+    }
+  }
+  if (buf) {
+    memcpy(buf, entry->Head(), entry->head_len);
+    memcpy(buf + entry->head_len + EXTRA_HEADERS_SIZE, entry->Body(), entry->body_len);
+    out->status = entry->status;
+    out->head = buf;
+    out->head_len = entry->head_len;
+    out->body = buf + entry->head_len + EXTRA_HEADERS_SIZE;
+    out->body_len = entry->body_len;
+    out->age = (now - entry->stored_ms) / 1000;
+    out->stale = result == CACHE_STALE;
+    Unlink(shard, entry);
+    PushFront(shard, entry);
+  }
+  shard.lock.UnLock();
+  return result;
+}
+
+bool MicroCache::Cacheable(int status, const char* head, int head_len) {
+  // 带实体、与请求的其他头部无关的状态码
+  if (status != 200 && status != 203 && status != 301 && status != 302 && status != 404 &&
+      status != 410) {
+    return false;
+  }
+  const char* end = head + head_len;
+  for (const char* line = head; line < end;) {
+    const char* line_end = (const char*)memchr(line, '\n', end - line);
+    line_end = line_end ? line_end + 1 : end;
+    if (HasPrefix(line, "Set-Cookie:") || HasPrefix(line, "Vary:")) {
+      return false;   // Vary的头部不在键中
+    }
+    if (HasPrefix(line, "Cache-Control:")) {
+      std::string value(line + 14, line_end - line - 14);
+      for (char& c : value) {
+        c = tolower(c);
+      }
+      if (value.find("no-store") != std::string::npos || value.find("no-cache") != std::string::npos ||
+          value.find("private") != std::string::npos) {
+        return false;
+      }
+    }
+    line = line_end;
+  }
+  return true;
+}
+
+void MicroCache::Store(const char* key, int key_len, const CachePolicy* policy, int status,
+                       const char* head, int head_len, const char* body, int body_len) {
+  if (!enabled_ || !policy) {
+    return;
+  }
+  size_t size = sizeof(Entry) + key_len + head_len + body_len;
+  if (size + NODE_OVERHEAD > max_entry_size_) {
+    return;
+  }
+  Entry* entry = (Entry*)malloc(size);
+  if (!entry) {
+    return;
+  }
+  int64_t now = NowMs();
+  entry->hash = Hash(key, key_len);
+  entry->key_len = key_len;
+  memcpy(entry->Key(), key, key_len);
+  entry->head_len = CopyHead(entry->Head(), head, head_len);
+  memmove(entry->Body(), body, body_len);
+  entry->body_len = body_len;
+  entry->size = size + NODE_OVERHEAD;
+  entry->status = status;
+  entry->stored_ms = now;
+  entry->fresh_until_ms = now + policy->ttl_ms;
+  entry->revalidate_until_ms = entry->fresh_until_ms + policy->stale_while_revalidate_ms;
+  entry->error_until_ms = entry->fresh_until_ms + policy->stale_if_error_ms;
+  entry->refreshing = false;
+
+  Shard& shard = ShardOf(entry->hash);
+  shard.lock.Lock();
+  Entry* old = Find(shard, entry->hash, key, key_len);
+  if (old) {
+    Remove(shard, old);
+  }
+  while (shard.lru_tail && shard.bytes + entry->size > shard_budget) {
+    Remove(shard, shard.lru_tail);
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+  Entry*& bucket = shard.table[entry->hash];
+  entry->hash_next = bucket;
+  bucket = entry;
+  PushFront(shard, entry);
+  shard.bytes += entry->size;
+  shard.lock.UnLock();
+  total_bytes.fetch_add(entry->size, std::memory_order_relaxed);
+  total_entries.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MicroCache::Refresh(RefreshJob* job) {
+  queue_lock.Lock();
+  bool queued = running.load() && (int)queue.size() < MAX_PENDING_REFRESH;
+  if (queued) {
+    queue.push_back(job);
+    pending.store(queue.size(), std::memory_order_relaxed);
+    queue_cond.Signal();
+  }
+  queue_lock.UnLock();
+  if (!queued) {
+    ClearRefreshing(job->key);
+    refresh_dropped.fetch_add(1, std::memory_order_relaxed);
+    delete job;
+  }
+}
+
+void MicroCache::RenderMetrics(std::string* out) {
+  if (!enabled_) {
+    return;
+  }
+  char text[1024];
+  snprintf(text, sizeof(text),
+           "# HELP webserver_cache_bytes Memory used by cached responses.\n"
+           "# TYPE webserver_cache_bytes gauge\n"
+           "webserver_cache_bytes %lld\n"
+           "# HELP webserver_cache_entries Cached responses.\n"
+           "# TYPE webserver_cache_entries gauge\n"
+           "webserver_cache_entries %lld\n"
+           "# HELP webserver_cache_evictions_total Cached responses evicted to stay within the memory budget.\n"
+           "# TYPE webserver_cache_evictions_total counter\n"
+           "webserver_cache_evictions_total %llu\n"
+           "# HELP webserver_cache_refreshes_total Background refreshes of stale responses.\n"
+           "# TYPE webserver_cache_refreshes_total counter\n"
+           "webserver_cache_refreshes_total{result=\"ok\"} %llu\n"
+           "webserver_cache_refreshes_total{result=\"failed\"} %llu\n"
+           "webserver_cache_refreshes_total{result=\"dropped\"} %llu\n",
+           (long long)total_bytes.load(), (long long)total_entries.load(),
+           (unsigned long long)evictions.load(), (unsigned long long)refresh_ok.load(),
+           (unsigned long long)refresh_failed.load(), (unsigned long long)refresh_dropped.load());
+  out->append(text);
+}
@@ -0,0 +1,84 @@
+#ifndef MICRO_CACHE_H_
+#define MICRO_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class Arena;
+
+// 一个路由的缓存策略，注册路由时指定(Router::Add()的cache参数)，不指定的路由不缓存
+struct CachePolicy {
+  int ttl_ms;                          // 响应保持新鲜的时间
+  int stale_while_revalidate_ms;       // 过期之后仍然直接回复、同时在后台刷新的时间
+  int stale_if_error_ms;               // 过期之后源站(处理函数或者上游)出错时仍然可以回复的时间
+};
+
+// 命中时复制到连接的arena中的响应，head之后预留了EXTRA_HEADERS_SIZE字节给Date等变化的头部
+struct CachedResponse {
+  int status;
+  char* head;                          // 状态行和头部，不包括Date、Content-Length、Connection和结尾的空行
+  int head_len;
+  const char* body;
+  int body_len;
+  int age;                             // 缓存的时间(秒)，用于Age头部
+  bool stale;
+};
+
+// 需要后台刷新的请求，由刷新线程调用Start()时传入的函数重新生成响应
+struct RefreshJob {
+  std::string key;
+  std::string url;                     // 请求的目标(包括查询串)，用来重新匹配路由
+  std::string request;                 // 转发给上游的请求报文(路由是反向代理时使用)
+  const CachePolicy* policy;
+};
+
+// 重新生成响应，成功时返回true并填写状态码、头部(格式同CachedResponse::head)和实体
+typedef bool (*RefreshFunc)(const RefreshJob& job, int* status, std::string* head, std::string* body);
+
+// 动态响应(路由的处理函数和反向代理)的短时间缓存(microcache)，毫秒级内到达的相同请求只有一个到达源站
+// 键是方法、URL和选定的请求头部(Host、Accept-Encoding)，由HttpConn生成；
+// 表按键的哈希分成SHARDS个分片，每个分片有自己的锁、LRU链表和内存上限(总上限的1/SHARDS)，
+// 超过上限时从最久没有使用的表项开始淘汰；命中时在锁内把响应复制到连接的arena中，之后不再引用表项
+// 过期之后的stale-while-revalidate窗口内直接回复旧的响应，第一个看到过期的请求把刷新交给后台线程；
+// stale-if-error窗口内源站出错时回复旧的响应而不是5xx
+class MicroCache {
+public:
+  static const int SHARDS = 16;
+  static const int MAX_KEY_SIZE = 1024;
+  static const int EXTRA_HEADERS_SIZE = 256;   // 命中时加上的Date、Content-Length、Age、X-Cache和Connection
+  static const int MAX_PENDING_REFRESH = 256;  // 等待后台刷新的请求数，超过时丢弃(下一次过期的命中再试)
+  enum RESULT {CACHE_MISS, CACHE_HIT, CACHE_STALE};
+
+  // spec为"路径=TTL毫秒[,stale-while-revalidate毫秒[,stale-if-error毫秒]]"，路径与注册路由时的路径或者上游的前缀相同
+  static bool AddRule(const char* spec);
+  // 注册路由时查找路径对应的策略，没有时返回NULL
+  static const CachePolicy* PolicyFor(const char* path);
+  static bool Enabled() { return enabled_; }
+  // 设置内存上限并启动后台刷新线程，在注册完所有路由之后、创建工作线程之前调用；
+  // 有没有被任何路由使用的规则时返回false
+  static bool Start(size_t budget_bytes, RefreshFunc refresh);
+  static void Stop();
+
+  // 查找键，命中时把响应复制到arena中；error为true时查找stale-if-error窗口内的响应(源站出错时)，
+  // 否则查找新鲜的或者stale-while-revalidate窗口内的响应，后者refresh返回true时调用者要提交后台刷新
+  // (刷新队列已满时不返回true，调用者不必构造刷新任务)
+  static RESULT Lookup(const char* key, int key_len, bool error, Arena* arena, CachedResponse* out,
+                       bool* refresh);
+  // 状态码和头部允许缓存(没有Set-Cookie，Cache-Control中没有no-store、no-cache和private)
+  static bool Cacheable(int status, const char* head, int head_len);
+  // 保存一个响应，替换已有的表项；头部中的Date、Content-Length和Age不保存
+  static void Store(const char* key, int key_len, const CachePolicy* policy, int status,
+                    const char* head, int head_len, const char* body, int body_len);
+  // 提交后台刷新，队列满时放弃并允许之后的命中再提交
+  static void Refresh(RefreshJob* job);
+  static size_t MaxEntrySize() { return max_entry_size_; }
+  // 在指标中加上缓存的大小和后台刷新的次数
+  static void RenderMetrics(std::string* out);
+
+private:
+  static bool enabled_;
+  static size_t max_entry_size_;
+};
+
+#endif
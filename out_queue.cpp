@@ -0,0 +1,173 @@
+#include "out_queue.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+OutQueue::Segment* OutQueue::Push() {
+  if (count_ == MAX_SEGMENTS) {
+    return nullptr;
+  }
+  Segment* seg = &segments_[(head_ + count_) % MAX_SEGMENTS];
+  ++count_;
+  seg->data = nullptr;
+  seg->fd = -1;
+  seg->offset = 0;
+  seg->map_addr = nullptr;
+  seg->map_offset = 0;
+  seg->map_len = 0;
+  return seg;
+}
+
+bool OutQueue::AddBuffer(const char* data, int64_t len) {
+  if (len <= 0) {
+    return true;
+  }
+  Segment* seg = Push();
+  if (!seg) {
+    return false;
+  }
+  seg->data = data;
+  seg->len = len;
+  bytes_ += len;
+  return true;
+}
+
+bool OutQueue::AddFile(int fd, off_t offset, int64_t len) {
+  Segment* seg = len > 0 ? Push() : nullptr;
+  if (!seg) {
+    close(fd);
+    return len <= 0;
+  }
+  seg->fd = fd;
+  seg->offset = offset;
+  seg->len = len;
+  bytes_ += len;
+  return true;
+}
+
+// 大文件不会一次映射到内存中，而是每次只映射FILE_WINDOW_SIZE大小的窗口，
+// 发送完一个窗口后再映射下一个，使每个下载占用的内存有上限
+bool OutQueue::MapWindow(Segment* seg) {
+  if (seg->map_addr) {
+    munmap(seg->map_addr, seg->map_len);
+    seg->map_addr = nullptr;
+  }
+  // mmap的偏移量必须是页大小的整数倍，因此从offset所在页的起始处开始映射
+  off_t page_size = sysconf(_SC_PAGESIZE);
+  off_t map_offset = seg->offset - seg->offset % page_size;
+  off_t window_end = map_offset + FILE_WINDOW_SIZE;
+  if (window_end > seg->offset + seg->len) {
+    window_end = seg->offset + seg->len;
+  }
+  // PORT_READ描述该映射区域的保护权限(Protection)
+  // MAP_PRIVATE表示更新这段区域对其他进程是不可见的
+  void* addr = mmap(NULL, window_end - map_offset, PROT_READ, MAP_PRIVATE, seg->fd, map_offset);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  // 顺序发送，提示内核预读
+  madvise(addr, window_end - map_offset, MADV_SEQUENTIAL);
+  seg->map_addr = (char*)addr;
+  seg->map_offset = map_offset;
+  seg->map_len = window_end - map_offset;
+  return true;
+}
+
+void OutQueue::Release(Segment* seg) {
+  if (seg->map_addr) {
+    munmap(seg->map_addr, seg->map_len);
+    seg->map_addr = nullptr;
+  }
+  if (seg->fd >= 0) {
+    close(seg->fd);
+    seg->fd = -1;
+  }
+}
+
+void OutQueue::Consume(int64_t bytes) {
+  bytes_ -= bytes;
+  while (bytes > 0) {
+    Segment* seg = &segments_[head_];
+    int64_t n = bytes < seg->len ? bytes : seg->len;
+    if (seg->data) {
+      seg->data += n;
+    } else {
+      seg->offset += n;
+    }
+    seg->len -= n;
+    bytes -= n;
+    if (seg->len == 0) {
+      // 该段发送完毕，出队
+      Release(seg);
+      head_ = (head_ + 1) % MAX_SEGMENTS;
+      --count_;
+    }
+  }
+}
+
+OutQueue::FLUSH_STATUS OutQueue::Flush(int sockfd, int64_t* sent) {
+  *sent = 0;
+  while (count_ > 0) {
+    // 把队列中的段收集到iovec中，文件段使用当前映射的窗口，
+    // 一次收集的数据不超过一个窗口的大小，避免同时映射过多的文件内容
+    struct iovec iov[MAX_SEGMENTS];
+    int iov_count = 0;
+    int64_t batch = 0;
+    for (int i = 0; i < count_ && batch < FILE_WINDOW_SIZE; ++i) {
+      Segment* seg = &segments_[(head_ + i) % MAX_SEGMENTS];
+      if (seg->data) {
+        iov[iov_count].iov_base = (void*)seg->data;
+        iov[iov_count].iov_len = seg->len;
+      } else {
+        off_t map_end = seg->map_offset + seg->map_len;
+        if (!seg->map_addr || seg->offset >= map_end) {
+          // 当前窗口已经发送完毕，映射文件的下一个窗口
+          if (!MapWindow(seg)) {
+            return FLUSH_ERROR;
+          }
+          map_end = seg->map_offset + seg->map_len;
+        }
+        iov[iov_count].iov_base = seg->map_addr + (seg->offset - seg->map_offset);
+        iov[iov_count].iov_len = map_end - seg->offset;
+      }
+      batch += iov[iov_count].iov_len;
+      ++iov_count;
+    }
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+    // 队列中还有这一批之外的数据时带上MSG_MORE，内核会等到凑满一个报文段再发送
+    int flags = MSG_NOSIGNAL;
+    if (batch < bytes_) {
+      flags |= MSG_MORE;
+    }
+    ssize_t n = sendmsg(sockfd, &msg, flags);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // TCP写缓冲没有空间，已发送的进度保存在队列中，等待下一轮EPOLLOUT事件
+        return FLUSH_AGAIN;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return FLUSH_ERROR;
+    }
+    // sendmsg可能只写了一部分，推进队列使下一次从中断的位置继续发送
+    *sent += n;
+    Consume(n);
+  }
+  return FLUSH_DONE;
+}
+
+void OutQueue::Clear() {
+  while (count_ > 0) {
+    Release(&segments_[head_]);
+    head_ = (head_ + 1) % MAX_SEGMENTS;
+    --count_;
+  }
+  head_ = 0;
+  bytes_ = 0;
+}
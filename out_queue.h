@@ -0,0 +1,53 @@
+#ifndef OUT_QUEUE_H_
+#define OUT_QUEUE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// 连接的发送队列，队列中的每一段是一块内存(响应头部、错误页面)或者文件的一个范围(响应实体)
+// 流水线上多个响应的所有段在Flush()时合并到一次sendmsg中发送，
+// 还有后续数据时带上MSG_MORE(作用与TCP_CORK相同)，使小响应也能合并成满的TCP报文段
+class OutQueue {
+public:
+  static const int MAX_SEGMENTS = 16;           // 队列中最多的段数
+  static const int FILE_WINDOW_SIZE = 1 << 20;  // 发送文件时每次映射的窗口大小(1MB)
+
+  // Flush()的结果
+  enum FLUSH_STATUS {FLUSH_DONE, FLUSH_AGAIN, FLUSH_ERROR};
+
+  OutQueue() : head_(0), count_(0), bytes_(0) {}
+  ~OutQueue() { Clear(); }
+
+  bool AddBuffer(const char* data, int64_t len);  // 内存段，发送完毕之前data必须有效
+  bool AddFile(int fd, off_t offset, int64_t len);  // 文件段，接管fd，发送完毕后关闭
+  // 尽可能多地发送队列中的数据，sent返回本次发送的字节数
+  // FLUSH_DONE: 队列已经发送完毕  FLUSH_AGAIN: socket写缓冲已满  FLUSH_ERROR: 发送出错
+  FLUSH_STATUS Flush(int sockfd, int64_t* sent);
+  void Clear();                                   // 丢弃未发送的段，解除映射并关闭文件
+  bool Empty() const { return count_ == 0; }
+  int FreeSegments() const { return MAX_SEGMENTS - count_; }
+  int64_t Bytes() const { return bytes_; }        // 还未发送的字节数
+
+private:
+  struct Segment {
+    const char* data;   // 内存段的数据，文件段为NULL
+    int fd;             // 文件段的文件描述符
+    off_t offset;       // 文件段下一个要发送的字节在文件中的偏移
+    int64_t len;        // 该段还未发送的字节数
+    char* map_addr;     // 文件段当前映射的窗口
+    off_t map_offset;   // 窗口在文件中的起始偏移(按页对齐)
+    size_t map_len;     // 窗口的长度
+  };
+
+  Segment* Push();
+  bool MapWindow(Segment* seg);   // 映射文件段从offset开始的下一个窗口
+  void Release(Segment* seg);     // 解除映射并关闭文件
+  void Consume(int64_t bytes);    // 从队头开始推进已发送的字节
+
+  Segment segments_[MAX_SEGMENTS];  // 环形队列
+  int head_;
+  int count_;
+  int64_t bytes_;
+};
+
+#endif
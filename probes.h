@@ -0,0 +1,43 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+// USDT静态探针，provider为webserver，供perf和bpftrace使用(见tools/bpftrace/)
+// 没有挂载时每个探针只是一条nop指令；没有sys/sdt.h(systemtap-sdt-dev)时编译为空
+//
+//   conn_accept(fd, ip, port)           新连接，ip和port为网络字节序
+//   conn_close(fd, bytes_sent)          关闭连接
+//   parse_start(fd)                     开始解析一个请求
+//   parse_end(fd, status, url)          响应已生成，status为状态码，url为请求的URL(可能为NULL)
+//   queue_enqueue(request)              连接放入线程池的请求队列
+//   queue_dequeue(request, wait_us)     工作线程取出连接
+//   timer_expire(user_data)             定时器到期，user_data为连接
+//   write_done(fd, bytes)               发送队列发送完毕，bytes为本次调用发送的字节数
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define WEBSERVER_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef WEBSERVER_HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE_CONN_ACCEPT(fd, ip, port) DTRACE_PROBE3(webserver, conn_accept, fd, ip, port)
+#define PROBE_CONN_CLOSE(fd, bytes) DTRACE_PROBE2(webserver, conn_close, fd, bytes)
+#define PROBE_PARSE_START(fd) DTRACE_PROBE1(webserver, parse_start, fd)
+#define PROBE_PARSE_END(fd, status, url) DTRACE_PROBE3(webserver, parse_end, fd, status, url)
+#define PROBE_QUEUE_ENQUEUE(request) DTRACE_PROBE1(webserver, queue_enqueue, request)
+#define PROBE_QUEUE_DEQUEUE(request, wait_us) DTRACE_PROBE2(webserver, queue_dequeue, request, wait_us)
+#define PROBE_TIMER_EXPIRE(user_data) DTRACE_PROBE1(webserver, timer_expire, user_data)
+#define PROBE_WRITE_DONE(fd, bytes) DTRACE_PROBE2(webserver, write_done, fd, bytes)
+#else
+#define PROBE_CONN_ACCEPT(fd, ip, port) do {} while (0)
+#define PROBE_CONN_CLOSE(fd, bytes) do {} while (0)
+#define PROBE_PARSE_START(fd) do {} while (0)
+#define PROBE_PARSE_END(fd, status, url) do {} while (0)
+#define PROBE_QUEUE_ENQUEUE(request) do {} while (0)
+#define PROBE_QUEUE_DEQUEUE(request, wait_us) do {} while (0)
+#define PROBE_TIMER_EXPIRE(user_data) do {} while (0)
+#define PROBE_WRITE_DONE(fd, bytes) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,747 @@
+#include "proxy.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "locker.h"
+#include "log.h"
+#include "metrics.h"
+#include "micro_cache.h"
+#include "router.h"
+
+std::vector<UpstreamGroup*> Proxy::groups_;
+
+namespace {
+
+std::vector<Backend*> backends;
+UpstreamConn** conn_objects = nullptr;            // 按fd索引的连接对象，只由持有这个fd的线程访问
+std::atomic<UpstreamConn*>* active_conns = nullptr;  // 打开着的上游连接，主线程据此分发事件
+
+// 每个线程的空闲连接池，按上游服务器分开
+struct IdlePool {
+  UpstreamConn* head[Proxy::MAX_BACKENDS];
+  int count[Proxy::MAX_BACKENDS];
+};
+thread_local IdlePool idle_pool;
+thread_local unsigned pick_start = 0;   // 未完成请求数相同时轮流选择
+
+// 健康检查
+const char* health_path = "/";
+int health_interval_ms = 2000;
+const int HEALTH_TIMEOUT_MS = 1000;
+const int FETCH_TIMEOUT_MS = 5000;       // 后台刷新缓存时同步请求的超时
+pthread_t health_thread;
+std::atomic<bool> running(false);
+Locker health_lock;
+Cond health_cond;
+
+// 解析"地址:端口"，地址可以是主机名
+bool ParseAddress(const char* text, int len, sockaddr_in* addr) {
+  char host[64];
+  const char* colon = (const char*)memrchr(text, ':', len);
+  if (!colon || colon - text >= (int)sizeof(host) || colon == text) {
+    return false;
+  }
+  memcpy(host, text, colon - text);
+  host[colon - text] = '\0';
+  int port = atoi(colon + 1);
+  if (port <= 0 || port > 65535) {
+    return false;
+  }
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result = NULL;
+  if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result) {
+    return false;
+  }
+  *addr = *(sockaddr_in*)result->ai_addr;
+  addr->sin_port = htons(port);
+  freeaddrinfo(result);
+  return true;
+}
+
+Backend* FindOrAddBackend(const char* text, int len) {
+  for (Backend* backend : backends) {
+    if ((int)strlen(backend->name) == len && strncmp(backend->name, text, len) == 0) {
+      return backend;
+    }
+  }
+  if ((int)backends.size() >= Proxy::MAX_BACKENDS || len >= (int)sizeof(Backend::name)) {
+    return NULL;
+  }
+  Backend* backend = new Backend;
+  if (!ParseAddress(text, len, &backend->addr)) {
+    delete backend;
+    return NULL;
+  }
+  backend->id = backends.size();
+  memcpy(backend->name, text, len);
+  backend->name[len] = '\0';
+  backends.push_back(backend);
+  return backend;
+}
+
+// 前缀对应的路由，处理函数只是要求HttpConn转发
+bool ProxyHandler(const RouteRequest&, RouteResponse* response, void* arg) {
+  response->Proxy((UpstreamGroup*)arg);
+  return true;
+}
+
+// 在健康的服务器中选择未完成请求最少的
+Backend* Pick(UpstreamGroup* group, const Backend* avoid) {
+  int n = group->backends.size();
+  unsigned start = pick_start++;
+  Backend* best = NULL;
+  int best_outstanding = 0;
+  for (int i = 0; i < n; ++i) {
+    Backend* backend = group->backends[(start + i) % n];
+    if (backend == avoid || !backend->healthy.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    int outstanding = backend->outstanding.load(std::memory_order_relaxed);
+    if (!best || outstanding < best_outstanding) {
+      best = backend;
+      best_outstanding = outstanding;
+    }
+  }
+  return best;
+}
+
+void Close(UpstreamConn* conn) {
+  int fd = conn->Fd();
+  active_conns[fd].store(nullptr, std::memory_order_release);
+  close(fd);   // 同时从epoll中删除
+}
+
+bool IsToken(const char* value, const char* end, const char* token) {
+  // 逗号分隔的列表中是否有token(不区分大小写)
+  int len = strlen(token);
+  while (value < end) {
+    value += strspn(value, " \t,");
+    const char* p = value;
+    while (p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r') {
+      ++p;
+    }
+    if (p - value == len && strncasecmp(value, token, len) == 0) {
+      return true;
+    }
+    value = p + 1;
+  }
+  return false;
+}
+
+bool HasPrefix(const char* line, const char* name) {
+  return strncasecmp(line, name, strlen(name)) == 0;
+}
+
+// 逐跳的头部，只对一个连接有效，不转发
+bool IsHopByHop(const char* line) {
+  static const char* names[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:",
+                                "Upgrade:", "Trailer:"};
+  for (const char* name : names) {
+    if (HasPrefix(line, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 请求一次path，2xx和3xx表示健康
+bool Probe(Backend* backend) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = false;
+  pollfd pfd = {fd, POLLOUT, 0};
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+  char request[256];
+  int len = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\nUser-Agent: webserver-health\r\n\r\n",
+                     health_path, backend->name);
+  char response[64];
+  int received = 0;
+  if ((connect(fd, (sockaddr*)&backend->addr, sizeof(backend->addr)) == 0 || errno == EINPROGRESS) &&
+      poll(&pfd, 1, HEALTH_TIMEOUT_MS) == 1 &&
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0 &&
+      send(fd, request, len, MSG_NOSIGNAL) == len) {
+    // 只需要状态行
+    pfd.events = POLLIN;
+    while (received < 12 && poll(&pfd, 1, HEALTH_TIMEOUT_MS) == 1) {
+      int n = recv(fd, response + received, sizeof(response) - 1 - received, 0);
+      if (n <= 0) {
+        break;
+      }
+      received += n;
+    }
+    response[received] = '\0';
+    ok = received >= 12 && strncmp(response, "HTTP/1.", 7) == 0 &&
+         (response[9] == '2' || response[9] == '3');
+  }
+  close(fd);
+  return ok;
+}
+
+void* HealthCheck(void*) {
+  while (running.load()) {
+    for (Backend* backend : backends) {
+      bool healthy = Probe(backend);
+      if (healthy != backend->healthy.load()) {
+        if (healthy) {
+          backend->failures.store(0);
+          LOG_INFO("上游服务器%s恢复", backend->name);
+        } else {
+          LOG_WARN("上游服务器%s没有通过健康检查", backend->name);
+        }
+        backend->healthy.store(healthy);
+      }
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)health_interval_ms * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    health_lock.Lock();
+    if (running.load()) {
+      health_cond.TimeWait(health_lock.Get(), &deadline);
+    }
+    health_lock.UnLock();
+  }
+  return NULL;
+}
+
+}  // namespace
+
+void UpstreamConn::StartRequest(int len, bool head_request, bool body_follows) {
+  len_ = len;
+  sent_ = 0;
+  received_ = 0;
+  state_ = SEND_REQUEST;
+  head_request_ = head_request;
+  body_follows_ = body_follows;
+  status_ = 0;
+  head_len_ = 0;
+  body_type_ = BODY_NONE;
+  remaining_ = 0;
+  keep_alive_ = false;
+  eof_ = false;
+  data_start_ = 0;
+  data_len_ = 0;
+  chunked_.Reset();
+}
+
+UpstreamConn::IO_STATUS UpstreamConn::Send() {
+  while (sent_ < len_) {
+    // 非阻塞的connect()还没有完成时返回EAGAIN，连接失败时返回ECONNREFUSED等错误
+    int n = send(fd_, buf_ + sent_, len_ - sent_, MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_ERROR;
+    }
+    sent_ += n;
+  }
+  state_ = body_follows_ ? SEND_BODY : READ_HEAD;
+  len_ = 0;      // 缓冲区接着用来读取响应头部
+  return IO_OK;
+}
+
+UpstreamConn::IO_STATUS UpstreamConn::ReadHead() {
+  while (true) {
+    if (len_ >= BUFFER_SIZE) {
+      return IO_ERROR;   // 响应头部太大
+    }
+    int n = recv(fd_, buf_ + len_, BUFFER_SIZE - len_, 0);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_ERROR;
+    } else if (n == 0) {
+      eof_ = true;
+      return IO_ERROR;
+    }
+    received_ += n;
+    len_ += n;
+    int ret;
+    while ((ret = ParseHead()) > 0) {
+      if (status_ >= 100 && status_ < 200) {
+        // 1xx的中间响应(如100 Continue)不转发，后面还有最终的响应
+        len_ -= head_len_;
+        memmove(buf_, buf_ + head_len_, len_);
+        continue;
+      }
+      data_start_ = head_len_;
+      data_len_ = len_ - head_len_;
+      if (body_type_ == BODY_NONE && data_len_ > 0) {
+        keep_alive_ = false;   // 多余的数据，连接不能复用
+        data_len_ = 0;
+      } else if (body_type_ == BODY_LENGTH && data_len_ >= remaining_) {
+        if (data_len_ > remaining_) {
+          keep_alive_ = false;
+          data_len_ = remaining_;
+        }
+      }
+      if (body_type_ == BODY_LENGTH) {
+        remaining_ -= data_len_;
+      }
+      state_ = body_type_ == BODY_NONE ? DONE : READ_BODY;
+      return IO_OK;
+    }
+    if (ret < 0) {
+      return IO_ERROR;
+    }
+  }
+}
+
+// 返回1表示头部完整并解析成功，0表示还需要更多数据，-1表示格式有误
+int UpstreamConn::ParseHead() {
+  const char* end = (const char*)memmem(buf_, len_, "\r\n\r\n", 4);
+  if (!end) {
+    return 0;
+  }
+  head_len_ = end - buf_ + 4;
+  // HTTP/1.1 200 OK
+  if (head_len_ < 16 || strncmp(buf_, "HTTP/1.", 7) != 0 || buf_[8] != ' ' ||
+      buf_[9] < '1' || buf_[9] > '5' || !isdigit(buf_[10]) || !isdigit(buf_[11])) {
+    return -1;
+  }
+  status_ = (buf_[9] - '0') * 100 + (buf_[10] - '0') * 10 + (buf_[11] - '0');
+  keep_alive_ = buf_[7] == '1';
+  int64_t content_length = -1;
+  bool chunked = false;
+  const char* line = (const char*)memchr(buf_, '\n', head_len_) + 1;
+  while (line < end) {
+    const char* line_end = (const char*)memchr(line, '\r', end + 2 - line);
+    const char* value = (const char*)memchr(line, ':', line_end - line);
+    if (value) {
+      ++value;
+      if (HasPrefix(line, "Content-Length:")) {
+        // 值后面只能有空白；多个值不同的Content-Length无法确定实体的边界，客户端可能取另一个值
+        char* num_end;
+        int64_t length = strtoll(value, &num_end, 10);
+        if (length < 0 || num_end == value || num_end + strspn(num_end, " \t") != line_end ||
+            (content_length >= 0 && length != content_length)) {
+          return -1;
+        }
+        content_length = length;
+      } else if (HasPrefix(line, "Transfer-Encoding:")) {
+        chunked = IsToken(value, line_end, "chunked");
+      } else if (HasPrefix(line, "Connection:")) {
+        if (IsToken(value, line_end, "close")) {
+          keep_alive_ = false;
+        } else if (IsToken(value, line_end, "keep-alive")) {
+          keep_alive_ = true;
+        }
+      }
+    }
+    line = line_end + 2;
+  }
+  // RFC 7230 3.3.3: HEAD的响应以及1xx、204、304没有实体；chunked优先于Content-Length
+  if (head_request_ || status_ < 200 || status_ == 204 || status_ == 304) {
+    body_type_ = BODY_NONE;
+  } else if (chunked) {
+    body_type_ = BODY_CHUNKED;
+  } else if (content_length > 0) {
+    body_type_ = BODY_LENGTH;
+    remaining_ = content_length;
+  } else if (content_length == 0) {
+    body_type_ = BODY_NONE;
+  } else {
+    body_type_ = BODY_UNTIL_CLOSE;
+    keep_alive_ = false;
+  }
+  return 1;
+}
+
+int UpstreamConn::CopyHead(char* out, bool drop_chunked) const {
+  // 状态行统一为HTTP/1.1，与服务器自己生成的响应一致
+  const char* line_end = (const char*)memchr(buf_, '\n', head_len_) + 1;
+  int len = 0;
+  memcpy(out, "HTTP/1.1", 8);
+  len += 8;
+  memcpy(out + len, buf_ + 8, line_end - buf_ - 8);
+  len += line_end - buf_ - 8;
+  const char* end = buf_ + head_len_ - 2;   // 不包括最后的空行
+  for (const char* line = line_end; line < end; line = line_end) {
+    line_end = (const char*)memchr(line, '\n', end - line);
+    line_end = line_end ? line_end + 1 : end;
+    // chunked优先于Content-Length(见ParseHead())，同时出现的Content-Length与转发的实体不符，不转发
+    if (IsHopByHop(line) || (drop_chunked && HasPrefix(line, "Transfer-Encoding:")) ||
+        (body_type_ == BODY_CHUNKED && HasPrefix(line, "Content-Length:"))) {
+      continue;
+    }
+    memcpy(out + len, line, line_end - line);
+    len += line_end - line;
+  }
+  return len;
+}
+
+UpstreamConn::IO_STATUS UpstreamConn::SpliceIn(int64_t max) {
+  if (pipe_[0] < 0 && pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+    return IO_ERROR;
+  }
+  // 只在管道为空时调用，EAGAIN只可能是上游还没有数据
+  if (max > PIPE_SIZE) {
+    max = PIPE_SIZE;
+  }
+  ssize_t n = splice(fd_, NULL, pipe_[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_ERROR;
+  } else if (n == 0) {
+    eof_ = true;
+    if (body_type_ != BODY_UNTIL_CLOSE) {
+      return IO_ERROR;   // 实体还没有读完上游就关闭了
+    }
+    state_ = DONE;
+    return IO_OK;
+  }
+  received_ += n;
+  pipe_bytes_ += n;
+  if (body_type_ == BODY_LENGTH) {
+    remaining_ -= n;
+    if (remaining_ == 0) {
+      state_ = DONE;
+    }
+  }
+  return IO_OK;
+}
+
+UpstreamConn::IO_STATUS UpstreamConn::Recv() {
+  int size = BUFFER_SIZE;
+  if (body_type_ == BODY_LENGTH && remaining_ < size) {
+    size = remaining_;   // 后面的数据不属于这个响应
+  }
+  int n = recv(fd_, buf_, size, 0);
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_ERROR;
+  } else if (n == 0) {
+    eof_ = true;
+    return IO_ERROR;
+  }
+  received_ += n;
+  if (body_type_ == BODY_LENGTH) {
+    remaining_ -= n;
+  }
+  data_start_ = 0;
+  data_len_ = n;
+  return IO_OK;
+}
+
+int UpstreamConn::TakeBody(char* out, bool dechunk) {
+  const char* data = buf_ + data_start_;
+  int len = data_len_;
+  data_len_ = 0;
+  if (body_type_ != BODY_CHUNKED) {
+    memcpy(out, data, len);
+    if (body_type_ == BODY_LENGTH && remaining_ == 0) {
+      state_ = DONE;
+    }
+    return len;
+  }
+  // chunked编码原样转发(HTTP/1.0的客户端只转发数据)，找到最后一个块之后响应结束
+  int out_len = 0;
+  int offset = 0;
+  while (offset < len) {
+    int consumed = 0;
+    const char* chunk = NULL;
+    int chunk_len = 0;
+    ChunkedParser::RESULT ret = chunked_.Parse(data + offset, len - offset, &consumed, &chunk, &chunk_len);
+    if (ret == ChunkedParser::CHUNK_ERROR) {
+      return -1;
+    }
+    if (dechunk) {
+      if (ret == ChunkedParser::CHUNK_DATA) {
+        memcpy(out + out_len, chunk, chunk_len);
+        out_len += chunk_len;
+      }
+    } else {
+      memcpy(out + out_len, data + offset, consumed);
+      out_len += consumed;
+    }
+    offset += consumed;
+    if (ret == ChunkedParser::CHUNK_DONE) {
+      if (offset < len) {
+        keep_alive_ = false;   // 多余的数据
+      }
+      state_ = DONE;
+      break;
+    }
+    if (ret == ChunkedParser::CHUNK_NEED_MORE) {
+      break;
+    }
+  }
+  return out_len;
+}
+
+bool Proxy::AddUpstream(const char* spec) {
+  const char* eq = strchr(spec, '=');
+  if (!eq || spec[0] != '/' || !eq[1]) {
+    return false;
+  }
+  UpstreamGroup* group = new UpstreamGroup;
+  group->prefix.assign(spec, eq - spec);
+  const char* p = eq + 1;
+  while (*p) {
+    int len = strcspn(p, ",");
+    Backend* backend = FindOrAddBackend(p, len);
+    if (!backend) {
+      delete group;
+      return false;
+    }
+    group->backends.push_back(backend);
+    p += len;
+    p += strspn(p, ",");
+  }
+  groups_.push_back(group);
+  return true;
+}
+
+void Proxy::SetHealthCheck(const char* path, int interval_ms) {
+  health_path = path;
+  if (interval_ms > 0) {
+    health_interval_ms = interval_ms;
+  }
+}
+
+bool Proxy::Start() {
+  if (!Enabled()) {
+    return true;
+  }
+  conn_objects = new UpstreamConn*[MAX_FDS]();
+  active_conns = new std::atomic<UpstreamConn*>[MAX_FDS]();
+  // "/api"转发/api和/api/下的所有路径，"/api/"只转发/api/下的路径
+  for (UpstreamGroup* group : groups_) {
+    std::string prefix = group->prefix;
+    if (prefix.back() != '/') {
+      prefix += '/';
+    }
+    std::string catch_all = prefix + "*proxy_path";
+    // 有缓存规则(-x 前缀=...)时缓存GET请求转发的响应
+    const CachePolicy* cache = MicroCache::PolicyFor(group->prefix.c_str());
+    for (int method = 0; method < Router::METHODS; ++method) {
+      const CachePolicy* policy = method == 0 ? cache : NULL;   // HttpConn::GET
+      if (!Router::Add(method, catch_all.c_str(), ProxyHandler, group, policy)) {
+        return false;
+      }
+      if (group->prefix.back() != '/' &&
+          !Router::Add(method, group->prefix.c_str(), ProxyHandler, group, policy)) {
+        return false;
+      }
+    }
+  }
+  running.store(true);
+  if (pthread_create(&health_thread, NULL, HealthCheck, NULL) != 0) {
+    running.store(false);
+    return false;
+  }
+  return true;
+}
+
+void Proxy::Stop() {
+  if (!running.load()) {
+    return;
+  }
+  health_lock.Lock();
+  running.store(false);
+  health_cond.Signal();
+  health_lock.UnLock();
+  pthread_join(health_thread, NULL);
+}
+
+bool Proxy::OnEvent(int fd, bool hup, void** owner) {
+  if (!active_conns || fd < 0 || fd >= MAX_FDS) {
+    return false;
+  }
+  UpstreamConn* conn = active_conns[fd].load(std::memory_order_acquire);
+  if (!conn) {
+    return false;
+  }
+  *owner = conn->owner_.load();
+  if (!*owner && hup) {
+    // 与Connect()中先设置owner_再检查stale_配合，两边至少有一边能看到对方的修改
+    conn->stale_.store(true);
+    *owner = conn->owner_.load();
+  }
+  return true;
+}
+
+UpstreamConn* Proxy::Connect(UpstreamGroup* group, void* owner, int epollfd, bool fresh,
+                             const Backend* avoid) {
+  Backend* backend = Pick(group, avoid);
+  if (!backend) {
+    return NULL;
+  }
+  ThreadMetrics* metrics = Metrics::Local();
+  IdlePool& pool = idle_pool;
+  UpstreamConn* conn = NULL;
+  while (!fresh && pool.head[backend->id]) {
+    conn = pool.head[backend->id];
+    pool.head[backend->id] = conn->next_idle_;
+    --pool.count[backend->id];
+    conn->owner_.store(owner);
+    if (!conn->stale_.load()) {
+      break;
+    }
+    conn->owner_.store(nullptr);
+    Close(conn);
+    conn = NULL;
+  }
+  if (conn) {
+    conn->reused_ = true;
+    metrics->upstream_reused.Add();
+  } else {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return NULL;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (fd >= MAX_FDS ||
+        (connect(fd, (sockaddr*)&backend->addr, sizeof(backend->addr)) < 0 && errno != EINPROGRESS)) {
+      close(fd);
+      Finish(NULL, false, true, backend);
+      return NULL;
+    }
+    conn = conn_objects[fd];
+    if (!conn) {
+      conn = new UpstreamConn;
+      conn_objects[fd] = conn;
+    }
+    conn->fd_ = fd;
+    conn->backend_ = backend;
+    conn->reused_ = false;
+    conn->stale_.store(false);
+    conn->owner_.store(owner);
+    conn->next_idle_ = NULL;
+    conn->pipe_bytes_ = 0;
+    active_conns[fd].store(conn, std::memory_order_release);
+    // 与客户连接一样以ET模式同时注册读写事件，connect()完成时会收到EPOLLOUT
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    metrics->upstream_connects.Add();
+  }
+  backend->outstanding.fetch_add(1, std::memory_order_relaxed);
+  return conn;
+}
+
+void Proxy::Finish(UpstreamConn* conn, bool reuse, bool failed, Backend* backend) {
+  if (conn) {
+    backend = conn->backend_;
+    backend->outstanding.fetch_sub(1, std::memory_order_relaxed);
+  }
+  if (failed) {
+    Metrics::Local()->upstream_errors.Add();
+    if (backend->failures.fetch_add(1) + 1 >= MAX_FAILURES && backend->healthy.exchange(false)) {
+      LOG_WARN("上游服务器%s连续失败%d次，等待健康检查恢复", backend->name, MAX_FAILURES);
+    }
+  } else if (conn && conn->state_ == UpstreamConn::DONE) {
+    backend->failures.store(0, std::memory_order_relaxed);
+  }
+  if (!conn) {
+    return;
+  }
+  conn->owner_.store(nullptr);
+  IdlePool& pool = idle_pool;
+  if (reuse && conn->keep_alive_ && conn->state_ == UpstreamConn::DONE && conn->pipe_bytes_ == 0 &&
+      pool.count[backend->id] < MAX_IDLE) {
+    conn->next_idle_ = pool.head[backend->id];
+    pool.head[backend->id] = conn;
+    ++pool.count[backend->id];
+    return;
+  }
+  if (conn->pipe_[0] >= 0) {
+    close(conn->pipe_[0]);
+    close(conn->pipe_[1]);
+    conn->pipe_[0] = conn->pipe_[1] = -1;
+  }
+  conn->pipe_bytes_ = 0;
+  Close(conn);
+}
+
+bool Proxy::Fetch(UpstreamGroup* group, const char* request, int len, size_t max_body, int* status,
+                  std::string* head, std::string* body) {
+  Backend* backend = Pick(group, NULL);
+  if (!backend || len > UpstreamConn::BUFFER_SIZE) {
+    return false;
+  }
+  // 阻塞的套接字，超时之后send()/recv()返回EAGAIN，按失败处理
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  timeval timeout = {FETCH_TIMEOUT_MS / 1000, (FETCH_TIMEOUT_MS % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  UpstreamConn* conn = new UpstreamConn;   // 不放进连接池，用完就关闭
+  conn->fd_ = fd;
+  conn->backend_ = backend;
+  memcpy(conn->buf_, request, len);
+  conn->StartRequest(len, false);
+  backend->outstanding.fetch_add(1, std::memory_order_relaxed);
+  bool answered = connect(fd, (sockaddr*)&backend->addr, sizeof(backend->addr)) == 0 &&
+                  conn->Send() == UpstreamConn::IO_OK && conn->ReadHead() == UpstreamConn::IO_OK;
+  bool ok = answered && (conn->body_type_ == UpstreamConn::BODY_NONE ||
+                         (conn->body_type_ == UpstreamConn::BODY_LENGTH &&
+                          conn->remaining_ + conn->data_len_ <= (int64_t)max_body));
+  bool failed = !answered;
+  if (ok) {
+    *status = conn->status_;
+    head->resize(conn->head_len_);
+    head->resize(conn->CopyHead(&(*head)[0], false));
+    while (conn->state_ != UpstreamConn::DONE) {
+      if (conn->data_len_ == 0) {
+        if (conn->Recv() != UpstreamConn::IO_OK) {
+          ok = false;
+          failed = true;
+          break;
+        }
+        continue;
+      }
+      size_t offset = body->size();
+      body->resize(offset + conn->data_len_);
+      body->resize(offset + conn->TakeBody(&(*body)[offset], false));
+    }
+  }
+  close(fd);
+  delete conn;
+  backend->outstanding.fetch_sub(1, std::memory_order_relaxed);
+  if (failed) {
+    Finish(NULL, false, true, backend);
+  }
+  return ok;
+}
+
+void Proxy::RenderMetrics(std::string* out) {
+  if (!Enabled()) {
+    return;
+  }
+  char line[160];
+  out->append("# HELP webserver_upstream_healthy Whether the upstream passed its last health check.\n"
+              "# TYPE webserver_upstream_healthy gauge\n");
+  for (Backend* backend : backends) {
+    snprintf(line, sizeof(line), "webserver_upstream_healthy{backend=\"%s\"} %d\n",
+             backend->name, backend->healthy.load() ? 1 : 0);
+    out->append(line);
+  }
+  out->append("# HELP webserver_upstream_outstanding Requests being forwarded to the upstream.\n"
+              "# TYPE webserver_upstream_outstanding gauge\n");
+  for (Backend* backend : backends) {
+    snprintf(line, sizeof(line), "webserver_upstream_outstanding{backend=\"%s\"} %d\n",
+             backend->name, backend->outstanding.load());
+    out->append(line);
+  }
+}
@@ -0,0 +1,149 @@
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "chunked.h"
+
+// 一个上游服务器
+struct Backend {
+  int id;
+  sockaddr_in addr;
+  char name[32];                      // "127.0.0.1:8081"
+  std::atomic<int> outstanding{0};    // 正在转发的请求数，选择上游时取最少的
+  std::atomic<bool> healthy{true};
+  std::atomic<int> failures{0};       // 连续失败的次数(连接失败、响应有误)
+};
+
+// 转发给同一组上游服务器的路径前缀
+struct UpstreamGroup {
+  std::string prefix;
+  std::vector<Backend*> backends;
+};
+
+// 与上游服务器的一个长连接，空闲时放在取出它的线程的连接池中
+// 对象按文件描述符索引，创建之后不释放，主线程收到事件时可以随时读取owner_
+class UpstreamConn {
+public:
+  static const int BUFFER_SIZE = 8192;       // 转发的请求和上游的响应头部都要放得下
+  static const int PIPE_SIZE = 65536;        // 一次splice最多转移的字节数(管道的默认容量)
+  // SEND_REQUEST: 发送请求  SEND_BODY: 转发流式接收的请求实体(由HttpConn写入Fd())
+  // READ_HEAD: 读取响应头部  READ_BODY: 转发响应实体  DONE: 响应已经读完
+  enum STATE {SEND_REQUEST, SEND_BODY, READ_HEAD, READ_BODY, DONE};
+  // 响应实体的长度: 没有实体，Content-Length，chunked编码，到上游关闭连接为止
+  enum BODY_TYPE {BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE};
+  enum IO_STATUS {IO_OK, IO_AGAIN, IO_ERROR};
+
+  // 开始一个请求，请求报文已经写在Buffer()中；body_follows时请求头部发送完之后进入SEND_BODY，
+  // 实体转发完毕后调用BodySent()
+  void StartRequest(int len, bool head_request, bool body_follows = false);
+  IO_STATUS Send();
+  void BodySent() { state_ = READ_HEAD; }
+  // 读取并解析响应头部，1xx的中间响应直接丢弃；头部读完后返回IO_OK
+  IO_STATUS ReadHead();
+  // 把响应头部改写成发给客户端的格式写到out(至少HeadLen()字节)，去掉逐跳的头部(Connection等)，
+  // drop_chunked时再去掉Transfer-Encoding，chunked编码的响应去掉Content-Length；不包括结尾的空行，返回长度
+  int CopyHead(char* out, bool drop_chunked) const;
+  // 把最多max个字节的响应实体从上游转移到管道中(splice，不经过用户空间)
+  IO_STATUS SpliceIn(int64_t max);
+  // 读取响应实体到缓冲区中(Content-Length时不超过剩余的长度)，用TakeBody()取出
+  IO_STATUS Recv();
+  // 把缓冲区中的实体数据复制到out(至少BUFFER_SIZE字节)，返回长度，chunked编码有误时返回-1；
+  // chunked编码时解析到最后一个块为止，dechunk时只复制数据本身
+  int TakeBody(char* out, bool dechunk);
+
+  char* Buffer() { return buf_; }
+  int Fd() const { return fd_; }
+  Backend* GetBackend() const { return backend_; }
+  STATE State() const { return state_; }
+  int Status() const { return status_; }
+  int HeadLen() const { return head_len_; }
+  BODY_TYPE BodyType() const { return body_type_; }
+  int64_t Remaining() const { return remaining_; }
+  bool Reused() const { return reused_; }
+  bool RequestSent() const { return sent_ > 0; }
+  bool ResponseStarted() const { return received_ > 0; }
+  int DataLen() const { return data_len_; }
+  int PipeRead() const { return pipe_[0]; }
+  int PipeBytes() const { return pipe_bytes_; }
+  void PipeDrained(int bytes) { pipe_bytes_ -= bytes; }
+
+private:
+  friend class Proxy;
+
+  int ParseHead();
+
+  int fd_ = -1;
+  Backend* backend_ = nullptr;
+  std::atomic<void*> owner_{nullptr};   // 正在使用这个连接的HttpConn，空闲时为NULL
+  std::atomic<bool> stale_{false};      // 空闲时对方关闭了连接(主线程设置)
+  bool reused_ = false;                 // 这个请求使用的是连接池中的连接
+  UpstreamConn* next_idle_ = nullptr;   // 连接池中的下一个空闲连接
+  STATE state_ = DONE;
+  bool head_request_ = false;           // HEAD请求的响应没有实体
+  bool body_follows_ = false;           // 请求头部之后还要转发流式接收的实体
+  char buf_[BUFFER_SIZE];
+  int len_ = 0;                         // 缓冲区中的字节数
+  int sent_ = 0;                        // 请求已经发送的字节数
+  int64_t received_ = 0;                // 收到的响应字节数，大于0之后出错不能再重试
+  int status_ = 0;
+  int head_len_ = 0;
+  BODY_TYPE body_type_ = BODY_NONE;
+  int64_t remaining_ = 0;               // Content-Length时还没有转发的实体字节数
+  bool keep_alive_ = false;             // 响应结束后连接可以复用
+  bool eof_ = false;                    // 上游关闭了连接
+  int data_start_ = 0;                  // 缓冲区中还没有转发的实体数据
+  int data_len_ = 0;
+  ChunkedParser chunked_;
+  int pipe_[2] = {-1, -1};              // splice用的管道，第一次转发实体时创建
+  int pipe_bytes_ = 0;                  // 管道中还没有发送给客户端的字节数
+};
+
+// 反向代理: 把指定路径前缀的请求转发给上游的HTTP/1.1服务器
+// 前缀注册为所有方法的路由，处理函数要求HttpConn转发(RouteResponse::Proxy())；
+// 上游连接和客户连接注册在同一个epoll中，上游连接上的事件交给正在使用它的客户连接处理(CONN_UPSTREAM)，
+// 转发期间客户连接上的I/O都由工作线程完成。每个线程有自己的空闲连接池，取出和放回都不加锁；
+// 选择上游时在健康的服务器中取未完成请求最少的，连续失败MAX_FAILURES次的服务器等健康检查恢复
+class Proxy {
+public:
+  static const int MAX_BACKENDS = 64;
+  static const int MAX_FDS = 65536;
+  static const int MAX_IDLE = 32;           // 每个线程对每个上游服务器最多缓存的空闲连接数
+  static const int MAX_FAILURES = 3;
+
+  // spec为"前缀=地址:端口[,地址:端口...]"，可以多次调用
+  static bool AddUpstream(const char* spec);
+  // 健康检查每interval_ms毫秒请求一次每个上游服务器的path，2xx和3xx表示健康
+  static void SetHealthCheck(const char* path, int interval_ms);
+  static bool Enabled() { return !groups_.empty(); }
+  // 注册路由并启动健康检查线程，必须在工作线程创建之前调用
+  static bool Start();
+  static void Stop();
+
+  // 主线程中调用: fd是否是上游连接，owner返回正在使用它的连接(空闲时为NULL)；
+  // 空闲的连接被对方关闭(hup)时记录下来，下一次取出时丢弃
+  static bool OnEvent(int fd, bool hup, void** owner);
+
+  // 为owner取一个到group中的上游服务器的连接，fresh时不使用连接池，avoid是刚刚失败的服务器(重试时跳过)；
+  // 没有可用的服务器或者连接失败时返回NULL
+  static UpstreamConn* Connect(UpstreamGroup* group, void* owner, int epollfd, bool fresh,
+                               const Backend* avoid);
+  // 请求结束，reuse时放回当前线程的连接池，否则关闭；failed表示上游服务器出错
+  // (conn为NULL时记在backend上，用于连接没有建立起来的情况)
+  static void Finish(UpstreamConn* conn, bool reuse, bool failed, Backend* backend = nullptr);
+  // 同步地转发一个请求(后台刷新缓存时使用)，只接受没有实体或者Content-Length不超过max_body的响应；
+  // head返回去掉逐跳头部的响应头部(不包括结尾的空行)
+  static bool Fetch(UpstreamGroup* group, const char* request, int len, size_t max_body, int* status,
+                    std::string* head, std::string* body);
+  // 在指标中加上每个上游服务器的状态
+  static void RenderMetrics(std::string* out);
+
+private:
+  static std::vector<UpstreamGroup*> groups_;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "rate_limit.h"
+
+#include <time.h>
+
+#include "locker.h"
+
+bool RateLimiter::enabled_ = false;
+
+namespace {
+
+const int BUCKETS = 8192;                 // 每个分片的哈希桶数(2的幂)
+const int GC_STEP = 4;                    // 每次建立连接时检查的表项数
+const int64_t TOKEN = 1000000;            // 令牌以百万分之一为单位计数，避免浮点运算
+
+struct Entry {
+  uint32_t ip;
+  int32_t conns;            // 当前的连接数
+  int64_t tokens;           // 当前的令牌数(TOKEN为一个)
+  int64_t last_us;          // 上一次补充令牌的时间
+  int32_t next;             // 哈希桶中的下一个表项，-1表示结束
+  bool used;
+};
+
+struct Shard {
+  Locker lock;
+  int32_t buckets[BUCKETS];
+  Entry entries[RateLimiter::SHARD_CAPACITY];
+  int32_t free_head;        // 空闲表项组成的链表(通过next链接)
+  int gc_cursor;            // 增量回收检查到的位置
+};
+
+Shard* shards = nullptr;
+int max_conns = 0;
+int64_t refill_per_us = 0;  // 每微秒补充的令牌数(单位同tokens)
+int64_t capacity = 0;       // 令牌桶的容量
+int64_t full_after_us = 0;  // 空的令牌桶补满需要的时间，超过这个时间没有活动的表项可以回收
+
+int64_t NowUs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// IP的低位在同一个网段中变化最多，乘法哈希之后高位选分片，低位选桶
+inline uint32_t Hash(uint32_t ip) {
+  return ip * 2654435761u;
+}
+
+inline Shard& ShardOf(uint32_t hash) {
+  return shards[hash >> 26];   // SHARDS = 64
+}
+
+inline int32_t* BucketOf(Shard& shard, uint32_t hash) {
+  return &shard.buckets[hash & (BUCKETS - 1)];
+}
+
+Entry* Find(Shard& shard, uint32_t ip, uint32_t hash) {
+  for (int32_t i = *BucketOf(shard, hash); i >= 0; i = shard.entries[i].next) {
+    if (shard.entries[i].ip == ip) {
+      return &shard.entries[i];
+    }
+  }
+  return nullptr;
+}
+
+// 没有空闲表项时返回NULL
+Entry* Insert(Shard& shard, uint32_t ip, uint32_t hash, int64_t now) {
+  int32_t index = shard.free_head;
+  if (index < 0) {
+    return nullptr;
+  }
+  Entry& entry = shard.entries[index];
+  shard.free_head = entry.next;
+  int32_t* bucket = BucketOf(shard, hash);
+  entry.ip = ip;
+  entry.conns = 0;
+  entry.tokens = capacity;
+  entry.last_us = now;
+  entry.used = true;
+  entry.next = *bucket;
+  *bucket = index;
+  return &entry;
+}
+
+void Remove(Shard& shard, int32_t index) {
+  Entry& entry = shard.entries[index];
+  int32_t* link = BucketOf(shard, Hash(entry.ip));
+  while (*link != index) {
+    link = &shard.entries[*link].next;
+  }
+  *link = entry.next;
+  entry.used = false;
+  entry.next = shard.free_head;
+  shard.free_head = index;
+}
+
+// 回收分片中从游标开始的几个表项里已经没有状态的IP
+void Collect(Shard& shard, int64_t now) {
+  for (int i = 0; i < GC_STEP; ++i) {
+    int32_t index = shard.gc_cursor;
+    shard.gc_cursor = (shard.gc_cursor + 1) % RateLimiter::SHARD_CAPACITY;
+    Entry& entry = shard.entries[index];
+    if (entry.used && entry.conns == 0 && now - entry.last_us >= full_after_us) {
+      Remove(shard, index);
+    }
+  }
+}
+
+}  // namespace
+
+void RateLimiter::Init(int conns, double rate, double burst) {
+  if (conns <= 0 && rate <= 0) {
+    return;
+  }
+  max_conns = conns > 0 ? conns : 0;
+  if (rate > 0) {
+    if (burst < 1) {
+      burst = rate > 1 ? rate : 1;
+    }
+    refill_per_us = (int64_t)(rate * TOKEN / 1000000);
+    if (refill_per_us < 1) {
+      refill_per_us = 1;
+    }
+    capacity = (int64_t)(burst * TOKEN);
+    full_after_us = capacity / refill_per_us + 1;
+  }
+  shards = new Shard[SHARDS];
+  for (int s = 0; s < SHARDS; ++s) {
+    Shard& shard = shards[s];
+    for (int i = 0; i < BUCKETS; ++i) {
+      shard.buckets[i] = -1;
+    }
+    for (int i = 0; i < SHARD_CAPACITY; ++i) {
+      shard.entries[i].used = false;
+      shard.entries[i].next = i + 1 < SHARD_CAPACITY ? i + 1 : -1;
+    }
+    shard.free_head = 0;
+    shard.gc_cursor = 0;
+  }
+  enabled_ = true;
+}
+
+bool RateLimiter::Connect(uint32_t ip) {
+  uint32_t hash = Hash(ip);
+  Shard& shard = ShardOf(hash);
+  int64_t now = NowUs();
+  shard.lock.Lock();
+  Collect(shard, now);
+  Entry* entry = Find(shard, ip, hash);
+  if (!entry) {
+    entry = Insert(shard, ip, hash, now);
+  }
+  bool ok = true;
+  if (entry) {
+    if (max_conns > 0 && entry->conns >= max_conns) {
+      ok = false;
+    } else {
+      ++entry->conns;
+    }
+  }
+  shard.lock.UnLock();
+  return ok;
+}
+
+void RateLimiter::Disconnect(uint32_t ip) {
+  uint32_t hash = Hash(ip);
+  Shard& shard = ShardOf(hash);
+  shard.lock.Lock();
+  Entry* entry = Find(shard, ip, hash);
+  // 表项用完时建立的连接没有被跟踪
+  if (entry && entry->conns > 0) {
+    --entry->conns;
+  }
+  shard.lock.UnLock();
+}
+
+bool RateLimiter::AllowRequest(uint32_t ip) {
+  if (refill_per_us == 0) {
+    return true;
+  }
+  uint32_t hash = Hash(ip);
+  Shard& shard = ShardOf(hash);
+  int64_t now = NowUs();
+  shard.lock.Lock();
+  Entry* entry = Find(shard, ip, hash);
+  if (!entry) {
+    entry = Insert(shard, ip, hash, now);
+  }
+  bool ok = true;
+  if (entry) {
+    int64_t elapsed = now - entry->last_us;
+    if (elapsed > 0) {
+      entry->tokens += elapsed >= full_after_us ? capacity : elapsed * refill_per_us;
+      if (entry->tokens > capacity) {
+        entry->tokens = capacity;
+      }
+      entry->last_us = now;
+    }
+    if (entry->tokens >= TOKEN) {
+      entry->tokens -= TOKEN;
+    } else {
+      ok = false;
+    }
+  }
+  shard.lock.UnLock();
+  return ok;
+}
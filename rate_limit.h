@@ -0,0 +1,30 @@
+#ifndef RATE_LIMIT_H_
+#define RATE_LIMIT_H_
+
+#include <stdint.h>
+
+// 按客户端IP限制并发连接数和请求速率(令牌桶)，防止一个客户端占满连接和线程池
+// 表按IP的哈希分成SHARDS个分片，每个分片有自己的锁和固定容量的表项，运行中不分配内存；
+// 建立连接时顺便检查几个表项，回收没有连接并且令牌已经补满的表项(与新建的表项等价)
+// 分片的表项用完时不再跟踪新的IP(放行)，避免大量伪造的源地址挤掉正常客户端的状态
+class RateLimiter {
+public:
+  static const int SHARDS = 64;
+  static const int SHARD_CAPACITY = 4096;   // 每个分片最多跟踪的IP数
+
+  // max_conns为每个IP的最大并发连接数，rate为每个IP每秒的请求数，burst为令牌桶的容量，
+  // 为0表示不限制；两者都为0时不启用
+  static void Init(int max_conns, double rate, double burst);
+  static bool Enabled() { return enabled_; }
+  // 建立连接时调用(主线程)，超过连接数上限时返回false，调用者直接关闭连接
+  static bool Connect(uint32_t ip);
+  // 关闭连接时调用，与返回true的Connect()一一对应
+  static void Disconnect(uint32_t ip);
+  // 开始处理一个请求时调用，没有令牌时返回false，调用者返回429
+  static bool AllowRequest(uint32_t ip);
+
+private:
+  static bool enabled_;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "request_body.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void RequestBody::Start(int64_t length, int64_t max, int sink, bool raw) {
+  active_ = true;
+  sink_ = sink;
+  chunked_ = length < 0;
+  raw_ = raw;
+  done_ = length == 0;
+  remaining_ = length < 0 ? 0 : length;
+  max_ = max;
+  received_ = 0;
+  parser_.Reset();
+  pending_ = nullptr;
+  pending_len_ = 0;
+  pipe_bytes_ = 0;
+}
+
+RequestBody::STATUS RequestBody::Pump(int sockfd, char* buf, int base, int size, int* start, int* end) {
+  while (true) {
+    // 先把上一次没有写完的数据写给接收方
+    if (pipe_bytes_ > 0) {
+      ssize_t n = splice(pipe_[0], NULL, sink_, NULL, pipe_bytes_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n <= 0) {
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? BODY_SINK_AGAIN : BODY_SINK_ERROR;
+      }
+      pipe_bytes_ -= n;
+      continue;
+    }
+    if (pending_len_ > 0) {
+      ssize_t n = send(sink_, pending_, pending_len_, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0 && errno == ENOTSOCK) {
+        n = write(sink_, pending_, pending_len_);   // 接收方是文件
+      }
+      if (n <= 0) {
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? BODY_SINK_AGAIN : BODY_SINK_ERROR;
+      }
+      pending_ += n;
+      pending_len_ -= n;
+      continue;
+    }
+    if (done_) {
+      return BODY_DONE;
+    }
+    // 再处理读缓冲区中已经读到的数据
+    if (*start < *end) {
+      const char* data = buf + *start;
+      int len = *end - *start;
+      if (!chunked_) {
+        if (len > remaining_) {
+          len = remaining_;    // 后面是流水线上的下一个请求
+        }
+        pending_ = data;
+        pending_len_ = len;
+        *start += len;
+        remaining_ -= len;
+        received_ += len;
+        done_ = remaining_ == 0;
+        continue;
+      }
+      int consumed = 0;
+      const char* chunk = NULL;
+      int chunk_len = 0;
+      ChunkedParser::RESULT ret = parser_.Parse(data, len, &consumed, &chunk, &chunk_len);
+      if (ret == ChunkedParser::CHUNK_ERROR) {
+        return BODY_BAD;
+      }
+      if (ret == ChunkedParser::CHUNK_DATA) {
+        received_ += chunk_len;
+        if (received_ > max_) {
+          return BODY_TOO_LARGE;
+        }
+      }
+      if (raw_) {
+        pending_ = data;
+        pending_len_ = consumed;
+      } else if (ret == ChunkedParser::CHUNK_DATA) {
+        pending_ = chunk;
+        pending_len_ = chunk_len;
+      }
+      *start += consumed;
+      done_ = ret == ChunkedParser::CHUNK_DONE;
+      continue;
+    }
+    // 读缓冲区已经处理完，从socket读取
+    if (!chunked_) {
+      // Content-Length的实体经管道直接转移给接收方，只转移这个实体的字节
+      if (pipe_[0] < 0 && pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return BODY_SINK_ERROR;
+      }
+      ssize_t n = splice(sockfd, NULL, pipe_[1], NULL, remaining_ < PIPE_SIZE ? remaining_ : PIPE_SIZE,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? BODY_AGAIN : BODY_CLOSED;
+      } else if (n == 0) {
+        return BODY_CLOSED;
+      }
+      pipe_bytes_ += n;
+      remaining_ -= n;
+      received_ += n;
+      done_ = remaining_ == 0;
+      continue;
+    }
+    if (base >= size) {
+      return BODY_BAD;     // 请求头部占满了读缓冲区，没有解码的空间
+    }
+    *start = *end = base;
+    ssize_t n = recv(sockfd, buf + base, size - base, 0);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? BODY_AGAIN : BODY_CLOSED;
+    } else if (n == 0) {
+      return BODY_CLOSED;
+    }
+    *end += n;
+  }
+}
+
+void RequestBody::Finish() {
+  active_ = false;
+  if (pipe_[0] >= 0) {
+    close(pipe_[0]);
+    close(pipe_[1]);
+    pipe_[0] = pipe_[1] = -1;
+  }
+  pipe_bytes_ = 0;
+  pending_len_ = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef REQUEST_BODY_H_
+#define REQUEST_BODY_H_
+
+#include <stdint.h>
+
+#include "chunked.h"
+
+// 流式接收的请求实体: 从客户连接读出，写到接收方(处理函数指定的文件、上游连接)，内存占用与实体的大小无关
+// Content-Length的实体用splice经管道从socket转移到接收方，不经过用户空间；
+// chunked编码的实体读到连接的读缓冲区中(请求头部之后的空间)解码后写出，转发给上游时原样写出，只用来找到结尾；
+// 读缓冲区中和头部一起读到的部分先处理。接收方可以是非阻塞的socket，写不进去时保留进度等它可写
+class RequestBody {
+public:
+  static const int PIPE_SIZE = 65536;    // 一次splice最多转移的字节数(管道的默认容量)
+  // Pump()的结果
+  // BODY_DONE: 实体已经全部写给接收方  BODY_AGAIN: 等待客户连接可读  BODY_SINK_AGAIN: 等待接收方可写
+  // BODY_TOO_LARGE: chunked编码的实体超过了上限  BODY_BAD: chunked编码有误
+  // BODY_CLOSED: 客户端在实体结束之前关闭了连接  BODY_SINK_ERROR: 写接收方出错(磁盘满、上游关闭等)
+  enum STATUS {BODY_DONE, BODY_AGAIN, BODY_SINK_AGAIN, BODY_TOO_LARGE, BODY_BAD, BODY_CLOSED,
+               BODY_SINK_ERROR};
+
+  // length为-1表示chunked编码，max是解码后的实体的上限；raw为true时chunked编码原样写出
+  void Start(int64_t length, int64_t max, int sink, bool raw);
+  // buf是连接的读缓冲区，[*start, *end)是已经读到还没有处理的数据，读取新数据时只使用[base, size)，
+  // base之前是请求头部；实体结束之后*start指向流水线上的下一个请求
+  STATUS Pump(int sockfd, char* buf, int base, int size, int* start, int* end);
+  // 结束(完成或者放弃)，关闭管道；接收方由调用者关闭
+  void Finish();
+  bool Active() const { return active_; }
+  int64_t Received() const { return received_; }   // 从客户端收到的实体字节数(chunked时为解码后的)
+
+private:
+  bool active_ = false;
+  int sink_ = -1;
+  bool chunked_ = false;
+  bool raw_ = false;
+  bool done_ = false;               // 实体已经读完，还要把剩下的数据写出
+  int64_t remaining_ = 0;           // Content-Length时还没有读的字节数
+  int64_t max_ = 0;
+  int64_t received_ = 0;
+  ChunkedParser parser_;
+  const char* pending_ = nullptr;   // 读缓冲区中还没有写给接收方的数据
+  int pending_len_ = 0;
+  int pipe_[2] = {-1, -1};          // splice用的管道，第一次从socket转移时创建
+  int pipe_bytes_ = 0;              // 管道中还没有写给接收方的字节数
+};
+
+#endif
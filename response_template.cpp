@@ -0,0 +1,196 @@
+#include "response_template.h"
+
+#include <string.h>
+#include <string>
+
+namespace {
+
+// 响应状态码，标题和错误页面的内容
+struct StatusInfo {
+  int status;
+  const char* title;
+  const char* form;    // 错误页面，成功的状态为NULL
+};
+
+const StatusInfo status_infos[] = {
+  {200, "OK", NULL},
+  {201, "Created", NULL},
+  {204, "No Content", NULL},
+  {206, "Partial Content", NULL},
+  {301, "Moved Permanently", NULL},
+  {302, "Found", NULL},
+  {304, "Not Modified", NULL},
+  {400, "Bad Request", "Your request has bad syntax or is inherently impossible to satisfy.\n"},
+  {403, "Forbidden", "You do not have permission to get file from this server.\n"},
+  {404, "Not Found", "The requested file was not found on thi server.\n"},
+  {405, "Method Not Allowed", "The requested method is not allowed for this resource.\n"},
+  {413, "Payload Too Large", "The request body is larger than the server is willing to accept.\n"},
+  {416, "Range Not Satisfiable", "The requested range is not satisfiable.\n"},
+  {429, "Too Many Requests", "You have sent too many requests, please retry later.\n"},
+  {500, "Internal Error", "There was an unusual problem serving the requested file.\n"},
+  {502, "Bad Gateway", "The upstream server is unavailable or sent an invalid response.\n"},
+  {503, "Service Unavailable", "The server is temporarily unable to handle the request.\n"},
+};
+
+const int MAX_STATUS = 600;
+std::string status_lines[MAX_STATUS];   // 按状态码索引
+std::string error_tails[MAX_STATUS];
+const char connection_keep_alive[] = "Connection: keep-alive\r\n";
+const char connection_close[] = "Connection: close\r\n";
+const char content_type[] = "Content-Type:text/html\r\n";
+
+// 00~99的两位数字表，每次可以转换两位
+const char digits[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+const char* week_days[] = {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};  // 1970-01-01是星期四
+const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// 每个线程缓存的Date头部
+const int DATE_HEADER_LEN = 6 + ResponseTemplate::HTTP_DATE_LEN + 2;  // "Date: " + 日期 + "\r\n"
+thread_local time_t date_second = -1;
+thread_local char date_header[DATE_HEADER_LEN];
+
+inline void Write2(char* buf, int value) {
+  memcpy(buf, digits + value * 2, 2);
+}
+
+}  // namespace
+
+void ResponseTemplate::Init() {
+  char num[24];
+  for (const StatusInfo& info : status_infos) {
+    std::string& line = status_lines[info.status];
+    line = "HTTP/1.1 ";
+    line.append(num, FormatUint(num, info.status));
+    line += ' ';
+    line += info.title;
+    line += "\r\n";
+    if (info.form) {
+      std::string& tail = error_tails[info.status];
+      tail = info.status == 429 ? "Retry-After: 1\r\n" : "";   // 令牌每秒都会补充
+      if (info.status == 405) {
+        tail = "Allow: GET\r\n";    // 没有路由的路径只能GET静态文件
+      }
+      tail += content_type;
+      tail += "Content-Length: ";
+      tail.append(num, FormatUint(num, strlen(info.form)));
+      tail += "\r\n\r\n";
+      tail += info.form;
+    }
+  }
+}
+
+Piece ResponseTemplate::StatusLine(int status) {
+  if (status < 100 || status >= MAX_STATUS) {
+    return Piece{NULL, 0};    // 处理函数设置的状态码可能超出范围
+  }
+  const std::string& line = status_lines[status];
+  return Piece{line.data(), (int)line.size()};
+}
+
+Piece ResponseTemplate::ErrorTail(int status) {
+  if (status < 100 || status >= MAX_STATUS) {
+    return Piece{NULL, 0};
+  }
+  const std::string& tail = error_tails[status];
+  return Piece{tail.data(), (int)tail.size()};
+}
+
+Piece ResponseTemplate::Connection(bool linger) {
+  if (linger) {
+    return Piece{connection_keep_alive, sizeof(connection_keep_alive) - 1};
+  }
+  return Piece{connection_close, sizeof(connection_close) - 1};
+}
+
+Piece ResponseTemplate::ContentType() {
+  return Piece{content_type, sizeof(content_type) - 1};
+}
+
+Piece ResponseTemplate::Date() {
+  time_t now = time(NULL);
+  if (now != date_second) {
+    // 每秒只格式化一次
+    date_second = now;
+    memcpy(date_header, "Date: ", 6);
+    FormatHttpDate(date_header + 6, now);
+    memcpy(date_header + 6 + HTTP_DATE_LEN, "\r\n", 2);
+  }
+  return Piece{date_header, DATE_HEADER_LEN};
+}
+
+int ResponseTemplate::FormatUint(char* buf, uint64_t value) {
+  char temp[24];
+  char* p = temp + sizeof(temp);
+  // 从低位开始每次转换两位数字
+  while (value >= 100) {
+    p -= 2;
+    Write2(p, value % 100);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    Write2(p, value);
+  } else {
+    *--p = '0' + value;
+  }
+  int len = temp + sizeof(temp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
+
+int ResponseTemplate::FormatHex(char* buf, uint64_t value) {
+  char temp[16];
+  char* p = temp + sizeof(temp);
+  do {
+    *--p = "0123456789abcdef"[value & 0xf];
+    value >>= 4;
+  } while (value);
+  int len = temp + sizeof(temp) - p;
+  memcpy(buf, p, len);
+  return len;
+}
+
+int ResponseTemplate::FormatHttpDate(char* buf, time_t t) {
+  // 由天数计算公历日期(Howard Hinnant的civil_from_days算法)，避免调用gmtime_r和strftime
+  int64_t days = t / 86400;
+  int secs = t % 86400;
+  if (secs < 0) {
+    secs += 86400;
+    --days;
+  }
+  int week_day = ((days % 7) + 7) % 7;
+  int64_t z = days + 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int doe = z - era * 146097;
+  int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int mp = (5 * doy + 2) / 153;
+  int day = doy - (153 * mp + 2) / 5 + 1;
+  int month = mp < 10 ? mp + 3 : mp - 9;
+  int year = yoe + era * 400 + (month <= 2);
+
+  // "Sun, 06 Nov 1994 08:49:37 GMT"
+  memcpy(buf, week_days[week_day], 3);
+  memcpy(buf + 3, ", ", 2);
+  Write2(buf + 5, day);
+  buf[7] = ' ';
+  memcpy(buf + 8, months[month - 1], 3);
+  buf[11] = ' ';
+  Write2(buf + 12, year / 100);
+  Write2(buf + 14, year % 100);
+  buf[16] = ' ';
+  Write2(buf + 17, secs / 3600);
+  buf[19] = ':';
+  Write2(buf + 20, secs / 60 % 60);
+  buf[22] = ':';
+  Write2(buf + 23, secs % 60);
+  memcpy(buf + 25, " GMT", 4);
+  return HTTP_DATE_LEN;
+}
@@ -0,0 +1,35 @@
+#ifndef RESPONSE_TEMPLATE_H_
+#define RESPONSE_TEMPLATE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// 一段预先生成好的响应报文片段
+struct Piece {
+  const char* data;
+  int len;
+};
+
+// HTTP响应报文中不变的部分(状态行、错误页面、Connection和Content-Type头部)
+// 在服务器启动时生成一次，组装响应报文时只需要memcpy
+class ResponseTemplate {
+public:
+  static const int HTTP_DATE_LEN = 29;  // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+  static void Init();                   // 生成所有模板，必须在工作线程创建之前调用
+  static Piece StatusLine(int status);  // "HTTP/1.1 200 OK\r\n"，没有这个状态码时为空
+  // 错误页面的剩余部分: Content-Type, Content-Length, 空行和响应实体
+  static Piece ErrorTail(int status);
+  static Piece Connection(bool linger); // "Connection: keep-alive\r\n"或"Connection: close\r\n"
+  static Piece ContentType();           // "Content-Type:text/html\r\n"
+  // "Date: ...\r\n"，每个线程缓存一份，每秒最多刷新一次
+  static Piece Date();
+
+  // 快速的整数格式化，返回写入的字节数(不写字符串结束符)
+  static int FormatUint(char* buf, uint64_t value);
+  static int FormatHex(char* buf, uint64_t value);
+  // 格式化为RFC 7231的HTTP日期，固定写入HTTP_DATE_LEN个字节
+  static int FormatHttpDate(char* buf, time_t t);
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include "router.h"
+
+#include <stdio.h>
+#include <vector>
+
+// 前缀树的节点，静态节点的prefix是压缩后的一段路径，参数节点的prefix是参数名
+struct RouteNode {
+  std::string prefix;
+  std::string indices;             // 静态子节点的第一个字符，与children一一对应
+  std::vector<RouteNode*> children;
+  RouteNode* param = nullptr;      // :name子节点
+  RouteNode* catch_all = nullptr;  // *name子节点
+  Route routes[Router::METHODS] = {};
+};
+
+RouteNode* Router::root_ = nullptr;
+
+namespace {
+
+// 把path(去掉已经匹配的部分)插入到node下面，重复注册或者参数名冲突时返回false
+bool Insert(RouteNode* node, const char* path, int method, const Route& route) {
+  while (true) {
+    if (*path == '\0') {
+      if (node->routes[method].handler) {
+        return false;
+      }
+      node->routes[method] = route;
+      return true;
+    }
+    if (*path == ':' || *path == '*') {
+      bool catch_all = *path == '*';
+      const char* name = path + 1;
+      size_t len = catch_all ? strlen(name) : strcspn(name, "/");
+      if (len == 0 || strcspn(name, ":*/") < len) {
+        return false;   // 参数名为空，或者*后面还有路径段
+      }
+      RouteNode*& child = catch_all ? node->catch_all : node->param;
+      if (!child) {
+        child = new RouteNode;
+        child->prefix.assign(name, len);
+      } else if (child->prefix.size() != len || child->prefix.compare(0, len, name, len) != 0) {
+        return false;   // 同一个位置上的参数名不同
+      }
+      node = child;
+      path = name + len;
+      continue;
+    }
+    // 静态的一段到下一个参数为止，参数必须占据整个路径段
+    size_t len = strcspn(path, ":*");
+    if (path[len] != '\0' && path[len - 1] != '/') {
+      return false;
+    }
+    size_t i = node->indices.find(path[0]);
+    if (i == std::string::npos) {
+      RouteNode* child = new RouteNode;
+      child->prefix.assign(path, len);
+      node->indices += path[0];
+      node->children.push_back(child);
+      node = child;
+      path += len;
+      continue;
+    }
+    RouteNode* child = node->children[i];
+    size_t common = 0;
+    while (common < len && common < child->prefix.size() && child->prefix[common] == path[common]) {
+      ++common;
+    }
+    if (common < child->prefix.size()) {
+      // 公共前缀拆成一个新的中间节点，原来的子节点挂在它下面
+      RouteNode* mid = new RouteNode;
+      mid->prefix = child->prefix.substr(0, common);
+      child->prefix.erase(0, common);
+      mid->indices += child->prefix[0];
+      mid->children.push_back(child);
+      node->children[i] = mid;
+      child = mid;
+    }
+    node = child;
+    path += common;
+  }
+}
+
+const Route* Found(const RouteNode* node, int method) {
+  return node->routes[method].handler ? &node->routes[method] : nullptr;
+}
+
+// 静态的子节点沿着唯一的分支向下匹配，只在有参数子节点的位置上可能回溯
+const Route* MatchNode(const RouteNode* node, const char* path, const char* end, int method,
+                       RouteRequest* request) {
+  if (path == end) {
+    const Route* route = Found(node, method);
+    if (route) {
+      return route;
+    }
+  } else {
+    const char* index = (const char*)memchr(node->indices.data(), *path, node->indices.size());
+    if (index) {
+      const RouteNode* child = node->children[index - node->indices.data()];
+      size_t len = child->prefix.size();
+      if ((size_t)(end - path) >= len && memcmp(path, child->prefix.data(), len) == 0) {
+        const Route* route = MatchNode(child, path + len, end, method, request);
+        if (route) {
+          return route;
+        }
+      }
+    }
+  }
+  if (node->param && path < end && request->param_count < RouteRequest::MAX_PARAMS) {
+    const char* segment_end = (const char*)memchr(path, '/', end - path);
+    if (!segment_end) {
+      segment_end = end;
+    }
+    if (segment_end > path) {
+      RouteParam& param = request->params[request->param_count++];
+      param.name = node->param->prefix.c_str();
+      param.value = path;
+      param.len = segment_end - path;
+      const Route* route = MatchNode(node->param, segment_end, end, method, request);
+      if (route) {
+        return route;
+      }
+      --request->param_count;
+    }
+  }
+  if (node->catch_all && request->param_count < RouteRequest::MAX_PARAMS) {
+    const Route* route = Found(node->catch_all, method);
+    if (route) {
+      RouteParam& param = request->params[request->param_count++];
+      param.name = node->catch_all->prefix.c_str();
+      param.value = path;
+      param.len = end - path;
+      return route;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+const RouteParam* RouteRequest::Param(const char* name) const {
+  for (int i = 0; i < param_count; ++i) {
+    if (strcmp(params[i].name, name) == 0) {
+      return &params[i];
+    }
+  }
+  return nullptr;
+}
+
+bool RouteResponse::AddHeader(const char* name, const char* value) {
+  int len = snprintf(headers_ + headers_len_, HEADERS_SIZE - headers_len_, "%s: %s\r\n", name, value);
+  if (len < 0 || len >= HEADERS_SIZE - headers_len_) {
+    headers_[headers_len_] = '\0';
+    return false;
+  }
+  headers_len_ += len;
+  return true;
+}
+
+bool RouteResponse::Redirect(int status, const char* location) {
+  SetStatus(status);
+  return AddHeader("Location", location);
+}
+
+bool Router::Add(int method, const char* path, RouteHandler handler, void* arg,
+                 const CachePolicy* cache) {
+  if (method < 0 || method >= METHODS || !handler || !path || path[0] != '/') {
+    return false;
+  }
+  int params = 0;
+  for (const char* p = path; *p; ++p) {
+    if (*p == ':' || *p == '*') {
+      ++params;
+    }
+  }
+  if (params > RouteRequest::MAX_PARAMS) {
+    return false;
+  }
+  if (!root_) {
+    root_ = new RouteNode;
+  }
+  return Insert(root_, path, method, Route{handler, arg, cache});
+}
+
+const Route* Router::Match(int method, const char* url, RouteRequest* request) {
+  if (!root_ || method < 0 || method >= METHODS) {
+    return nullptr;
+  }
+  const char* end = url + strcspn(url, "?");
+  request->method = method;
+  request->url = url;
+  request->query = *end == '?' ? end + 1 : nullptr;
+  request->param_count = 0;
+  request->body_state = RouteRequest::BODY_NONE;
+  request->body = nullptr;
+  request->body_len = 0;
+  request->body_fd = -1;
+  request->body_arg = nullptr;
+  return MatchNode(root_, url, end, method, request);
+}
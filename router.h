@@ -0,0 +1,116 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// 路径中捕获的参数，值指向请求的URL(没有字符串结束符)
+struct RouteParam {
+  const char* name;
+  const char* value;
+  int len;
+};
+
+// 处理函数看到的请求，生成响应之前一直有效
+// 请求实体: 和头部一起读入读缓冲区的实体在body中(BODY_BUFFERED)；更大的或者chunked编码的实体不读入内存
+// (BODY_STREAMING)，处理函数调用RouteResponse::ReceiveBody()指定写入的文件，实体写完之后处理函数
+// 再被调用一次(BODY_RECEIVED，body_len是实体的长度)，由它关闭文件并生成响应；连接出错、实体超过上限时
+// 以BODY_FAILED调用，只用于清理，响应被忽略。处理函数不接收实体时回复之后关闭连接
+struct RouteRequest {
+  static const int MAX_PARAMS = 8;
+  enum BODY_STATE {BODY_NONE, BODY_BUFFERED, BODY_STREAMING, BODY_RECEIVED, BODY_FAILED};
+  int method;                      // HttpConn::METHOD
+  const char* url;                 // 请求的目标(包括查询串)
+  const char* query;               // '?'之后的部分，没有查询串时为NULL
+  int param_count;
+  RouteParam params[MAX_PARAMS];
+  BODY_STATE body_state;
+  const char* body;                // BODY_BUFFERED时的实体(没有字符串结束符)
+  int64_t body_len;
+  int body_fd;                     // BODY_RECEIVED和BODY_FAILED时为ReceiveBody()指定的文件和参数
+  void* body_arg;
+  // 按名字查找参数，找不到时返回NULL
+  const RouteParam* Param(const char* name) const;
+};
+
+struct UpstreamGroup;
+struct CachePolicy;
+
+// 处理函数生成的响应，状态行、Date、Content-Length和Connection头部由HttpConn在处理函数返回后加上
+// 响应实体写在工作线程的缓冲区中，生成后由HttpConn拷贝到连接的arena中直到发送完毕
+class RouteResponse {
+public:
+  static const int HEADERS_SIZE = 512;
+
+  explicit RouteResponse(std::string* body)
+      : status_(200), content_type_("text/plain"), headers_len_(0), body_(body), upstream_(nullptr),
+        body_fd_(-1), body_arg_(nullptr) {}
+  // 状态码必须在ResponseTemplate中有对应的状态行(status_infos中列出的)，否则回复500；
+  // 204和304的响应不带实体，也不带Content-Length
+  void SetStatus(int status) { status_ = status; }
+  void SetContentType(const char* type) { content_type_ = type; }   // 必须是静态的字符串
+  bool AddHeader(const char* name, const char* value);  // 超过HEADERS_SIZE时返回false
+  bool Redirect(int status, const char* location);      // 301/302，带上Location头部
+  void Append(const char* data, size_t len) { body_->append(data, len); }
+  void Append(const char* str) { body_->append(str); }
+  std::string* Body() { return body_; }
+  // 不在这里生成响应，由HttpConn把请求转发给上游服务器(见Proxy)
+  void Proxy(UpstreamGroup* group) { upstream_ = group; }
+  // 把请求实体写入fd(阻塞的文件)，实体写完之后再调用处理函数生成响应，arg原样传回
+  void ReceiveBody(int fd, void* arg = nullptr) { body_fd_ = fd; body_arg_ = arg; }
+
+  int Status() const { return status_; }
+  const char* ContentType() const { return content_type_; }
+  const char* Headers() const { return headers_; }
+  int HeadersLen() const { return headers_len_; }
+  UpstreamGroup* Upstream() const { return upstream_; }
+  int BodyFd() const { return body_fd_; }
+  void* BodyArg() const { return body_arg_; }
+
+private:
+  int status_;
+  const char* content_type_;
+  int headers_len_;
+  char headers_[HEADERS_SIZE];      // 处理函数附加的头部，每个以\r\n结尾
+  std::string* body_;
+  UpstreamGroup* upstream_;
+  int body_fd_;
+  void* body_arg_;
+};
+
+struct RouteNode;
+
+// 处理函数，在工作线程中执行，返回false时回复500；arg是注册路由时传入的参数
+typedef bool (*RouteHandler)(const RouteRequest& request, RouteResponse* response, void* arg);
+
+struct Route {
+  RouteHandler handler;
+  void* arg;
+  const CachePolicy* cache;        // 响应的缓存策略(见MicroCache)，NULL表示不缓存
+};
+
+// 按方法和路径把请求分发给注册的处理函数，没有匹配的路由时DoRequest()再按静态文件处理
+// 路径保存在压缩的前缀树(radix tree)中，匹配的时间与路径的长度成正比:
+//   /status          静态的路径
+//   /users/:id       :name匹配一个非空的路径段(到下一个'/'为止)
+//   /files/*path     *name匹配剩余的整个路径，只能在最后
+// 同一个节点上静态的子节点优先于参数，参数优先于*；查询串不参与匹配
+// 所有路由都在启动时(工作线程创建之前)注册，之后树是只读的，匹配时不加锁也不分配内存
+class Router {
+public:
+  static const int METHODS = 9;    // HttpConn::METHOD的个数
+
+  // 注册路由，路径的语法错误、参数过多或者与已有的路由冲突时返回false；cache不为NULL时缓存GET请求的响应
+  static bool Add(int method, const char* path, RouteHandler handler, void* arg,
+                  const CachePolicy* cache = nullptr);
+  static bool Empty() { return root_ == nullptr; }
+  // 匹配请求，成功时填写request中的参数并返回路由，否则返回NULL
+  static const Route* Match(int method, const char* url, RouteRequest* request);
+
+private:
+  static RouteNode* root_;
+};
+
+#endif
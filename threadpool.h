@@ -2,9 +2,12 @@
 #define THREAD_POOL_H_
 
 #include <pthread.h>
-#include <list>
+#include <vector>
 #include <exception>
 #include "locker.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
 
 template <class T>
 class ThreadPool {
@@ -19,7 +22,15 @@ private:
   int thread_numbers_;        // 线程的数量
   pthread_t* threads_;        // 线程池中的线程数组
   int max_requests_;          // 请求队列的容量
-  std::list<T*> workqueue_;   // 请求队列
+  // 请求队列中的任务，记录入队时间以统计排队等待的时间
+  struct Task {
+    T* request;
+    int64_t enqueue_us;
+  };
+  // 请求队列，容量为max_requests_的环形队列，创建时一次分配，入队出队不再分配内存
+  std::vector<Task> workqueue_;
+  int queue_head_;            // 队头的位置
+  int queue_size_;            // 队列中的任务数
   Locker queuelock_;          // 请求队列锁
   Sem queuestat_;             // 信号量用来判断是否请求队列中有任务需要处理
   bool is_stop_;              // 是否结束线程
@@ -27,15 +38,16 @@ private:
 
 template <class T>
 ThreadPool<T>::ThreadPool(int thread_number, int max_requests) : 
-  thread_numbers_(thread_number), max_requests_(max_requests), is_stop_(false), 
-  threads_(NULL) {
+  thread_numbers_(thread_number), threads_(NULL), max_requests_(max_requests), 
+  queue_head_(0), queue_size_(0), is_stop_(false) {
   if (thread_number <= 0 || max_requests <= 0) {
     throw std::exception();
   }
+  workqueue_.resize(max_requests);
   // 初始化线程池中的线程数组
   threads_ = new pthread_t[thread_number];
   for (int i = 0; i < thread_number; ++i) {
-    printf("在线程池中创建第%d个线程\n", i);
+    LOG_INFO("在线程池中创建第%d个线程", i);
     if (pthread_create(threads_+i, NULL, Worker, this) != 0) {  // 创建对应线程池中的线程
       delete[] threads_;
       throw std::exception();
@@ -59,10 +71,12 @@ bool ThreadPool<T>::Append(T* requests) {
     return false;
   }
   queuelock_.Lock();
-  if (workqueue_.size() >= max_requests_) {
+  if (queue_size_ >= max_requests_) {
+    queuelock_.UnLock();
     return false;
   }
-  workqueue_.push_back(requests);
+  workqueue_[(queue_head_ + queue_size_++) % max_requests_] = Task{requests, Metrics::NowUs()};
+  PROBE_QUEUE_ENQUEUE(requests);
   queuelock_.UnLock();
   queuestat_.Post();                      // 唤醒等待的工作线程处理任务
   return true;
@@ -80,14 +94,19 @@ void ThreadPool<T>::Run() {
   while (!is_stop_) {
     queuestat_.Wait();                    // 工作线程休眠等待有任务唤醒
     queuelock_.Lock();
-    if (workqueue_.empty()) {
+    if (queue_size_ == 0) {
       queuelock_.UnLock();
       continue;
     }
     // 在当前场景下request就是HTTP连接的一个指针
-    T* request = workqueue_.front();      // 从工作队列中取任务(函数)
-    workqueue_.pop_front();               
+    Task task = workqueue_[queue_head_];  // 从工作队列中取任务(函数)
+    queue_head_ = (queue_head_ + 1) % max_requests_;
+    --queue_size_;
     queuelock_.UnLock();
+    T* request = task.request;
+    int64_t wait_us = Metrics::NowUs() - task.enqueue_us;
+    Metrics::Local()->queue_wait_us.Record(wait_us > 0 ? wait_us : 0);
+    PROBE_QUEUE_DEQUEUE(request, wait_us);
     request->Process();                   // 工作线程处理任务
   }
 }
@@ -1,34 +1,47 @@
 #include "timer.h"
+#include "log.h"
+#include "probes.h"
 
 void SortTimerList::AddTimer(Timer* timer) {
   // 该定时器未初始化
   if (!timer) {
     return;
   }
+  lock_.Lock();
+  timer->linked_ = true;
+  timer->prev_ = nullptr;
+  timer->next_ = nullptr;
   // 若该定时器链表中没有定时器
   if (!head_) {
     head_ = tail_ = timer;
-    return;
-  }
-  // 直接插入头部的
-  if (timer->expire_ < head_->expire_) {
+  } else if (timer->expire_ < head_->expire_) {
+    // 直接插入头部的
     timer->next_ = head_;
     head_->prev_ = timer;
     // 更新定时器链表的头节点
     head_ = timer;
-    return;
+  } else {
+    // 调用重载函数插入合适的位置
+    AddTimer(timer, head_);
   }
-  // 调用重载函数插入合适的位置
-  AddTimer(timer, head_);
+  lock_.UnLock();
 }
 
-void SortTimerList::AdjustTimer(Timer* timer) {
+void SortTimerList::AdjustTimer(Timer* timer, time_t expire) {
   if (!timer) {
     return;
   }
+  lock_.Lock();
+  // 已经到期的定时器正在等待执行回调，不再调整
+  if (!timer->linked_) {
+    lock_.UnLock();
+    return;
+  }
+  timer->expire_ = expire;
   Timer* node = timer->next_;
   // 若被调整的定时器已经在尾部(到期绝对时间最长)或者它在合适的位置上则不需调整
   if (!node || timer->expire_ < node->expire_) {
+    lock_.UnLock();
     return;
   }
   if (timer == head_) {
@@ -45,15 +58,24 @@ void SortTimerList::AdjustTimer(Timer* timer) {
     timer->next_->prev_ = timer->prev_;
     AddTimer(timer, timer->next_);
   }
+  lock_.UnLock();
 }
 
 void SortTimerList::DelTimer(Timer* timer) {
   if (!timer) {
     return;
   }
+  lock_.Lock();
+  if (timer->linked_) {
+    Unlink(timer);    // 已经到期的定时器在Tick()中取下了
+  }
+  lock_.UnLock();
+}
+
+void SortTimerList::Unlink(Timer* timer) {
+  timer->linked_ = false;
   // 下面这个条件成立表示链表中只有一个定时器，即目标定时器
   if (timer == head_ && timer == tail_) {
-    delete timer;
     head_ = nullptr;
     tail_ = nullptr;
     return;
@@ -63,47 +85,68 @@ void SortTimerList::DelTimer(Timer* timer) {
   if (timer == head_) {
     head_ = head_->next_;
     head_->prev_ = nullptr;
-    delete timer;
     return;
   }
   // 该定时器是尾节点
   if (timer == tail_) {
     tail_ = tail_->prev_;
     tail_->next_ = nullptr;
-    delete timer;
     return;
   }
   // common case位于定时器链表的中间
   timer->prev_->next_ = timer->next_;
   timer->next_->prev_ = timer->prev_;
-  delete timer;
 }
 
 void SortTimerList::Tick() {
+  lock_.Lock();
   if (!head_) {
+    lock_.UnLock();
     return;
   }
-  printf("Time tick!\n");
+  LOG_DEBUG("Time tick!");
   // 绝对时间
   time_t cur_abtime = time(NULL);  // 获取当前的系统时间
-  Timer* cur = head_;
   // 从头节点开始一次处理每个定时器，直到遇到一个尚未到期的定时器
-  while (cur) {
-    if (cur_abtime < cur->expire_) {
-      // 直到链表中不存在到期的定时器，跳出循环
-      break;
-    }
-    // 直到找到第一个超时的任务
-    // 超时调用回调函数
-    cur->cb_func_(cur->sockfd_);
-    // 执行完定时器中的任务后，就将它从定时器链表中删除(因为超时了)
-    head_ = cur->next_;
-    if (head_) {
-      head_->prev_ = nullptr;
-    }
-    delete cur;
-    cur = head_;
+  // 到期的定时器先从链表中取下，解锁之后再执行回调(回调中会关闭连接)
+  Timer* expired = head_;
+  Timer* cur = head_;
+  while (cur && cur_abtime >= cur->expire_) {
+    cur->linked_ = false;
+    cur = cur->next_;
+  }
+  if (cur == head_) {
+    // 直到链表中不存在到期的定时器
+    lock_.UnLock();
+    return;
+  }
+  if (cur) {
+    cur->prev_->next_ = nullptr;
+    cur->prev_ = nullptr;
+  } else {
+    tail_ = nullptr;
+  }
+  head_ = cur;
+  lock_.UnLock();
+
+  while (expired) {
+    // 超时调用回调函数，回调中会关闭连接，先取出下一个定时器
+    Timer* next = expired->next_;
+    expired->prev_ = expired->next_ = nullptr;
+    PROBE_TIMER_EXPIRE(expired->user_data_);
+    expired->cb_func_(expired->user_data_);
+    expired = next;
+  }
+}
+
+int SortTimerList::Oldest(void** out, int max) {
+  lock_.Lock();
+  int count = 0;
+  for (Timer* cur = head_; cur && count < max; cur = cur->next_) {
+    out[count++] = cur->user_data_;
   }
+  lock_.UnLock();
+  return count;
 }
 
 // 第二个参数为遍历起点的timer
@@ -7,6 +7,8 @@
 #include <time.h>
 #include <stdio.h>
 
+#include "locker.h"
+
 // class Timer;
 
 // struct ClientData {
@@ -15,43 +17,44 @@
 //   Timer *timer_;    // 定时器
 // };
 
-// 定时器
+// 定时器，嵌入在所属的对象中(每个连接槽位一个，见HttpConn::timer_)，和所属对象的生命周期相同，
+// 链表只负责链接和取下，不分配也不释放定时器，建立和关闭连接时没有堆分配；
+// 到期的定时器在回调之前就已经取下，所属对象在回调之后仍可安全地调整或删除它(都不会生效)
 class Timer {
 public:
-  Timer() : prev_(nullptr), next_(nullptr) {}
+  Timer() : user_data_(nullptr), linked_(false), prev_(nullptr), next_(nullptr) {}
   ~Timer() {}
-  void (*cb_func_)(int);  // 任务回调函数
+  void (*cb_func_)(void*);  // 任务回调函数，参数为user_data_
   time_t expire_;          // 超时时间
-  int sockfd_;          // 客户连接的fd
-  // ClientData* user_data_;
+  void* user_data_;        // 定时器所属的客户连接
+  bool linked_;            // 是否还在定时器链表中(到期后在执行回调之前就已经从链表中取下)
   // 双向链表
   Timer* prev_;        // 上一个指针
   Timer* next_;        // 下一个指针
 };
 
 // 定时器升序链表(按超时绝对时间进行排序)
+// 工作线程也会调整和删除定时器，因此链表的操作都要加锁
 class SortTimerList {
 public:
   SortTimerList() : head_(nullptr), tail_(nullptr) {}
-  ~SortTimerList() {
-    // 释放掉定时器升序链表的对象
-    Timer* cur = head_;
-    while (cur) {
-      head_ = cur->next_;
-      delete cur;
-      cur = head_;
-    }
-  }
-
-  void AddTimer(Timer* timer);    // 将定时器加入定时器链表中
-  void AdjustTimer(Timer* timer); // 调整定时器在定时器链表中的位置
-  void DelTimer(Timer* timer);    // 从定时器链表中删除定时器
+  ~SortTimerList() {}
+
+  void AddTimer(Timer* timer);    // 将定时器加入定时器链表中(定时器不能已经在链表中)
+  // 更新定时器的超时时间，并调整定时器在定时器链表中的位置
+  void AdjustTimer(Timer* timer, time_t expire);
+  void DelTimer(Timer* timer);    // 将定时器从链表中取下，已经到期的定时器不受影响
   // 处理定时器链表上到期的任务
   void Tick();                    // SIGALARM信号每次触发就在信号处理函数中执行一次Tick()函数
+  // 按超时时间从早到晚取出最多max个定时器的user_data_(不取下)；连接有活动时会延后超时时间，
+  // 所以这也是最久没有活动的连接(LRU)的顺序，返回取出的个数
+  int Oldest(void** out, int max);
 private:
   void AddTimer(Timer* timer, Timer* start);
+  void Unlink(Timer* timer);      // 将定时器从链表中取下
   Timer* head_;
   Timer* tail_;
+  Locker lock_;
 };
 
-#endif
\ No newline at end of file
+#endif
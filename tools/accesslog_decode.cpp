@@ -0,0 +1,151 @@
+// 把二进制访问日志的段文件转换成文本或CSV
+// 用法: accesslog-decode [-c] access_<pid>_<tid>_<seq>.bin ...
+//   -c  输出CSV(带表头)，默认输出一行一条的文本
+// URL表从段文件所在目录下的access_<pid>_<tid>.urls读取
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include "../access_log.h"
+
+namespace {
+
+const char* method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+bool LoadUrls(const std::string& path, std::vector<std::string>* urls) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+  uint32_t entry[2];  // id, len
+  char url[AccessLog::MAX_URL_LEN];
+  while (fread(entry, sizeof(entry), 1, fp) == 1) {
+    if (entry[1] > sizeof(url) || fread(url, 1, entry[1], fp) != entry[1]) {
+      break;
+    }
+    if (urls->size() <= entry[0]) {
+      urls->resize(entry[0] + 1);
+    }
+    (*urls)[entry[0]].assign(url, entry[1]);
+  }
+  fclose(fp);
+  return true;
+}
+
+// CSV中的URL用双引号括起来，内部的双引号写两次
+std::string CsvQuote(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"') {
+      out += '"';
+    }
+    out += c;
+  }
+  out += '"';
+  return out;
+}
+
+bool Decode(const char* path, bool csv) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(AccessLogHeader)) {
+    fprintf(stderr, "%s: 不是访问日志段文件\n", path);
+    close(fd);
+    return false;
+  }
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  const AccessLogHeader* header = (const AccessLogHeader*)addr;
+  if (memcmp(header->magic, ACCESS_LOG_MAGIC, sizeof(header->magic)) != 0 ||
+      header->record_size != sizeof(AccessRecord)) {
+    fprintf(stderr, "%s: 不是访问日志段文件\n", path);
+    munmap(addr, st.st_size);
+    return false;
+  }
+  // 服务器可能还在写这个段，只读取已经完整写入的记录
+  uint64_t count = header->count;
+  uint64_t max_count = (st.st_size - sizeof(AccessLogHeader)) / sizeof(AccessRecord);
+  if (count > max_count) {
+    count = max_count;
+  }
+
+  std::string dir = path;
+  size_t slash = dir.rfind('/');
+  dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+  char urls_path[64];
+  snprintf(urls_path, sizeof(urls_path), "/access_%d_%d.urls", header->pid, header->tid);
+  // 该线程没有处理过URL有效的请求时没有URL表，URL都输出为"-"
+  std::vector<std::string> urls;
+  LoadUrls(dir + urls_path, &urls);
+
+  const AccessRecord* records = (const AccessRecord*)(header + 1);
+  for (uint64_t i = 0; i < count; ++i) {
+    const AccessRecord& r = records[i];
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &r.client_ip, client, sizeof(client));
+    const char* method = r.method < sizeof(method_names) / sizeof(method_names[0]) ?
+                         method_names[r.method] : "-";
+    std::string url = r.url_id && r.url_id < urls.size() ? urls[r.url_id] : "-";
+    if (csv) {
+      printf("%lld,%s,%u,%s,%s,%u,%llu,%u,%u,%u,%d,%d\n",
+             (long long)r.time_us, client, ntohs(r.client_port), method, CsvQuote(url).c_str(),
+             r.status, (unsigned long long)r.bytes, r.wait_us, r.parse_us, r.handle_us,
+             (r.flags & ACCESS_KEEP_ALIVE) != 0, (r.flags & ACCESS_RANGE) != 0);
+    } else {
+      time_t sec = r.time_us / 1000000;
+      struct tm tm;
+      localtime_r(&sec, &tm);
+      char date[32];
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+      printf("%s.%06d %s:%u %s %s %u %llu wait=%uus parse=%uus handle=%uus%s\n",
+             date, (int)(r.time_us % 1000000), client, ntohs(r.client_port), method, url.c_str(),
+             r.status, (unsigned long long)r.bytes, r.wait_us, r.parse_us, r.handle_us,
+             (r.flags & ACCESS_KEEP_ALIVE) ? " keep-alive" : "");
+    }
+  }
+  munmap(addr, st.st_size);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool csv = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "c")) != -1) {
+    if (opt == 'c') {
+      csv = true;
+    } else {
+      argc = 0;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "用法: %s [-c] access_<pid>_<tid>_<seq>.bin ...\n", argv[0]);
+    return 1;
+  }
+  if (csv) {
+    printf("time_us,client,port,method,url,status,bytes,wait_us,parse_us,handle_us,keep_alive,range\n");
+  }
+  int ret = 0;
+  for (int i = optind; i < argc; ++i) {
+    if (!Decode(argv[i], csv)) {
+      ret = 1;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,171 @@
+#!/bin/bash
+# 端到端性能回归测试(make perf)
+# 在回环地址上用生成的网站根目录启动服务器，依次运行固定的场景，每个场景重新启动服务器，
+# 收集吞吐、延迟百分位数、峰值RSS、每个请求的上下文切换次数和系统调用次数，
+# 与tools/perf_baseline.txt中的基准按各自的容差对比，有退化时返回1
+#
+# 用法: tools/perf.sh [-b] [-d 每个场景的秒数] [-o 结果文件]
+#   -b 把本次结果写为新的基准(make perf-baseline)
+# 环境变量: PERF_PORT 端口(默认9100)  PERF_IDLE 空闲连接数(默认50000，受文件描述符上限限制)
+#
+# 基准文件每行为"场景 指标 数值 容差(%)"，容差可以手工调整；
+# rps和mbps越大越好，其余指标越小越好，超出容差的变化记为退化
+
+cd "$(dirname "$0")/.." || exit 1
+repo=$(pwd)
+baseline=tools/perf_baseline.txt
+results=perf_results.txt
+duration=5
+write_baseline=0
+port=${PERF_PORT:-9100}
+idle=${PERF_IDLE:-50000}
+
+while getopts "bd:o:" opt; do
+  case $opt in
+    b) write_baseline=1 ;;
+    d) duration=$OPTARG ;;
+    o) results=$OPTARG ;;
+    *) echo "用法: $0 [-b] [-d 秒] [-o 结果文件]" >&2; exit 1 ;;
+  esac
+done
+
+for f in server webbench/loadgen tools/syscount.so; do
+  if [ ! -x "$f" ] && [ ! -f "$f" ]; then
+    echo "缺少$f，请先执行make perf" >&2
+    exit 1
+  fi
+done
+
+# 服务器和压测工具各自占用一端的文件描述符，空闲连接数不能超过上限
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+max_idle=$(( $(ulimit -n) - 2000 ))
+if [ "$idle" -gt "$max_idle" ]; then
+  echo "文件描述符上限为$(ulimit -n)，空闲连接数从$idle减少到$max_idle"
+  idle=$max_idle
+fi
+
+work=$(mktemp -d /tmp/webserver_perf.XXXXXX)
+trap 'kill $server_pid 2>/dev/null; rm -rf "$work"' EXIT
+
+# 生成网站根目录
+mkdir -p "$work/www"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$work/www/small.html"
+head -c $((32 * 1024 * 1024)) /dev/zero > "$work/www/large.bin"
+
+url="http://127.0.0.1:$port"
+# 场景名和loadgen的参数
+scenarios=(
+  "small_keepalive|-c 100 -t 2 $url/small.html"
+  "large_file|-c 4 -t 1 $url/large.bin"
+  "notfound_storm|-c 100 -t 2 $url/no/such/file.html"
+  "idle_plus_load|-I $idle -c 100 -t 2 $url/small.html"
+  "slow_clients|-L 200:/large.bin -c 100 -t 2 $url/small.html"
+)
+
+# 服务器所有线程的上下文切换次数之和
+ContextSwitches() {
+  cat /proc/"$1"/task/*/status 2>/dev/null |
+    awk '/ctxt_switches/ { sum += $2 } END { print sum + 0 }'
+}
+
+# 取loadgen JSON输出中第一个出现的字段
+JsonField() {
+  grep -o "\"$2\":[0-9.]*" "$1" | head -1 | cut -d: -f2
+}
+
+StartServer() {
+  mkdir -p "$work/run"
+  (cd "$work/run" && LD_PRELOAD="$repo/tools/syscount.so" SYSCOUNT_OUT="$work/syscount" \
+     exec "$repo/server" -r "$work/www" "$port" > server.out 2>&1) &
+  server_pid=$!
+  for _ in $(seq 50); do
+    if (exec 3<>/dev/tcp/127.0.0.1/"$port") 2>/dev/null; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "服务器启动失败" >&2
+  return 1
+}
+
+StopServer() {
+  kill -TERM "$server_pid" 2>/dev/null
+  wait "$server_pid" 2>/dev/null
+  server_pid=
+}
+
+: > "$results"
+for scenario in "${scenarios[@]}"; do
+  name=${scenario%%|*}
+  args=${scenario#*|}
+  StartServer || exit 1
+  ctx_before=$(ContextSwitches "$server_pid")
+  # shellcheck disable=SC2086
+  ./webbench/loadgen -J -d "$duration" $args > "$work/out.json"
+  ctx_after=$(ContextSwitches "$server_pid")
+  rss=$(awk '/VmHWM/ { print $2 }' /proc/"$server_pid"/status)
+  StopServer
+  requests=$(JsonField "$work/out.json" requests)
+  if [ -z "$requests" ] || [ "$requests" -eq 0 ]; then
+    echo "$name: 没有完成任何请求" >&2
+    cat "$work/out.json" >&2
+    exit 1
+  fi
+  syscalls=$(awk '$1 == "total" { print $2 }' "$work/syscount")
+  awk -v name="$name" -v seconds="$(JsonField "$work/out.json" seconds)" \
+      -v requests="$requests" -v bytes="$(JsonField "$work/out.json" bytes)" \
+      -v p50="$(JsonField "$work/out.json" p50)" -v p99="$(JsonField "$work/out.json" p99)" \
+      -v p999="$(JsonField "$work/out.json" p999)" -v rss="$rss" \
+      -v ctx=$((ctx_after - ctx_before)) -v syscalls="$syscalls" 'BEGIN {
+    printf "%s rps %.1f\n", name, requests / seconds
+    printf "%s mbps %.2f\n", name, bytes / seconds / 1048576
+    printf "%s p50_us %d\n", name, p50
+    printf "%s p99_us %d\n", name, p99
+    printf "%s p999_us %d\n", name, p999
+    printf "%s rss_kb %d\n", name, rss
+    printf "%s ctxsw_per_req %.3f\n", name, ctx / requests
+    printf "%s syscalls_per_req %.3f\n", name, syscalls / requests
+  }' >> "$results"
+  echo "$name: 完成 $requests 个请求"
+done
+
+if [ "$write_baseline" -eq 1 ]; then
+  # 默认容差: 延迟的波动最大，系统调用次数基本是确定的
+  awk '{
+    tol = 20
+    if ($2 ~ /^p/) tol = 50
+    else if ($2 == "ctxsw_per_req") tol = 30
+    else if ($2 == "syscalls_per_req") tol = 10
+    print $1, $2, $3, tol
+  }' "$results" > "$baseline"
+  echo "基准已写入$baseline"
+  exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+  cat "$results"
+  echo "没有基准文件$baseline，用make perf-baseline生成" >&2
+  exit 0
+fi
+
+awk 'NR == FNR { current[$1 " " $2] = $3; next }
+{
+  key = $1 " " $2
+  if (!(key in current)) {
+    printf "%-18s %-18s %12s %12s %8s  缺少\n", $1, $2, $3, "-", "-"
+    next
+  }
+  base = $3; cur = current[key]; tol = $4
+  change = base != 0 ? (cur - base) * 100 / base : 0
+  higher_better = ($2 == "rps" || $2 == "mbps")
+  worse = higher_better ? -change : change
+  status = "ok"
+  if (worse > tol) {
+    status = "退化"
+    failed = 1
+  } else if (worse < -tol) {
+    status = "提升"
+  }
+  printf "%-18s %-18s %12s %12s %+7.1f%%  %s\n", $1, $2, base, cur, change, status
+}
+END { exit failed }' "$results" "$baseline"
@@ -0,0 +1,117 @@
+// 统计服务器系统调用次数的LD_PRELOAD库(没有strace/perf的环境下使用，见tools/perf.sh)
+// 拦截服务器直接调用的libc函数，进程退出时把各个调用的次数写入SYSCOUNT_OUT指定的文件
+// (默认./syscount.out)，每行"名称 次数"，最后一行为total
+// glibc内部发起的系统调用(例如pthread的futex)和vDSO中的clock_gettime/time不在统计之内
+//
+//   LD_PRELOAD=./tools/syscount.so SYSCOUNT_OUT=/tmp/sc.txt ./server 9006
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+
+namespace {
+
+enum SYSCALL {
+  SC_ACCEPT, SC_CLOSE, SC_EPOLL_CTL, SC_EPOLL_WAIT, SC_RECV, SC_SEND, SC_SENDMSG, SC_WRITEV,
+  SC_READ, SC_WRITE, SC_OPEN, SC_STAT, SC_FSTAT, SC_MMAP, SC_MUNMAP, SC_MADVISE, SC_FCNTL,
+  SC_SETSOCKOPT, SC_COUNT
+};
+
+const char* const names[SC_COUNT] = {
+  "accept", "close", "epoll_ctl", "epoll_wait", "recv", "send", "sendmsg", "writev",
+  "read", "write", "open", "stat", "fstat", "mmap", "munmap", "madvise", "fcntl", "setsockopt",
+};
+
+std::atomic<long> counts[SC_COUNT];
+
+// 第一次调用时通过dlsym找到libc中的实现
+template <class F>
+F Real(F* cache, const char* name) {
+  if (!*cache) {
+    *cache = (F)dlsym(RTLD_NEXT, name);
+  }
+  return *cache;
+}
+
+inline void Count(SYSCALL sc) {
+  counts[sc].fetch_add(1, std::memory_order_relaxed);
+}
+
+__attribute__((destructor)) void Report() {
+  const char* path = getenv("SYSCOUNT_OUT");
+  FILE* fp = fopen(path ? path : "syscount.out", "w");
+  if (!fp) {
+    return;
+  }
+  long total = 0;
+  for (int i = 0; i < SC_COUNT; ++i) {
+    long n = counts[i].load();
+    total += n;
+    fprintf(fp, "%s %ld\n", names[i], n);
+  }
+  fprintf(fp, "total %ld\n", total);
+  fclose(fp);
+}
+
+}  // namespace
+
+#define WRAP(ret, name, params, sc, args)          \
+  extern "C" ret name params {                     \
+    static ret (*real) params;                     \
+    Count(sc);                                     \
+    return Real(&real, #name) args;                \
+  }
+
+WRAP(int, accept, (int fd, sockaddr* addr, socklen_t* len), SC_ACCEPT, (fd, addr, len))
+WRAP(int, close, (int fd), SC_CLOSE, (fd))
+WRAP(int, epoll_ctl, (int epfd, int op, int fd, epoll_event* event), SC_EPOLL_CTL,
+     (epfd, op, fd, event))
+WRAP(int, epoll_wait, (int epfd, epoll_event* events, int max, int timeout), SC_EPOLL_WAIT,
+     (epfd, events, max, timeout))
+WRAP(ssize_t, recv, (int fd, void* buf, size_t len, int flags), SC_RECV, (fd, buf, len, flags))
+WRAP(ssize_t, send, (int fd, const void* buf, size_t len, int flags), SC_SEND,
+     (fd, buf, len, flags))
+WRAP(ssize_t, sendmsg, (int fd, const msghdr* msg, int flags), SC_SENDMSG, (fd, msg, flags))
+WRAP(ssize_t, writev, (int fd, const iovec* iov, int count), SC_WRITEV, (fd, iov, count))
+WRAP(ssize_t, read, (int fd, void* buf, size_t len), SC_READ, (fd, buf, len))
+WRAP(ssize_t, write, (int fd, const void* buf, size_t len), SC_WRITE, (fd, buf, len))
+WRAP(int, stat, (const char* path, struct stat* st), SC_STAT, (path, st))
+WRAP(int, fstat, (int fd, struct stat* st), SC_FSTAT, (fd, st))
+WRAP(void*, mmap, (void* addr, size_t len, int prot, int flags, int fd, off_t offset), SC_MMAP,
+     (addr, len, prot, flags, fd, offset))
+WRAP(int, munmap, (void* addr, size_t len), SC_MUNMAP, (addr, len))
+WRAP(int, madvise, (void* addr, size_t len, int advice), SC_MADVISE, (addr, len, advice))
+WRAP(int, setsockopt, (int fd, int level, int name, const void* value, socklen_t len),
+     SC_SETSOCKOPT, (fd, level, name, value, len))
+
+// open和fcntl的第三个参数是可变参数
+extern "C" int open(const char* path, int flags, ...) {
+  static int (*real)(const char*, int, ...);
+  Count(SC_OPEN);
+  mode_t mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+  return Real(&real, "open")(path, flags, mode);
+}
+
+extern "C" int fcntl(int fd, int cmd, ...) {
+  static int (*real)(int, int, ...);
+  Count(SC_FCNTL);
+  va_list args;
+  va_start(args, cmd);
+  long arg = va_arg(args, long);
+  va_end(args);
+  return Real(&real, "fcntl")(fd, cmd, arg);
+}
@@ -0,0 +1,171 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "locker.h"
+#include "log.h"
+
+bool Tracer::enabled_ = false;
+
+namespace {
+
+FILE* trace_file = NULL;
+Locker trace_lock;            // 保护trace_file，只有被记录的请求才会加锁
+bool first_event = true;
+double ticks_per_us = 1000;   // 由Init()校准
+uint64_t base_ticks = 0;      // 校准时的TSC和对应的UNIX时间，用于把TSC换算成时间
+int64_t base_us = 0;
+int sample_every = 0;
+uint64_t slow_ticks = 0;
+thread_local uint64_t request_counter = 0;   // 每个线程单独计数采样，不共享
+
+// Chrome trace中的一个阶段(X事件)
+struct Span {
+  const char* name;
+  TRACE_PHASE from;
+  TRACE_PHASE to;
+};
+
+const Span spans[] = {
+  {"read", TRACE_READ_START, TRACE_READ_END},
+  {"queue", TRACE_ENQUEUE, TRACE_DEQUEUE},
+  {"parse", TRACE_PARSE_START, TRACE_PARSE_END},
+  {"do_request", TRACE_PARSE_END, TRACE_HANDLE_END},
+  {"build_response", TRACE_HANDLE_END, TRACE_RESPONSE},
+  {"write", TRACE_RESPONSE, TRACE_DONE},
+  {"backpressure", TRACE_WRITE_BLOCKED, TRACE_DONE},
+};
+
+int64_t NowUs(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+double ToUs(uint64_t ticks) {
+  return ticks / ticks_per_us;
+}
+
+double Duration(const RequestTrace& trace, TRACE_PHASE from, TRACE_PHASE to) {
+  if (!trace.ts[from] || trace.ts[to] < trace.ts[from]) {
+    return 0;
+  }
+  return ToUs(trace.ts[to] - trace.ts[from]);
+}
+
+// 复制URL并转义JSON中的特殊字符
+void EscapeJson(char* out, int size, const char* in) {
+  int len = 0;
+  for (; *in && len < size - 7; ++in) {
+    unsigned char c = *in;
+    if (c == '"' || c == '\\') {
+      out[len++] = '\\';
+      out[len++] = c;
+    } else if (c < 0x20) {
+      len += snprintf(out + len, size - len, "\\u%04x", c);
+    } else {
+      out[len++] = c;
+    }
+  }
+  out[len] = '\0';
+}
+
+}  // namespace
+
+bool Tracer::Init(const char* path, int sample, int slow_ms) {
+  if (sample <= 0 && slow_ms <= 0) {
+    return true;
+  }
+  trace_file = fopen(path, "w");
+  if (!trace_file) {
+    return false;
+  }
+  // 用单调时钟校准TSC的频率
+  int64_t start_us = NowUs(CLOCK_MONOTONIC);
+  uint64_t start_ticks = Now();
+  usleep(20000);
+  int64_t end_us = NowUs(CLOCK_MONOTONIC);
+  uint64_t end_ticks = Now();
+  ticks_per_us = (double)(end_ticks - start_ticks) / (end_us - start_us);
+  base_ticks = Now();
+  base_us = NowUs(CLOCK_REALTIME);
+  sample_every = sample > 0 ? sample : 0;
+  slow_ticks = slow_ms > 0 ? (uint64_t)(slow_ms * 1000 * ticks_per_us) : 0;
+  fputs("[\n", trace_file);   // Chrome trace的JSON数组格式，结尾的]可以省略
+  enabled_ = true;
+  LOG_INFO("请求追踪写入%s，每%d个请求采样一个，慢请求阈值%dms，TSC %.1f ticks/us",
+           path, sample_every, slow_ms, ticks_per_us);
+  return true;
+}
+
+void Tracer::Stop() {
+  if (!trace_file) {
+    return;
+  }
+  trace_lock.Lock();
+  enabled_ = false;
+  fputs("\n]\n", trace_file);
+  fclose(trace_file);
+  trace_file = NULL;
+  trace_lock.UnLock();
+}
+
+void Tracer::Finish(const RequestTrace& trace) {
+  TRACE_PHASE start = trace.ts[TRACE_READ_START] ? TRACE_READ_START : TRACE_PARSE_START;
+  if (!trace.ts[start] || trace.ts[TRACE_DONE] < trace.ts[start]) {
+    return;
+  }
+  uint64_t total = trace.ts[TRACE_DONE] - trace.ts[start];
+  bool sampled = sample_every && ++request_counter % sample_every == 0;
+  bool slow = slow_ticks && total >= slow_ticks;
+  if (!sampled && !slow) {
+    return;
+  }
+
+  char url[256];
+  EscapeJson(url, sizeof(url), trace.url);
+  char buf[4096];
+  int pid = getpid();
+  double begin = base_us + ((double)trace.ts[start] - base_ticks) / ticks_per_us;
+  int len = snprintf(buf, sizeof(buf),
+      "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+      "\"args\":{\"status\":%d,\"bytes\":%lld,\"slow\":%s}}",
+      url, pid, trace.fd, begin, ToUs(total), trace.status, (long long)trace.bytes,
+      slow ? "true" : "false");
+  for (const Span& span : spans) {
+    if (!trace.ts[span.from] || trace.ts[span.to] < trace.ts[span.from]) {
+      continue;
+    }
+    double ts = base_us + ((double)trace.ts[span.from] - base_ticks) / ticks_per_us;
+    len += snprintf(buf + len, sizeof(buf) - len,
+        ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+        span.name, pid, trace.fd, ts, Duration(trace, span.from, span.to));
+  }
+
+  trace_lock.Lock();
+  if (trace_file) {
+    if (!first_event) {
+      fputs(",\n", trace_file);
+    }
+    first_event = false;
+    fputs(buf, trace_file);
+    fflush(trace_file);
+  }
+  trace_lock.UnLock();
+
+  if (slow) {
+    LOG_WARN("慢请求%s 状态%d 共%.0fus: read=%.0f queue=%.0f parse=%.0f do_request=%.0f "
+             "build=%.0f write=%.0f(backpressure=%.0f)",
+             trace.url, trace.status, ToUs(total),
+             Duration(trace, TRACE_READ_START, TRACE_READ_END),
+             Duration(trace, TRACE_ENQUEUE, TRACE_DEQUEUE),
+             Duration(trace, TRACE_PARSE_START, TRACE_PARSE_END),
+             Duration(trace, TRACE_PARSE_END, TRACE_HANDLE_END),
+             Duration(trace, TRACE_HANDLE_END, TRACE_RESPONSE),
+             Duration(trace, TRACE_RESPONSE, TRACE_DONE),
+             Duration(trace, TRACE_WRITE_BLOCKED, TRACE_DONE));
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// 请求处理过程中各阶段的边界
+enum TRACE_PHASE {
+  TRACE_READ_START = 0,   // 主线程开始读取请求数据
+  TRACE_READ_END,         // 主线程读取完毕
+  TRACE_ENQUEUE,          // 放入线程池的请求队列
+  TRACE_DEQUEUE,          // 工作线程取出，开始处理
+  TRACE_PARSE_START,      // 开始解析请求
+  TRACE_PARSE_END,        // 解析完毕，开始查找文件(DoRequest)
+  TRACE_HANDLE_END,       // 文件查找/打开完毕
+  TRACE_RESPONSE,         // 响应加入发送队列
+  TRACE_WRITE_BLOCKED,    // 第一次遇到写缓冲满(EAGAIN)
+  TRACE_DONE,             // 响应的最后一个字节发送完毕
+  TRACE_PHASE_COUNT
+};
+
+// 一个请求在各阶段边界的TSC时间戳，0表示该请求没有经过这个阶段
+struct RequestTrace {
+  uint64_t ts[TRACE_PHASE_COUNT];
+  int fd;
+  int status;
+  int64_t bytes;
+  char url[128];
+};
+
+// 请求阶段追踪，按采样率或者超过慢请求阈值的请求写入Chrome trace格式(JSON数组)的文件，
+// 可以用chrome://tracing或者Perfetto打开；慢请求同时写一条WARN日志
+class Tracer {
+public:
+  // sample_every: 每N个请求采样一个(0为不采样)，slow_ms: 慢请求阈值(0为不记录慢请求)
+  // 两者都为0时不追踪，也不读取TSC
+  static bool Init(const char* path, int sample_every, int slow_ms);
+  static void Stop();
+  static bool Enabled() { return enabled_; }
+
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+  }
+  // 请求完成时调用，决定是否记录
+  static void Finish(const RequestTrace& trace);
+
+private:
+  static bool enabled_;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef LOADGEN_HISTOGRAM_H_
+#define LOADGEN_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// HDR风格的延迟直方图(微秒)，每个2的幂区间再分为SUB_BUCKETS个等宽的小区间，
+// 相对误差不超过1/SUB_BUCKETS(<1%)，记录一个值只需要计算最高位
+// 每个压测线程一份，结束时合并
+class LatencyHistogram {
+public:
+  static const int SUB_BITS = 7;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int MAX_BITS = 40;                                  // 最大约12天
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+  LatencyHistogram() { Reset(); }
+
+  void Reset() {
+    memset(counts_, 0, sizeof(counts_));
+    total_ = 0;
+    sum_ = 0;
+    min_ = UINT64_MAX;
+    max_ = 0;
+  }
+
+  void Record(uint64_t us) {
+    ++counts_[Index(us)];
+    ++total_;
+    sum_ += us;
+    if (us < min_) {
+      min_ = us;
+    }
+    if (us > max_) {
+      max_ = us;
+    }
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < BUCKETS; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    sum_ += other.sum_;
+    if (other.min_ < min_) {
+      min_ = other.min_;
+    }
+    if (other.max_ > max_) {
+      max_ = other.max_;
+    }
+  }
+
+  // 百分位数(0~100)，返回所在区间的上界
+  uint64_t Percentile(double p) const {
+    if (total_ == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * total_ + 0.5);
+    if (rank < 1) {
+      rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        uint64_t upper = UpperBound(i);
+        return upper < max_ ? upper : max_;
+      }
+    }
+    return max_;
+  }
+
+  uint64_t Count() const { return total_; }
+  uint64_t Min() const { return total_ ? min_ : 0; }
+  uint64_t Max() const { return max_; }
+  double Mean() const { return total_ ? (double)sum_ / total_ : 0; }
+
+  static int Index(uint64_t us) {
+    if (us < SUB_BUCKETS) {
+      return us;
+    }
+    if (us >= (1ULL << MAX_BITS)) {
+      us = (1ULL << MAX_BITS) - 1;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((us >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  static uint64_t UpperBound(int index) {
+    if (index < SUB_BUCKETS) {
+      return index;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return lower + (1ULL << shift) - 1;
+  }
+
+private:
+  uint64_t counts_[BUCKETS];
+  uint64_t total_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+
+#endif
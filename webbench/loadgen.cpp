@@ -0,0 +1,826 @@
+// 基于epoll的多线程HTTP压测工具
+// 与webbench每个客户端fork一个进程、每个请求新建一个连接不同，loadgen在少量线程中
+// 用epoll驱动大量长连接(keep-alive)，支持流水线(pipelining)和按权重混合的请求，
+// 统计每个请求的延迟并输出p50/p90/p99/p99.9
+//
+// 默认是闭环模式: 每个连接收到响应后立即发送下一个请求，服务器变慢时客户端也随之变慢，
+// 排队的时间不会体现在延迟中(coordinated omission)。
+// -R指定总的请求速率时为开环模式(与wrk2相同): 请求按固定的时间表发出，
+// 第k个请求的预定发送时间为 开始时间+k/速率，轮流分配给各个连接，
+// 延迟从预定发送时间开始计算，服务器停顿期间本应发出的请求的等待时间也计入延迟
+//
+// 用法: loadgen [选项] http://host:port/path
+//   -c 连接数(默认100)  -t 线程数(默认2)  -d 压测时间秒(默认10)
+//   -p 每个连接的流水线深度(默认1)  -f 请求列表文件(每行"路径 [权重]")
+//   -C 每个请求后关闭连接(Connection: close，与webbench相同)  -J 以JSON输出结果
+//   -R 开环模式的总请求速率(请求/秒)
+//   -S 起始:结束:步长 按速率扫描，每个速率开环压测-d秒，找出延迟的拐点
+//   -I 压测期间额外保持的空闲连接数(只建立连接，不发送请求)
+//   -L 慢速客户端数[:路径] 每个慢速客户端每100ms只读4KB，读完一个响应后重新连接
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "response_parser.h"
+
+namespace {
+
+const int MAX_PIPELINE = 64;
+const int READ_CHUNK = 64 * 1024;
+const int64_t GRACE_US = 2000000;       // 开环模式结束后等待已发出请求完成的时间
+const int IDLE_PER_SOURCE = 25000;      // 回环地址上每个源地址建立的空闲连接数
+const int SLOW_CHUNK = 4096;            // 慢速客户端每次读取的字节数
+const int SLOW_INTERVAL_US = 100000;
+
+// 压测配置，所有线程只读
+struct Config {
+  int connections = 100;
+  int threads = 2;
+  int duration = 10;
+  int pipeline = 1;
+  bool close_each = false;
+  bool json = false;
+  double rate = 0;                     // 开环模式的总速率，0为闭环模式
+  int idle = 0;                        // 空闲连接数
+  int slow = 0;                        // 慢速客户端数
+  std::string slow_path;
+  sockaddr_in addr;
+  std::string host;
+  std::vector<std::string> requests;   // 预先生成好的请求报文
+  std::vector<uint64_t> weights;       // 累积权重，与requests一一对应
+};
+
+Config config;
+
+// 空闲连接和慢速客户端的结果
+struct Background {
+  int idle_open = 0;                   // 实际建立的空闲连接数
+  uint64_t slow_bytes = 0;             // 慢速客户端收到的字节数
+};
+
+Background background;
+
+int64_t NowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// 每个连接的状态
+struct Connection {
+  int fd = -1;
+  bool connected = false;
+  int index = 0;                         // 在线程的连接数组中的下标
+  std::string out;                       // 还没有发送的请求
+  size_t out_offset = 0;
+  int64_t intended_us[MAX_PIPELINE];     // 已发送请求的预定发送时间(环形队列)
+  int64_t send_us[MAX_PIPELINE];         // 已发送请求的实际发送时间
+  int head = 0;
+  int inflight = 0;
+  uint64_t issued = 0;                   // 开环模式下已经到了预定时间的请求数
+  uint64_t sent = 0;                     // 开环模式下已经发出的请求数
+  ResponseParser parser;                  // 响应的解析状态
+};
+
+// 每个线程的统计，结束时合并
+struct Stats {
+  uint64_t requests = 0;
+  uint64_t bytes = 0;
+  uint64_t non_2xx = 0;
+  uint64_t connects = 0;
+  uint64_t connect_errors = 0;
+  uint64_t io_errors = 0;
+  uint64_t unfinished = 0;               // 开环模式结束时还没有完成的请求
+  LatencyHistogram latency;              // 从预定发送时间开始计算(闭环模式下与service相同)
+  LatencyHistogram service;              // 从实际发送时间开始计算
+
+  void Merge(const Stats& s) {
+    requests += s.requests;
+    bytes += s.bytes;
+    non_2xx += s.non_2xx;
+    connects += s.connects;
+    connect_errors += s.connect_errors;
+    io_errors += s.io_errors;
+    unfinished += s.unfinished;
+    latency.Merge(s.latency);
+    service.Merge(s.service);
+  }
+};
+
+class Worker {
+public:
+  // rate为本线程的请求速率，0为闭环模式；开环模式下所有线程建立好连接后在ready处同步
+  Worker(int connections, int64_t duration_us, double rate, pthread_barrier_t* ready)
+    : conns_(connections), start_us_(0), deadline_us_(INT64_MAX), end_us_(0), duration_us_(duration_us),
+      period_us_(rate > 0 ? 1e6 / rate : 0), next_k_(0), ready_(ready),
+      rand_state_(0x9e3779b97f4a7c15ULL ^ (uint64_t)this) {
+    for (size_t i = 0; i < conns_.size(); ++i) {
+      conns_[i].index = i;
+    }
+  }
+  void Run();
+  const Stats& GetStats() const { return stats_; }
+  // 开始发送请求到最后一个请求完成的时间
+  int64_t StartUs() const { return start_us_; }
+  int64_t EndUs() const { return end_us_; }
+
+private:
+  void Connect(Connection* c);
+  void Reconnect(Connection* c, bool error);
+  void Fill(Connection* c);               // 补满流水线
+  bool Flush(Connection* c);              // 发送out中的数据，出错返回false
+  bool Read(Connection* c);               // 读取并解析响应，出错或者连接关闭返回false
+  bool Complete(Connection* c, int status);  // 一个响应接收完毕，返回false表示收到了没有请求的响应
+  void Issue(int64_t now);                // 开环模式下把到了预定时间的请求分配给连接
+  uint64_t Outstanding() const;           // 已到预定时间但还没有完成的请求数
+  const std::string& NextRequest();
+
+  std::vector<Connection> conns_;
+  void WaitConnected();                   // 开环模式下等待所有连接建立
+
+  int64_t start_us_;
+  int64_t deadline_us_;
+  int64_t end_us_;
+  int64_t duration_us_;
+  double period_us_;                      // 开环模式下相邻两个请求的间隔
+  uint64_t next_k_;                       // 下一个请求在时间表中的序号
+  pthread_barrier_t* ready_;
+  int epollfd_ = -1;
+  uint64_t rand_state_;
+  Stats stats_;
+  char buf_[READ_CHUNK];
+};
+
+void Worker::Connect(Connection* c) {
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd < 0) {
+    ++stats_.connect_errors;
+    return;
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  c->connected = false;
+  c->out.clear();
+  c->out_offset = 0;
+  c->head = 0;
+  c->inflight = 0;
+  c->parser.Reset();
+  if (connect(c->fd, (sockaddr*)&config.addr, sizeof(config.addr)) != 0 && errno != EINPROGRESS) {
+    ++stats_.connect_errors;
+    close(c->fd);
+    c->fd = -1;
+    return;
+  }
+  ++stats_.connects;
+  epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = c;
+  epoll_ctl(epollfd_, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+void Worker::Reconnect(Connection* c, bool error) {
+  if (error) {
+    ++stats_.io_errors;
+  }
+  if (c->fd >= 0) {
+    close(c->fd);   // 同时从epoll中删除
+    c->fd = -1;
+  }
+  // 开环模式下连接断开时已经发出的请求作废，还没有发出的请求在新的连接上发送
+  if (NowUs() < deadline_us_ || (period_us_ > 0 && c->sent < c->issued)) {
+    Connect(c);
+  }
+}
+
+const std::string& Worker::NextRequest() {
+  if (config.requests.size() == 1) {
+    return config.requests[0];
+  }
+  // xorshift64，按累积权重选择请求
+  rand_state_ ^= rand_state_ << 13;
+  rand_state_ ^= rand_state_ >> 7;
+  rand_state_ ^= rand_state_ << 17;
+  uint64_t r = rand_state_ % config.weights.back();
+  size_t lo = 0;
+  size_t hi = config.weights.size() - 1;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (config.weights[mid] > r) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return config.requests[lo];
+}
+
+void Worker::Fill(Connection* c) {
+  int depth = config.close_each ? 1 : config.pipeline;
+  int64_t now = NowUs();
+  while (c->inflight < depth) {
+    int slot = (c->head + c->inflight) % MAX_PIPELINE;
+    if (period_us_ > 0) {
+      if (c->sent == c->issued) {
+        break;   // 还没有到下一个请求的预定时间
+      }
+      // 该连接的第sent个请求在时间表中的序号
+      uint64_t k = c->sent * conns_.size() + c->index;
+      c->intended_us[slot] = start_us_ + (int64_t)(k * period_us_);
+      ++c->sent;
+    } else {
+      if (now >= deadline_us_) {
+        break;
+      }
+      c->intended_us[slot] = now;
+    }
+    c->out += NextRequest();
+    c->send_us[slot] = now;
+    ++c->inflight;
+  }
+}
+
+void Worker::Issue(int64_t now) {
+  while (true) {
+    int64_t due = start_us_ + (int64_t)(next_k_ * period_us_);
+    if (due > now || due >= deadline_us_) {
+      return;
+    }
+    Connection* c = &conns_[next_k_ % conns_.size()];
+    ++next_k_;
+    ++c->issued;
+    // 连接正在建立或者流水线已满时，请求留到之后发送，延迟仍从预定时间开始计算
+    if (c->fd >= 0 && c->connected) {
+      Fill(c);
+      if (!Flush(c)) {
+        Reconnect(c, true);
+      }
+    }
+  }
+}
+
+uint64_t Worker::Outstanding() const {
+  uint64_t n = 0;
+  for (const Connection& c : conns_) {
+    n += c.inflight + (c.issued - c.sent);
+  }
+  return n;
+}
+
+bool Worker::Flush(Connection* c) {
+  while (c->out_offset < c->out.size()) {
+    ssize_t n = send(c->fd, c->out.data() + c->out_offset, c->out.size() - c->out_offset, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;   // 等待EPOLLOUT
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    c->out_offset += n;
+  }
+  c->out.clear();
+  c->out_offset = 0;
+  return true;
+}
+
+bool Worker::Complete(Connection* c, int status) {
+  if (c->inflight == 0) {
+    return false;
+  }
+  int64_t now = NowUs();
+  int64_t latency = now - c->intended_us[c->head];
+  int64_t service = now - c->send_us[c->head];
+  c->head = (c->head + 1) % MAX_PIPELINE;
+  --c->inflight;
+  stats_.latency.Record(latency > 0 ? latency : 0);
+  stats_.service.Record(service > 0 ? service : 0);
+  ++stats_.requests;
+  if (status < 200 || status >= 300) {
+    ++stats_.non_2xx;
+  }
+  return true;
+}
+
+bool Worker::Read(Connection* c) {
+  while (true) {
+    ssize_t n = recv(c->fd, buf_, sizeof(buf_), 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      return false;
+    }
+    stats_.bytes += n;
+    if (!c->parser.Feed(buf_, n, [this, c](int status) { return Complete(c, status); })) {
+      return false;
+    }
+  }
+}
+
+void Worker::WaitConnected() {
+  epoll_event events[1024];
+  int64_t give_up = NowUs() + 10000000;
+  while (NowUs() < give_up) {
+    bool all = true;
+    for (const Connection& c : conns_) {
+      all = all && c.connected;
+    }
+    if (all) {
+      return;
+    }
+    int num = epoll_wait(epollfd_, events, 1024, 100);
+    for (int i = 0; i < num; ++i) {
+      Connection* c = (Connection*)events[i].data.ptr;
+      if (c->fd < 0 || c->connected) {
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        ++stats_.connect_errors;
+        Reconnect(c, false);
+      } else if (events[i].events & EPOLLOUT) {
+        c->connected = true;
+      }
+    }
+  }
+}
+
+void Worker::Run() {
+  epollfd_ = epoll_create1(0);
+  for (Connection& c : conns_) {
+    Connect(&c);
+  }
+  if (period_us_ > 0) {
+    // 开环模式下建立连接的时间(例如服务器的listen队列满时SYN重传)不计入时间表
+    WaitConnected();
+    pthread_barrier_wait(ready_);
+  }
+  start_us_ = NowUs();
+  deadline_us_ = start_us_ + duration_us_;
+  epoll_event events[1024];
+  while (true) {
+    int64_t now = NowUs();
+    int64_t wake = deadline_us_;
+    if (now >= deadline_us_) {
+      // 开环模式下不再产生新的请求，等待已经到预定时间的请求完成
+      if (period_us_ <= 0 || now >= deadline_us_ + GRACE_US || Outstanding() == 0) {
+        break;
+      }
+      wake = deadline_us_ + GRACE_US;
+    } else if (period_us_ > 0) {
+      Issue(now);
+      int64_t next = start_us_ + (int64_t)(next_k_ * period_us_);
+      wake = next < deadline_us_ ? next : deadline_us_;
+    }
+    int64_t timeout = (wake - NowUs() + 999) / 1000;
+    if (timeout < 0) {
+      timeout = 0;
+    }
+    int num = epoll_wait(epollfd_, events, 1024, timeout < 100 ? timeout : 100);
+    for (int i = 0; i < num; ++i) {
+      Connection* c = (Connection*)events[i].data.ptr;
+      if (c->fd < 0) {
+        continue;
+      }
+      if (events[i].events & EPOLLERR) {
+        if (!c->connected) {
+          ++stats_.connect_errors;
+          Reconnect(c, false);
+        } else {
+          Reconnect(c, true);
+        }
+        continue;
+      }
+      if (!c->connected && (events[i].events & EPOLLOUT)) {
+        c->connected = true;
+        Fill(c);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        bool ok = Read(c);
+        if (c->parser.ServerClose()) {
+          // 服务器按Connection: close关闭连接(例如达到长连接的请求数上限)，
+          // 之后流水线上已经发出的请求不会被处理，不算作错误
+          Reconnect(c, false);
+          continue;
+        }
+        if (!ok) {
+          Reconnect(c, true);
+          continue;
+        }
+        Fill(c);
+      }
+      if (c->connected && !Flush(c)) {
+        Reconnect(c, true);
+      }
+    }
+  }
+  if (period_us_ > 0) {
+    stats_.unfinished = Outstanding();
+  }
+  end_us_ = NowUs();
+  for (Connection& c : conns_) {
+    if (c.fd >= 0) {
+      close(c.fd);
+    }
+  }
+  close(epollfd_);
+}
+
+void* WorkerMain(void* arg) {
+  ((Worker*)arg)->Run();
+  return NULL;
+}
+
+bool ParseUrl(const char* url, std::string* host, int* port, std::string* path) {
+  if (strncmp(url, "http://", 7) != 0) {
+    return false;
+  }
+  url += 7;
+  const char* slash = strchr(url, '/');
+  std::string authority = slash ? std::string(url, slash - url) : std::string(url);
+  *path = slash ? slash : "/";
+  size_t colon = authority.find(':');
+  *port = 80;
+  if (colon != std::string::npos) {
+    *port = atoi(authority.c_str() + colon + 1);
+    authority.resize(colon);
+  }
+  *host = authority;
+  return !host->empty() && *port > 0;
+}
+
+std::string BuildRequest(const std::string& path) {
+  std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + config.host + "\r\n";
+  req += config.close_each ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+  return req;
+}
+
+bool LoadRequests(const char* file, const std::string& default_path) {
+  if (!file) {
+    config.requests.push_back(BuildRequest(default_path));
+    config.weights.push_back(1);
+    return true;
+  }
+  FILE* fp = fopen(file, "r");
+  if (!fp) {
+    perror(file);
+    return false;
+  }
+  char line[4096];
+  uint64_t total = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    char path[4096];
+    unsigned long weight = 1;
+    if (line[0] == '#' || sscanf(line, "%4095s %lu", path, &weight) < 1 || weight == 0) {
+      continue;
+    }
+    total += weight;
+    config.requests.push_back(BuildRequest(path));
+    config.weights.push_back(total);
+  }
+  fclose(fp);
+  if (config.requests.empty()) {
+    fprintf(stderr, "%s: 没有请求\n", file);
+    return false;
+  }
+  return true;
+}
+
+// 建立n个空闲连接，返回成功建立的连接
+// 目标为回环地址时每IDLE_PER_SOURCE个连接换一个源地址(127.0.0.2、127.0.0.3...)，避免本地端口耗尽
+std::vector<int> OpenIdle(int n) {
+  std::vector<int> fds;
+  bool loopback = (ntohl(config.addr.sin_addr.s_addr) >> 24) == 127;
+  for (int i = 0; i < n; ++i) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      break;
+    }
+    if (loopback && i >= IDLE_PER_SOURCE) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+      sockaddr_in local = {};
+      local.sin_family = AF_INET;
+      local.sin_addr.s_addr = htonl((127u << 24) + 1 + i / IDLE_PER_SOURCE);
+      bind(fd, (sockaddr*)&local, sizeof(local));
+    }
+    if (connect(fd, (sockaddr*)&config.addr, sizeof(config.addr)) != 0) {
+      perror("connect");
+      close(fd);
+      break;
+    }
+    fds.push_back(fd);
+  }
+  return fds;
+}
+
+int SlowConnect(const std::string& request) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // 接收缓冲区很小，服务器很快就会因为发送不出去而等待EPOLLOUT
+  int size = SLOW_CHUNK;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if (connect(fd, (sockaddr*)&config.addr, sizeof(config.addr)) != 0 ||
+      send(fd, request.data(), request.size(), 0) != (ssize_t)request.size()) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// 慢速客户端线程，运行到deadline_us
+void* SlowMain(void* arg) {
+  int64_t deadline_us = *(int64_t*)arg;
+  std::string request = "GET " + config.slow_path + " HTTP/1.1\r\nHost: " + config.host +
+                        "\r\nConnection: close\r\n\r\n";
+  std::vector<int> fds(config.slow, -1);
+  char buf[SLOW_CHUNK];
+  while (NowUs() < deadline_us) {
+    for (int& fd : fds) {
+      if (fd < 0) {
+        fd = SlowConnect(request);
+        continue;
+      }
+      int n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n > 0) {
+        background.slow_bytes += n;
+      } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close(fd);   // 响应读完了(或者出错)，下一轮重新连接
+        fd = -1;
+      }
+    }
+    usleep(SLOW_INTERVAL_US);
+  }
+  for (int fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+void Usage(const char* name) {
+  fprintf(stderr,
+          "用法: %s [-c 连接数] [-t 线程数] [-d 秒] [-p 流水线深度] [-f 请求文件] [-C] [-J] "
+          "[-R 请求/秒 | -S 起始:结束:步长] [-I 空闲连接数] [-L 慢速客户端数[:路径]] "
+          "http://host:port/path\n", name);
+  exit(1);
+}
+
+void PrintResult(const Stats& total, double seconds) {
+  const LatencyHistogram& h = total.latency;
+  const LatencyHistogram& s = total.service;
+  if (config.json) {
+    printf("{\"connections\":%d,\"threads\":%d,\"pipeline\":%d,\"target_rps\":%.1f,"
+           "\"seconds\":%.3f,\"requests\":%llu,\"rps\":%.1f,\"bytes\":%llu,\"non_2xx\":%llu,"
+           "\"connects\":%llu,\"connect_errors\":%llu,\"io_errors\":%llu,\"unfinished\":%llu,"
+           "\"idle\":%d,\"slow\":%d,\"slow_bytes\":%llu,"
+           "\"latency_us\":{\"min\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+           "\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+           "\"service_us\":{\"p50\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+           config.connections, config.threads, config.pipeline, config.rate, seconds,
+           (unsigned long long)total.requests, total.requests / seconds,
+           (unsigned long long)total.bytes, (unsigned long long)total.non_2xx,
+           (unsigned long long)total.connects, (unsigned long long)total.connect_errors,
+           (unsigned long long)total.io_errors, (unsigned long long)total.unfinished,
+           background.idle_open, config.slow, (unsigned long long)background.slow_bytes,
+           (unsigned long long)h.Min(), h.Mean(),
+           (unsigned long long)h.Percentile(50), (unsigned long long)h.Percentile(90),
+           (unsigned long long)h.Percentile(99), (unsigned long long)h.Percentile(99.9),
+           (unsigned long long)h.Max(), (unsigned long long)s.Percentile(50),
+           (unsigned long long)s.Percentile(99), (unsigned long long)s.Max());
+    return;
+  }
+  printf("%d个连接，%d个线程，流水线深度%d，%.1f秒\n",
+         config.connections, config.threads, config.pipeline, seconds);
+  if (config.rate > 0) {
+    printf("开环模式，目标速率%.1f/秒，结束时未完成的请求: %llu\n",
+           config.rate, (unsigned long long)total.unfinished);
+  }
+  printf("请求: %llu (%.1f/秒)  接收: %.2fMB (%.2fMB/秒)\n",
+         (unsigned long long)total.requests, total.requests / seconds,
+         total.bytes / 1048576.0, total.bytes / 1048576.0 / seconds);
+  printf("非2xx响应: %llu  建立连接: %llu  连接失败: %llu  读写错误: %llu\n",
+         (unsigned long long)total.non_2xx, (unsigned long long)total.connects,
+         (unsigned long long)total.connect_errors, (unsigned long long)total.io_errors);
+  if (config.idle > 0 || config.slow > 0) {
+    printf("空闲连接: %d  慢速客户端: %d (接收%.2fMB)\n", background.idle_open, config.slow,
+           background.slow_bytes / 1048576.0);
+  }
+  printf("延迟(us): min %llu  mean %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+         (unsigned long long)h.Min(), h.Mean(),
+         (unsigned long long)h.Percentile(50), (unsigned long long)h.Percentile(90),
+         (unsigned long long)h.Percentile(99), (unsigned long long)h.Percentile(99.9),
+         (unsigned long long)h.Max());
+  if (config.rate > 0) {
+    // 从实际发送时间算起的延迟，与上面的差距就是请求在客户端等待发送的时间
+    printf("服务时间(us): mean %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           s.Mean(), (unsigned long long)s.Percentile(50), (unsigned long long)s.Percentile(90),
+           (unsigned long long)s.Percentile(99), (unsigned long long)s.Percentile(99.9),
+           (unsigned long long)s.Max());
+  }
+}
+
+// 按config压测一轮，返回所有线程合并后的统计
+Stats RunOnce(double* seconds) {
+  int64_t start = NowUs();
+  pthread_barrier_t ready;
+  pthread_barrier_init(&ready, NULL, config.threads);
+  std::vector<Worker*> workers;
+  std::vector<pthread_t> threads(config.threads);
+  for (int i = 0; i < config.threads; ++i) {
+    // 连接平均分配到各个线程，开环模式下速率按连接数分配
+    int n = config.connections / config.threads + (i < config.connections % config.threads);
+    workers.push_back(new Worker(n, (int64_t)config.duration * 1000000,
+                                 config.rate * n / config.connections, &ready));
+    pthread_create(&threads[i], NULL, WorkerMain, workers[i]);
+  }
+  Stats total;
+  int64_t first = INT64_MAX;
+  int64_t last = 0;
+  for (int i = 0; i < config.threads; ++i) {
+    pthread_join(threads[i], NULL);
+    total.Merge(workers[i]->GetStats());
+    first = std::min(first, workers[i]->StartUs());
+    last = std::max(last, workers[i]->EndUs());
+    delete workers[i];
+  }
+  pthread_barrier_destroy(&ready);
+  // 开环模式下不计建立连接的时间，但计入结束后等待请求完成的时间
+  *seconds = config.rate > 0 ? (last - first) / 1e6 : (NowUs() - start) / 1e6;
+  return total;
+}
+
+// 从start到stop逐步提高速率，每一步开环压测config.duration秒，输出延迟随速率的变化
+// 拐点为吞吐仍能跟上目标速率(>=95%)且p99不超过最低速率时5倍的最后一个速率
+void Sweep(double start, double stop, double step) {
+  if (!config.json) {
+    printf("%10s %10s %10s %10s %10s %10s %10s\n",
+           "目标/秒", "实际/秒", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "非2xx");
+  }
+  uint64_t base_p99 = 0;
+  double knee = 0;
+  bool saturated = false;
+  for (double rate = start; rate <= stop + 1e-9; rate += step) {
+    config.rate = rate;
+    double seconds;
+    Stats total = RunOnce(&seconds);
+    const LatencyHistogram& h = total.latency;
+    double achieved = total.requests / seconds;
+    if (config.json) {
+      PrintResult(total, seconds);
+    } else {
+      printf("%10.0f %10.1f %10llu %10llu %10llu %10llu %10llu\n", rate, achieved,
+             (unsigned long long)h.Percentile(50), (unsigned long long)h.Percentile(99),
+             (unsigned long long)h.Percentile(99.9), (unsigned long long)h.Max(),
+             (unsigned long long)total.non_2xx);
+    }
+    fflush(stdout);
+    if (base_p99 == 0) {
+      base_p99 = h.Percentile(99) > 0 ? h.Percentile(99) : 1;
+    }
+    if (!saturated && achieved >= rate * 0.95 && h.Percentile(99) <= base_p99 * 5) {
+      knee = rate;
+    } else {
+      saturated = true;
+    }
+    sleep(1);   // 让服务器处理完上一轮残留的连接
+  }
+  if (!config.json) {
+    if (knee > 0) {
+      printf("拐点: 约%.0f请求/秒\n", knee);
+    } else {
+      printf("最低的速率已经超过服务器的处理能力\n");
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* request_file = NULL;
+  int opt;
+  double sweep[3] = {0, 0, 0};
+  while ((opt = getopt(argc, argv, "c:t:d:p:f:CJR:S:I:L:")) != -1) {
+    switch (opt) {
+      case 'c': config.connections = atoi(optarg); break;
+      case 't': config.threads = atoi(optarg); break;
+      case 'd': config.duration = atoi(optarg); break;
+      case 'p': config.pipeline = atoi(optarg); break;
+      case 'f': request_file = optarg; break;
+      case 'C': config.close_each = true; break;
+      case 'J': config.json = true; break;
+      case 'R': config.rate = atof(optarg); break;
+      case 'I': config.idle = atoi(optarg); break;
+      case 'L': {
+        config.slow = atoi(optarg);
+        const char* colon = strchr(optarg, ':');
+        if (colon) {
+          config.slow_path = colon + 1;
+        }
+        break;
+      }
+      case 'S':
+        if (sscanf(optarg, "%lf:%lf:%lf", &sweep[0], &sweep[1], &sweep[2]) != 3 ||
+            sweep[0] <= 0 || sweep[1] < sweep[0] || sweep[2] <= 0) {
+          Usage(argv[0]);
+        }
+        break;
+      default: Usage(argv[0]);
+    }
+  }
+  if (optind >= argc || config.connections <= 0 || config.threads <= 0 || config.duration <= 0 ||
+      config.pipeline <= 0 || config.pipeline > MAX_PIPELINE || config.rate < 0 ||
+      config.idle < 0 || config.slow < 0) {
+    Usage(argv[0]);
+  }
+  if (config.threads > config.connections) {
+    config.threads = config.connections;
+  }
+  // 空闲连接较多时需要提高文件描述符的上限
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  std::string path;
+  int port;
+  if (!ParseUrl(argv[optind], &config.host, &port, &path)) {
+    fprintf(stderr, "只支持http://host:port/path格式的URL\n");
+    return 1;
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result;
+  if (getaddrinfo(config.host.c_str(), NULL, &hints, &result) != 0) {
+    fprintf(stderr, "无法解析主机%s\n", config.host.c_str());
+    return 1;
+  }
+  if (port != 80) {
+    config.host += ":" + std::to_string(port);   // Host头部带上端口
+  }
+  config.addr = *(sockaddr_in*)result->ai_addr;
+  config.addr.sin_port = htons(port);
+  freeaddrinfo(result);
+  if (!LoadRequests(request_file, path)) {
+    return 1;
+  }
+  if (config.slow_path.empty()) {
+    config.slow_path = path;
+  }
+
+  std::vector<int> idle = OpenIdle(config.idle);
+  background.idle_open = idle.size();
+  pthread_t slow_thread;
+  int64_t slow_deadline = NowUs() + (int64_t)config.duration * 1000000;
+  if (config.slow > 0) {
+    if (sweep[0] > 0) {
+      // 扫描时慢速客户端持续到所有速率测试完
+      int steps = (int)((sweep[1] - sweep[0]) / sweep[2]) + 1;
+      slow_deadline += (int64_t)steps * (config.duration + 1) * 1000000;
+    }
+    pthread_create(&slow_thread, NULL, SlowMain, &slow_deadline);
+  }
+
+  if (sweep[0] > 0) {
+    Sweep(sweep[0], sweep[1], sweep[2]);
+  } else {
+    double seconds;
+    Stats total = RunOnce(&seconds);
+    PrintResult(total, seconds);
+  }
+  if (config.slow > 0) {
+    pthread_join(slow_thread, NULL);
+  }
+  for (int fd : idle) {
+    close(fd);
+  }
+  return 0;
+}
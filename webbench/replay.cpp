@@ -0,0 +1,532 @@
+// 流量回放工具: 把服务器用-c录制的请求流量发回服务器
+// 录制文件中的每个连接在回放时对应一个新的连接，按原来的时间发送原始字节，
+// 保留了真实的URL分布、请求头大小、长连接上的请求数和流水线，用于评估缓存和解析的改动
+//
+// 用法: replay [选项] 录制文件 http://host:port
+//   -x 倍速(默认1，2表示以两倍的速度回放，0.5表示放慢一倍)
+//   -m 以最快速度回放: 忽略时间，每个连接收到已发送请求的全部响应后立即发送下一段数据
+//   -c 最快速度回放时同时进行的连接数(默认100)  -t 线程数(默认1)  -J 以JSON输出结果
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../capture.h"
+#include "histogram.h"
+#include "response_parser.h"
+
+namespace {
+
+const int64_t GRACE_US = 5000000;       // 最后一个事件之后等待响应的时间
+const int READ_CHUNK = 64 * 1024;
+
+// 录制的一个连接上的一个事件
+struct Step {
+  int64_t time_us;                      // 相对于录制中第一个事件的时间
+  uint16_t type;                        // CAPTURE_DATA或CAPTURE_CLOSE
+  std::string data;
+  int requests;                         // 在这段数据中结束的请求数(按空行计算)
+};
+
+struct Session {
+  int64_t start_us;
+  std::vector<Step> steps;
+};
+
+struct Config {
+  double speed = 1;
+  bool max_speed = false;
+  int concurrency = 100;
+  int threads = 1;
+  bool json = false;
+  sockaddr_in addr;
+};
+
+Config config;
+std::vector<Session> sessions;
+std::atomic<size_t> next_session(0);    // 最快速度回放时各线程共享的下一个会话
+
+int64_t NowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+struct Stats {
+  uint64_t sessions = 0;
+  uint64_t requests = 0;                // 收到响应的请求数
+  uint64_t sent = 0;                    // 发出的请求数
+  uint64_t bytes = 0;
+  uint64_t non_2xx = 0;
+  uint64_t errors = 0;                  // 连接失败或者出错时没有收到响应的请求数
+  uint64_t unsent = 0;                  // 服务器关闭连接后没有发出的请求数
+  LatencyHistogram latency;
+
+  void Merge(const Stats& s) {
+    sessions += s.sessions;
+    requests += s.requests;
+    sent += s.sent;
+    bytes += s.bytes;
+    non_2xx += s.non_2xx;
+    errors += s.errors;
+    unsent += s.unsent;
+    latency.Merge(s.latency);
+  }
+};
+
+// 回放中的一个连接
+struct Conn {
+  int fd = -1;
+  bool connected = false;
+  bool done = false;
+  const Session* session = NULL;
+  size_t next = 0;                      // 下一个要回放的事件
+  bool closing = false;                 // 已经回放到CLOSE，收到所有响应后关闭
+  std::string out;
+  size_t out_offset = 0;
+  std::deque<int64_t> pending;          // 已发送但还没有收到响应的请求的发送时间
+  ResponseParser parser;
+};
+
+class Worker {
+public:
+  // 按时间回放时sessions为分配给本线程的会话，最快速度回放时从全局的next_session中取
+  Worker(std::vector<const Session*> sessions, int64_t t0, int slots)
+    : sessions_(sessions), next_(0), t0_(t0), slots_(slots) {}
+  void Run();
+  const Stats& GetStats() const { return stats_; }
+
+private:
+  void Start(const Session* session);
+  void Advance(Conn* c, int64_t now);   // 回放到期的事件
+  bool Flush(Conn* c);
+  bool Read(Conn* c);
+  void Finish(Conn* c, bool error);
+  int64_t ToReal(int64_t capture_us) const { return t0_ + (int64_t)(capture_us / config.speed); }
+
+  std::vector<const Session*> sessions_;
+  size_t next_;
+  int64_t t0_;
+  int slots_;
+  int epollfd_;
+  std::vector<Conn*> active_;
+  std::vector<Conn*> finished_;         // 本轮事件处理完之后再释放
+  Stats stats_;
+  char buf_[READ_CHUNK];
+};
+
+void Worker::Start(const Session* session) {
+  Conn* c = new Conn;
+  c->session = session;
+  active_.push_back(c);
+  ++stats_.sessions;
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd < 0 || (connect(c->fd, (sockaddr*)&config.addr, sizeof(config.addr)) != 0 &&
+                    errno != EINPROGRESS)) {
+    Finish(c, true);
+    return;
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = c;
+  epoll_ctl(epollfd_, EPOLL_CTL_ADD, c->fd, &event);
+}
+
+void Worker::Advance(Conn* c, int64_t now) {
+  const std::vector<Step>& steps = c->session->steps;
+  while (!c->closing && c->next < steps.size()) {
+    const Step& step = steps[c->next];
+    if (config.max_speed) {
+      // 收到之前请求的全部响应后才发送下一段数据
+      if (!c->pending.empty() || !c->out.empty()) {
+        break;
+      }
+    } else if (ToReal(step.time_us) > now) {
+      break;
+    }
+    if (step.type == CAPTURE_CLOSE) {
+      c->closing = true;
+    } else {
+      c->out += step.data;
+      for (int i = 0; i < step.requests; ++i) {
+        c->pending.push_back(now);
+      }
+      stats_.sent += step.requests;
+    }
+    ++c->next;
+  }
+  if (c->connected && !Flush(c)) {
+    Finish(c, true);
+    return;
+  }
+  bool ended = c->closing || c->next == steps.size();
+  if (ended && c->pending.empty() && c->out.empty()) {
+    Finish(c, false);
+  }
+}
+
+bool Worker::Flush(Conn* c) {
+  while (c->out_offset < c->out.size()) {
+    ssize_t n = send(c->fd, c->out.data() + c->out_offset, c->out.size() - c->out_offset,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    c->out_offset += n;
+  }
+  c->out.clear();
+  c->out_offset = 0;
+  return true;
+}
+
+bool Worker::Read(Conn* c) {
+  while (true) {
+    ssize_t n = recv(c->fd, buf_, sizeof(buf_), 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      return false;
+    }
+    stats_.bytes += n;
+    bool ok = c->parser.Feed(buf_, n, [this, c](int status) {
+      if (c->pending.empty()) {
+        return false;   // 收到了没有请求的响应
+      }
+      int64_t latency = NowUs() - c->pending.front();
+      c->pending.pop_front();
+      stats_.latency.Record(latency > 0 ? latency : 0);
+      ++stats_.requests;
+      if (status < 200 || status >= 300) {
+        ++stats_.non_2xx;
+      }
+      return true;
+    });
+    if (!ok) {
+      return false;
+    }
+  }
+}
+
+void Worker::Finish(Conn* c, bool error) {
+  if (c->done) {
+    return;
+  }
+  c->done = true;
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  if (error || !c->pending.empty()) {
+    stats_.errors += c->pending.size();
+  }
+  // 服务器提前关闭了连接，录制中剩下的请求没有发出
+  for (size_t i = c->next; i < c->session->steps.size(); ++i) {
+    stats_.unsent += c->session->steps[i].requests;
+  }
+  finished_.push_back(c);
+}
+
+void Worker::Run() {
+  epollfd_ = epoll_create1(0);
+  epoll_event events[1024];
+  int64_t last_event = 0;   // 按时间回放时最后一个事件的时间
+  for (const Session* s : sessions_) {
+    if (!s->steps.empty()) {
+      last_event = std::max(last_event, ToReal(s->steps.back().time_us));
+    }
+  }
+  while (true) {
+    int64_t now = NowUs();
+    // 开始到时间的会话
+    if (config.max_speed) {
+      while ((int)active_.size() < slots_) {
+        size_t i = next_session.fetch_add(1);
+        if (i >= sessions.size()) {
+          break;
+        }
+        Start(&sessions[i]);
+      }
+    } else {
+      while (next_ < sessions_.size() && ToReal(sessions_[next_]->start_us) <= now) {
+        Start(sessions_[next_++]);
+      }
+    }
+    // 回放到期的事件，同时计算下一个事件的时间
+    int64_t wake = now + 100000;
+    if (!config.max_speed && next_ < sessions_.size()) {
+      wake = std::min(wake, ToReal(sessions_[next_]->start_us));
+    }
+    for (Conn* c : active_) {
+      if (!c->done) {
+        Advance(c, now);
+      }
+      if (!c->done && !config.max_speed && c->next < c->session->steps.size() && !c->closing) {
+        wake = std::min(wake, ToReal(c->session->steps[c->next].time_us));
+      }
+    }
+    for (Conn* c : finished_) {
+      active_.erase(std::find(active_.begin(), active_.end(), c));
+      delete c;
+    }
+    finished_.clear();
+    bool no_more = config.max_speed ? next_session.load() >= sessions.size()
+                                    : next_ >= sessions_.size();
+    if (no_more && active_.empty()) {
+      break;
+    }
+    if (!config.max_speed && now > last_event + GRACE_US) {
+      break;    // 服务器没有响应的请求记为错误
+    }
+    int timeout = wake > now ? (wake - now + 999) / 1000 : 0;
+    int num = epoll_wait(epollfd_, events, 1024, timeout);
+    for (int i = 0; i < num; ++i) {
+      Conn* c = (Conn*)events[i].data.ptr;
+      if (c->done) {
+        continue;
+      }
+      if (events[i].events & EPOLLERR) {
+        Finish(c, true);
+        continue;
+      }
+      if (!c->connected && (events[i].events & EPOLLOUT)) {
+        c->connected = true;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        if (!Read(c)) {
+          Finish(c, !c->pending.empty());
+          continue;
+        }
+      }
+      if (!Flush(c)) {
+        Finish(c, true);
+      }
+    }
+  }
+  for (Conn* c : active_) {
+    Finish(c, true);
+  }
+  for (Conn* c : finished_) {
+    delete c;
+  }
+  close(epollfd_);
+}
+
+void* WorkerMain(void* arg) {
+  ((Worker*)arg)->Run();
+  return NULL;
+}
+
+// 读取录制文件，按连接分组，时间以第一个事件为0
+bool LoadCapture(const char* path) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  CaptureHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.record_size != sizeof(CaptureRecord)) {
+    fprintf(stderr, "%s: 不是流量录制文件\n", path);
+    fclose(fp);
+    return false;
+  }
+  std::unordered_map<uint32_t, size_t> index;
+  std::unordered_map<uint32_t, std::string> tails;   // 每个连接已发送数据的最后3个字节
+  int64_t first = -1;
+  CaptureRecord record;
+  std::string data;
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    data.resize(record.len);
+    if (record.len > 0 && fread(&data[0], 1, record.len, fp) != record.len) {
+      break;    // 录制时被中断，最后一条不完整
+    }
+    if (first < 0) {
+      first = record.time_us;
+    }
+    int64_t time = record.time_us - first;
+    auto it = index.find(record.conn);
+    if (it == index.end()) {
+      if (record.type == CAPTURE_CLOSE) {
+        continue;   // 录制开始之前建立的空闲连接
+      }
+      it = index.emplace(record.conn, sessions.size()).first;
+      sessions.push_back(Session{time, {}});
+    }
+    if (record.type == CAPTURE_OPEN) {
+      continue;
+    }
+    Step step{time, record.type, std::string(), 0};
+    if (record.type == CAPTURE_DATA) {
+      // 按空行计算请求数(只适用于没有实体的请求)，空行可能跨越两次recv
+      std::string& tail = tails[record.conn];
+      std::string scan = tail + data;
+      for (size_t pos = scan.find("\r\n\r\n"); pos != std::string::npos;
+           pos = scan.find("\r\n\r\n", pos + 4)) {
+        ++step.requests;
+      }
+      tail = scan.size() > 3 ? scan.substr(scan.size() - 3) : scan;
+      step.data = data;
+    }
+    sessions[it->second].steps.push_back(std::move(step));
+  }
+  fclose(fp);
+  return true;
+}
+
+bool ParseTarget(const char* url) {
+  if (strncmp(url, "http://", 7) != 0) {
+    return false;
+  }
+  std::string authority = url + 7;
+  authority = authority.substr(0, authority.find('/'));
+  size_t colon = authority.find(':');
+  int port = 80;
+  if (colon != std::string::npos) {
+    port = atoi(authority.c_str() + colon + 1);
+    authority.resize(colon);
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result;
+  if (port <= 0 || getaddrinfo(authority.c_str(), NULL, &hints, &result) != 0) {
+    return false;
+  }
+  config.addr = *(sockaddr_in*)result->ai_addr;
+  config.addr.sin_port = htons(port);
+  freeaddrinfo(result);
+  return true;
+}
+
+void PrintResult(const Stats& total, double seconds) {
+  const LatencyHistogram& h = total.latency;
+  if (config.json) {
+    printf("{\"mode\":\"%s\",\"speed\":%.2f,\"seconds\":%.3f,\"sessions\":%llu,\"sent\":%llu,"
+           "\"requests\":%llu,\"rps\":%.1f,\"bytes\":%llu,\"non_2xx\":%llu,\"errors\":%llu,"
+           "\"unsent\":%llu,\"latency_us\":{\"min\":%llu,\"mean\":%.1f,\"p50\":%llu,"
+           "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+           config.max_speed ? "max" : "timed", config.speed, seconds,
+           (unsigned long long)total.sessions, (unsigned long long)total.sent,
+           (unsigned long long)total.requests, total.requests / seconds,
+           (unsigned long long)total.bytes, (unsigned long long)total.non_2xx,
+           (unsigned long long)total.errors, (unsigned long long)total.unsent,
+           (unsigned long long)h.Min(), h.Mean(),
+           (unsigned long long)h.Percentile(50), (unsigned long long)h.Percentile(90),
+           (unsigned long long)h.Percentile(99), (unsigned long long)h.Percentile(99.9),
+           (unsigned long long)h.Max());
+    return;
+  }
+  if (config.max_speed) {
+    printf("最快速度回放，%d个并发连接，%.1f秒\n", config.concurrency, seconds);
+  } else {
+    printf("按录制时间%.2f倍速回放，%.1f秒\n", config.speed, seconds);
+  }
+  printf("连接: %llu  发出请求: %llu  收到响应: %llu (%.1f/秒)  接收: %.2fMB\n",
+         (unsigned long long)total.sessions, (unsigned long long)total.sent,
+         (unsigned long long)total.requests, total.requests / seconds, total.bytes / 1048576.0);
+  printf("非2xx响应: %llu  没有响应: %llu  服务器关闭连接后未发出: %llu\n",
+         (unsigned long long)total.non_2xx, (unsigned long long)total.errors,
+         (unsigned long long)total.unsent);
+  printf("延迟(us): min %llu  mean %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+         (unsigned long long)h.Min(), h.Mean(),
+         (unsigned long long)h.Percentile(50), (unsigned long long)h.Percentile(90),
+         (unsigned long long)h.Percentile(99), (unsigned long long)h.Percentile(99.9),
+         (unsigned long long)h.Max());
+}
+
+void Usage(const char* name) {
+  fprintf(stderr, "用法: %s [-x 倍速 | -m [-c 并发连接数]] [-t 线程数] [-J] 录制文件 "
+          "http://host:port\n", name);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "x:mc:t:J")) != -1) {
+    switch (opt) {
+      case 'x': config.speed = atof(optarg); break;
+      case 'm': config.max_speed = true; break;
+      case 'c': config.concurrency = atoi(optarg); break;
+      case 't': config.threads = atoi(optarg); break;
+      case 'J': config.json = true; break;
+      default: Usage(argv[0]);
+    }
+  }
+  if (optind + 2 > argc || config.speed <= 0 || config.concurrency <= 0 || config.threads <= 0) {
+    Usage(argv[0]);
+  }
+  if (!ParseTarget(argv[optind + 1])) {
+    fprintf(stderr, "只支持http://host:port格式的地址\n");
+    return 1;
+  }
+  if (!LoadCapture(argv[optind])) {
+    return 1;
+  }
+  if (sessions.empty()) {
+    fprintf(stderr, "%s: 没有录制到连接\n", argv[optind]);
+    return 1;
+  }
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  int64_t start = NowUs();
+  std::vector<Worker*> workers;
+  std::vector<pthread_t> threads(config.threads);
+  for (int i = 0; i < config.threads; ++i) {
+    // 按时间回放时会话轮流分配给各个线程
+    std::vector<const Session*> mine;
+    if (!config.max_speed) {
+      for (size_t j = i; j < sessions.size(); j += config.threads) {
+        mine.push_back(&sessions[j]);
+      }
+    }
+    int slots = config.concurrency / config.threads + (i < config.concurrency % config.threads);
+    workers.push_back(new Worker(mine, start, slots > 0 ? slots : 1));
+    pthread_create(&threads[i], NULL, WorkerMain, workers[i]);
+  }
+  Stats total;
+  for (int i = 0; i < config.threads; ++i) {
+    pthread_join(threads[i], NULL);
+    total.Merge(workers[i]->GetStats());
+    delete workers[i];
+  }
+  PrintResult(total, (NowUs() - start) / 1e6);
+  return 0;
+}
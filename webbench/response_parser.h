@@ -0,0 +1,103 @@
+#ifndef LOADGEN_RESPONSE_PARSER_H_
+#define LOADGEN_RESPONSE_PARSER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+// HTTP响应流的增量解析(loadgen和replay共用)
+// 只解析状态码、Content-Length和Connection: close，响应实体直接跳过
+class ResponseParser {
+public:
+  static const size_t MAX_HEADER_SIZE = 16 * 1024;
+
+  ResponseParser() { Reset(); }
+
+  void Reset() {
+    header_.clear();
+    body_left_ = 0;
+    in_body_ = false;
+    status_ = 0;
+    server_close_ = false;
+  }
+
+  // 每解析完一个响应调用一次on_response(status)，回调返回false时停止解析
+  // 返回false表示回调要求停止或者响应头部过大
+  template <class F>
+  bool Feed(const char* data, size_t len, F on_response) {
+    while (len > 0) {
+      if (in_body_) {
+        size_t n = (int64_t)len < body_left_ ? len : body_left_;
+        body_left_ -= n;
+        data += n;
+        len -= n;
+        if (body_left_ == 0) {
+          in_body_ = false;
+          if (!on_response(status_)) {
+            return false;
+          }
+        }
+        continue;
+      }
+      // 头部可能分多次到达，先累积到header_中
+      size_t old = header_.size();
+      header_.append(data, len);
+      size_t pos = header_.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+      if (pos == std::string::npos) {
+        return header_.size() <= MAX_HEADER_SIZE;
+      }
+      size_t used = pos + 4 - old;
+      header_.resize(pos + 2);
+      int64_t content_length;
+      bool close;
+      ParseHeader(&content_length, &close);
+      server_close_ = server_close_ || close;
+      header_.clear();
+      data += used;
+      len -= used;
+      if (content_length > 0) {
+        in_body_ = true;
+        body_left_ = content_length;
+      } else if (!on_response(status_)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // 服务器在某个响应中带了Connection: close
+  bool ServerClose() const { return server_close_; }
+
+private:
+  // 解析响应头部中的状态码、Content-Length和Connection: close
+  void ParseHeader(int64_t* content_length, bool* close) {
+    status_ = 0;
+    *content_length = 0;
+    *close = false;
+    if (header_.size() > 12 && header_.compare(0, 5, "HTTP/") == 0) {
+      status_ = atoi(header_.c_str() + 9);
+    }
+    size_t pos = header_.find("\r\n");
+    while (pos != std::string::npos && pos + 2 < header_.size()) {
+      const char* line = header_.c_str() + pos + 2;
+      if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        *content_length = atoll(line + 15);
+      } else if (strncasecmp(line, "Connection:", 11) == 0) {
+        const char* value = line + 11;
+        value += strspn(value, " \t");
+        *close = strncasecmp(value, "close", 5) == 0;
+      }
+      pos = header_.find("\r\n", pos + 2);
+    }
+  }
+
+  std::string header_;
+  int64_t body_left_;
+  bool in_body_;
+  int status_;
+  bool server_close_;
+};
+
+#endif
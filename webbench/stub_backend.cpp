@@ -0,0 +1,269 @@
+// 测试反向代理用的上游服务器: 每个连接一个线程，支持长连接和流水线
+// 响应都带X-Backend: 端口号，用来检查负载均衡
+//
+// 用法: stub_backend 端口号，下面的路径可以带任意前缀
+//   /healthz          200 ok
+//   /bytes/N          N个字节的实体(Content-Length)
+//   /chunked/N        N个字节的实体，chunked编码，每块4096字节
+//   /close/N          N个字节的实体，没有长度，发送完关闭连接
+//   /echo             回显请求实体(Content-Length或者chunked编码)
+//   /count            回复请求实体的字节数和校验和(FNV-1a)
+//   /status/NNN       指定状态码，没有实体
+//   /slow/MS          等待MS毫秒之后回复ok
+//   其他路径          回复请求行
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+namespace {
+
+int port = 0;
+
+bool SendAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+std::string Filler(long n) {
+  std::string body(n, 'x');
+  for (long i = 0; i < n; i += 64) {
+    body[i] = '\n';
+  }
+  return body;
+}
+
+// 代理转发时路径前面还有前缀(如/api/bytes/100)，arg返回名字之后的部分
+bool Endpoint(const std::string& path, const char* name, const char** arg) {
+  size_t pos = path.find(name);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  *arg = path.c_str() + pos + strlen(name);
+  return true;
+}
+
+// 保证buf中pos之后有一个完整的行，eol返回行尾(\r\n)的位置，不够时从fd读取
+bool ReadLine(int fd, std::string* buf, size_t pos, size_t* eol) {
+  char chunk[16384];
+  while ((*eol = buf->find("\r\n", pos)) == std::string::npos) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buf->append(chunk, n);
+  }
+  return true;
+}
+
+// buf的开头是一个chunked编码的实体(不够时从fd读取)，解码后放在body中，buf中留下后面的数据
+bool ReadChunked(int fd, std::string* buf, std::string* body) {
+  char chunk[16384];
+  size_t eol;
+  while (true) {
+    if (!ReadLine(fd, buf, 0, &eol)) {
+      return false;
+    }
+    size_t size = strtoul(buf->c_str(), NULL, 16);
+    buf->erase(0, eol + 2);
+    if (size == 0) {
+      break;
+    }
+    while (buf->size() < size + 2) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        return false;
+      }
+      buf->append(chunk, n);
+    }
+    body->append(*buf, 0, size);
+    buf->erase(0, size + 2);
+  }
+  // 尾部(trailer)以空行结束
+  do {
+    if (!ReadLine(fd, buf, 0, &eol)) {
+      return false;
+    }
+    buf->erase(0, eol + 2);
+  } while (eol != 0);
+  return true;
+}
+
+// 生成一个响应，返回false表示发送完之后关闭连接
+bool Respond(int fd, const std::string& method, const std::string& path, const std::string& body,
+             bool keep_alive) {
+  char head[256];
+  int status = 200;
+  std::string out;
+  std::string content;
+  bool with_length = true;
+  bool chunked = false;
+  const char* arg;
+  if (Endpoint(path, "/healthz", &arg)) {
+    content = "ok\n";
+  } else if (Endpoint(path, "/bytes/", &arg)) {
+    content = Filler(atol(arg));
+  } else if (Endpoint(path, "/chunked/", &arg)) {
+    content = Filler(atol(arg));
+    chunked = true;
+  } else if (Endpoint(path, "/close/", &arg)) {
+    content = Filler(atol(arg));
+    with_length = false;
+    keep_alive = false;
+  } else if (Endpoint(path, "/echo", &arg)) {
+    content = body;
+  } else if (Endpoint(path, "/count", &arg)) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : body) {
+      hash = (hash ^ c) * 1099511628211ULL;
+    }
+    char text[64];
+    snprintf(text, sizeof(text), "%zu %016llx\n", body.size(), (unsigned long long)hash);
+    content = text;
+  } else if (Endpoint(path, "/status/", &arg)) {
+    status = atoi(arg);
+  } else if (Endpoint(path, "/slow/", &arg)) {
+    usleep(atoi(arg) * 1000);
+    content = "ok\n";
+  } else {
+    content = method + " " + path + "\n";
+  }
+  bool no_body = method == "HEAD" || status == 204 || status == 304;
+  int len = snprintf(head, sizeof(head), "HTTP/1.1 %d Stub\r\nX-Backend: %d\r\nContent-Type: text/plain\r\n%s",
+                     status, port, keep_alive ? "" : "Connection: close\r\n");
+  out.assign(head, len);
+  if (chunked) {
+    out += "Transfer-Encoding: chunked\r\n\r\n";
+    for (size_t i = 0; !no_body && i < content.size(); i += 4096) {
+      size_t n = content.size() - i < 4096 ? content.size() - i : 4096;
+      len = snprintf(head, sizeof(head), "%zx\r\n", n);
+      out.append(head, len);
+      out.append(content, i, n);
+      out += "\r\n";
+    }
+    if (!no_body) {
+      out += "0\r\n\r\n";
+    }
+  } else {
+    if (with_length) {
+      len = snprintf(head, sizeof(head), "Content-Length: %zu\r\n", content.size());
+      out.append(head, len);
+    }
+    out += "\r\n";
+    if (!no_body) {
+      out += content;
+    }
+  }
+  return SendAll(fd, out.data(), out.size()) && keep_alive;
+}
+
+void* Serve(void* arg) {
+  int fd = (int)(long)arg;
+  std::string buf;
+  char chunk[16384];
+  while (true) {
+    size_t end = buf.find("\r\n\r\n");
+    if (end == std::string::npos) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) {
+        break;
+      }
+      buf.append(chunk, n);
+      continue;
+    }
+    std::string head = buf.substr(0, end + 2);
+    size_t content_length = 0;
+    bool chunked = false;
+    bool keep_alive = head.find("HTTP/1.1\r\n") != std::string::npos;
+    for (size_t pos = head.find("\r\n") + 2; pos < head.size(); pos = head.find("\r\n", pos) + 2) {
+      const char* line = head.c_str() + pos;
+      if (strncasecmp(line, "Content-Length:", 15) == 0) {
+        content_length = atol(line + 15);
+      } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+        chunked = strstr(line, "chunked") != NULL;
+      } else if (strncasecmp(line, "Connection:", 11) == 0) {
+        keep_alive = strncasecmp(line + 11 + strspn(line + 11, " "), "close", 5) != 0;
+      }
+    }
+    size_t sp1 = head.find(' ');
+    size_t sp2 = head.find(' ', sp1 + 1);
+    std::string method = head.substr(0, sp1);
+    std::string path = head.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string body;
+    if (chunked) {
+      buf.erase(0, end + 4);
+      if (!ReadChunked(fd, &buf, &body)) {
+        break;
+      }
+    } else {
+      while (buf.size() < end + 4 + content_length) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+          close(fd);
+          return NULL;
+        }
+        buf.append(chunk, n);
+      }
+      body = buf.substr(end + 4, content_length);
+      buf.erase(0, end + 4 + content_length);
+    }
+    if (!Respond(fd, method, path, body, keep_alive)) {
+      break;
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s port\n", argv[0]);
+    return 1;
+  }
+  port = atoi(argv[1]);
+  signal(SIGPIPE, SIG_IGN);
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listenfd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenfd, SOMAXCONN) < 0) {
+    perror("bind");
+    return 1;
+  }
+  while (true) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, Serve, (void*)(long)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}